@@ -0,0 +1,302 @@
+// Benchmark harness for the filesystem builtins. Builds synthetic trees in a
+// temporary directory, runs ls, ls -l, ls -R, cp -r, mv and rm -rf on them
+// through the Shell class and prints the results as JSON.
+//
+//   ./myShell_bench [--scale N] [--repeat N] [--dir PATH]
+
+#define MYSHELL_NO_MAIN
+#include "myShell.cpp"
+
+namespace {
+
+// Process-wide counters sampled before and after each command. /proc/self/io
+// counts read- and write-type system calls for all threads of the process.
+struct Counters {
+    std::chrono::steady_clock::time_point wall;
+    double cpuSeconds = 0;
+    uint64_t readSyscalls = 0;
+    uint64_t writeSyscalls = 0;
+};
+
+Counters sampleCounters() {
+    Counters counters;
+    counters.wall = std::chrono::steady_clock::now();
+
+    struct rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                              + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+
+    FileDescriptor fd(::open("/proc/self/io", O_RDONLY | O_CLOEXEC));
+    char text[512];
+    ssize_t n = fd.get() < 0 ? -1 : ::read(fd.get(), text, sizeof(text) - 1);
+    if (n > 0) {
+        text[n] = '\0';
+        if (const char* field = std::strstr(text, "syscr: ")) {
+            counters.readSyscalls = std::strtoull(field + 7, nullptr, 10);
+        }
+        if (const char* field = std::strstr(text, "syscw: ")) {
+            counters.writeSyscalls = std::strtoull(field + 7, nullptr, 10);
+        }
+    }
+    return counters;
+}
+
+// Size of a generated tree, used to turn times into rates
+struct TreeStats {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    // Entries directly in the root, which is all a plain ls reads
+    uint64_t rootEntries = 0;
+};
+
+void writeFile(const std::string& path, size_t size, TreeStats& stats) {
+    static const std::string block(1 << 20, 'x');
+    FileDescriptor fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd.get() < 0) {
+        throw fs::filesystem_error("cannot create", path, std::error_code(errno, std::generic_category()));
+    }
+    for (size_t written = 0; written < size;) {
+        size_t chunk = std::min(block.size(), size - written);
+        ssize_t n = ::write(fd.get(), block.data(), chunk);
+        if (n <= 0) {
+            throw fs::filesystem_error("cannot write", path, std::error_code(errno, std::generic_category()));
+        }
+        written += n;
+    }
+    ++stats.files;
+    stats.bytes += size;
+}
+
+void makeDirectory(const std::string& path) {
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw fs::filesystem_error("cannot create directory", path, std::error_code(errno, std::generic_category()));
+    }
+}
+
+// Many small files spread over a few directories
+TreeStats makeSmallFiles(const std::string& root, unsigned int scale) {
+    TreeStats stats;
+    makeDirectory(root);
+    for (unsigned int d = 0; d < 20 * scale; ++d) {
+        std::string dir = root + "/d" + std::to_string(d);
+        makeDirectory(dir);
+        for (unsigned int f = 0; f < 500; ++f) {
+            writeFile(dir + "/f" + std::to_string(f), 1024, stats);
+        }
+    }
+    stats.rootEntries = 20 * scale;
+    return stats;
+}
+
+// A few large files, where data transfer dominates
+TreeStats makeHugeFiles(const std::string& root, unsigned int scale) {
+    TreeStats stats;
+    makeDirectory(root);
+    for (unsigned int f = 0; f < 4 * scale; ++f) {
+        writeFile(root + "/huge" + std::to_string(f), 64u << 20, stats);
+    }
+    stats.rootEntries = stats.files;
+    return stats;
+}
+
+// A long chain of directories with a few files at every level
+TreeStats makeDeepTree(const std::string& root, unsigned int scale) {
+    TreeStats stats;
+    std::string dir = root;
+    makeDirectory(dir);
+    for (unsigned int level = 0; level < 64 * scale; ++level) {
+        for (unsigned int f = 0; f < 4; ++f) {
+            writeFile(dir + "/f" + std::to_string(f), 256, stats);
+        }
+        dir += "/l" + std::to_string(level);
+        makeDirectory(dir);
+    }
+    stats.rootEntries = 5;
+    return stats;
+}
+
+// One directory with a large number of empty files
+TreeStats makeWideDirectory(const std::string& root, unsigned int scale) {
+    TreeStats stats;
+    makeDirectory(root);
+    for (unsigned int f = 0; f < 50000 * scale; ++f) {
+        writeFile(root + "/entry" + std::to_string(f), 0, stats);
+    }
+    stats.rootEntries = stats.files;
+    return stats;
+}
+
+struct Result {
+    std::string tree;
+    std::string command;
+    double seconds;
+    double cpuSeconds;
+    uint64_t readSyscalls;
+    uint64_t writeSyscalls;
+    int status;
+};
+
+class Bench {
+
+public:
+    Bench(std::string directory, unsigned int repeat) : directory(std::move(directory)), repeat(repeat) {
+        sink.reset(::open("/dev/null", O_WRONLY | O_CLOEXEC));
+    }
+
+    void run(const std::string& name, TreeStats (*generate)(const std::string&, unsigned int), unsigned int scale) {
+        std::string tree = directory + "/" + name;
+        TreeStats stats = generate(tree, scale);
+        treeStats.emplace_back(name, stats);
+
+        std::string moved = directory + "/moved";
+        makeDirectory(moved);
+        measure(name, "ls", "ls " + tree);
+        measure(name, "ls -l", "ls -l " + tree);
+        measure(name, "ls -R", "ls -R " + tree);
+        for (unsigned int i = 0; i < repeat; ++i) {
+            // Every round needs a fresh copy to move and remove
+            measureOnce(name, "cp -r", "cp -r " + tree + " " + directory + "/copy");
+            measureOnce(name, "mv", "mv " + directory + "/copy " + moved);
+            measureOnce(name, "rm -rf", "rm -rf " + moved + "/copy");
+        }
+        StageRedirect redirect(-1, sink.get());
+        shell.runCommandString("rm -rf " + tree);
+        shell.runCommandString("rm -rf " + moved);
+    }
+
+    void print() {
+        OutputWriter& writer = out();
+        writer << "{\n  \"threads\": " << defaultThreadCount()
+               << ",\n  \"io_uring\": " << (IoUring::forThread() != nullptr ? "true" : "false")
+               << ",\n  \"repeat\": " << repeat << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& result = results[i];
+            TreeStats stats = statsFor(result.tree);
+            // mv is a rename per entry, so only its file rate is meaningful
+            bool movesData = result.command == "cp -r";
+            bool rootOnly = result.command == "ls" || result.command == "ls -l";
+            uint64_t files = rootOnly ? stats.rootEntries : stats.files;
+            double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+            writer << (i == 0 ? "\n" : ",\n")
+                   << "    {\"tree\": \"" << result.tree << "\", \"command\": \"" << result.command << "\""
+                   << ", \"files\": " << files << ", \"bytes\": " << stats.bytes
+                   << ", \"seconds\": " << fixed(result.seconds, 6)
+                   << ", \"cpu_seconds\": " << fixed(result.cpuSeconds, 6)
+                   << ", \"files_per_sec\": " << fixed(files / seconds, 0)
+                   << ", \"mb_per_sec\": " << fixed(movesData ? stats.bytes / (1024.0 * 1024.0) / seconds : 0.0, 1)
+                   << ", \"read_syscalls\": " << result.readSyscalls
+                   << ", \"write_syscalls\": " << result.writeSyscalls
+                   << ", \"status\": " << result.status << "}";
+        }
+        writer << "\n  ]\n}\n";
+        writer.flush();
+    }
+
+private:
+    // Best of `repeat` runs
+    void measure(const std::string& tree, const std::string& label, const std::string& command) {
+        for (unsigned int i = 0; i < repeat; ++i) {
+            measureOnce(tree, label, command);
+        }
+    }
+
+    void measureOnce(const std::string& tree, const std::string& label, const std::string& command) {
+        Counters before;
+        Counters after;
+        int status;
+        {
+            StageRedirect redirect(-1, sink.get());
+            before = sampleCounters();
+            status = shell.runCommandString(command);
+            after = sampleCounters();
+        }
+
+        Result result{tree, label, std::chrono::duration<double>(after.wall - before.wall).count(),
+                      after.cpuSeconds - before.cpuSeconds, after.readSyscalls - before.readSyscalls,
+                      after.writeSyscalls - before.writeSyscalls, status};
+        for (Result& existing : results) {
+            if (existing.tree == tree && existing.command == label) {
+                if (result.seconds < existing.seconds) {
+                    existing = result;
+                }
+                return;
+            }
+        }
+        results.push_back(result);
+    }
+
+    TreeStats statsFor(const std::string& tree) const {
+        for (const auto& entry : treeStats) {
+            if (entry.first == tree) {
+                return entry.second;
+            }
+        }
+        return TreeStats();
+    }
+
+    std::string directory;
+    unsigned int repeat;
+    Shell shell;
+    FileDescriptor sink;
+    std::vector<Result> results;
+    std::vector<std::pair<std::string, TreeStats>> treeStats;
+};
+
+bool parseCount(const char* text, unsigned int& value) {
+    std::string_view view(text);
+    auto result = std::from_chars(view.data(), view.data() + view.size(), value);
+    return result.ec == std::errc() && result.ptr == view.data() + view.size() && value > 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    unsigned int scale = 1;
+    unsigned int repeat = 3;
+    std::string parent = getenv("TMPDIR") != nullptr ? getenv("TMPDIR") : "/tmp";
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        bool valid = i + 1 < argc;
+        if (arg == "--scale" && valid) {
+            valid = parseCount(argv[++i], scale);
+        } else if (arg == "--repeat" && valid) {
+            valid = parseCount(argv[++i], repeat);
+        } else if (arg == "--dir" && valid) {
+            parent = argv[++i];
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            out() << "Usage: " << argv[0] << " [--scale N] [--repeat N] [--dir PATH]" << '\n';
+            out().flush();
+            return 2;
+        }
+    }
+
+    std::string pattern = parent + "/myshell-bench-XXXXXX";
+    if (::mkdtemp(pattern.data()) == nullptr) {
+        out() << "Error: cannot create " << pattern << ": " << std::strerror(errno) << '\n';
+        out().flush();
+        return 1;
+    }
+
+    int status = 0;
+    try {
+        Bench bench(pattern, repeat);
+        bench.run("small_files", makeSmallFiles, scale);
+        bench.run("huge_files", makeHugeFiles, scale);
+        bench.run("deep_tree", makeDeepTree, scale);
+        bench.run("wide_directory", makeWideDirectory, scale);
+        bench.print();
+    } catch (const fs::filesystem_error& ex) {
+        out() << "Error: " << ex.what() << '\n';
+        out().flush();
+        status = 1;
+    }
+
+    std::error_code ec;
+    fs::remove_all(pattern, ec);
+    return status;
+}
@@ -1,597 +1,8892 @@
-#include <iostream>
-#include <vector>
-#include <sstream>
-#include <cstdlib>
-#include <filesystem>
-#include <iomanip>
-#include <algorithm>
-#include <ctime>
-#include <chrono>
-
-namespace fs = std::filesystem;
-
-class Shell {
-
-public:
-    void run() {
-        std::string input;
-        while (true) {
-            std::cout << "MyShell> ";
-            std::getline(std::cin, input);
-
-            if (input == "exit") {
-                break;
-            }
-
-            executeCommand(input);
-        }
-    }
-
-private:
-    void executeCommand(const std::string& input) {
-        std::vector<std::string> tokens = tokenize(input);
-
-        if (tokens.empty()) {
-            return;
-        }
-
-        std::string command = tokens[0];
-        if (command == "cd") {
-            changeDirectory(tokens);
-        } else if (command == "ls") {
-            listDirectory(tokens);
-        } else if (command == "mv") {
-            moveFile(tokens);
-        } else if (command == "rm") {
-            removeFile(tokens);
-        } else if (command == "cp") {
-            copyFile(tokens);
-        } else {
-            std::cout << "Unknown command: " << command << std::endl;
-        }
-    }
-
-    std::vector<std::string> tokenize(const std::string& input) {
-        std::vector<std::string> tokens;
-        std::istringstream iss(input);
-        std::string token;
-        while (iss >> token) {
-            tokens.push_back(token);
-        }
-        return tokens;
-    }
-
-     void changeDirectory(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 2) {
-            std::cout << "Usage: cd [options] <directory>" << std::endl;
-            return;
-        }
-
-        std::string option = tokens[1];
-
-        if (option == "--help") {
-            displayCdHelp();
-            return;
-        }
-
-        fs::path targetDir;
-
-        if (option == "~" || option == "~username") {
-            // Go to home directory or specified user's home directory
-            targetDir = getHomeDirectory(option);
-        } else if (option == ".") {
-            // Stay in the current directory
-            targetDir = ".";
-        } else {
-            // Go to a subdirectory
-            targetDir = option;
-        }
-
-        if (fs::exists(targetDir) && fs::is_directory(targetDir)) {
-            fs::current_path(targetDir);
-        } else {
-            std::cout << "Directory does not exist: " << targetDir.string() << std::endl;
-        }
-    }
-
-    void displayCdHelp() {
-        std::cout << "Usage: cd [options] <directory>" << std::endl;
-        std::cout << "Options:" << std::endl;
-        std::cout << "  ~ or ~username      Go to home directory or specified user's home directory" << std::endl;
-        std::cout << "  .                   Stay in the current directory" << std::endl;
-        std::cout << "  dir                 Go to a subdirectory" << std::endl;
-        std::cout << "  --help              Display this help message" << std::endl;
-    }
-
-    fs::path getHomeDirectory(const std::string& option) {
-        // Get the home directory path
-        if (option == "~") {
-            return fs::path(getenv("HOME"));
-        } else if (option.substr(0, 2) == "~/") {
-            // Get the home directory of the specified user
-            std::string username = option.substr(2);
-            return fs::path("/home/" + username);
-        } else {
-            return fs::path(getenv("HOME")); // Default to user's home directory
-        }
-    }
-
-
-        void listDirectory(const std::vector<std::string>& tokens) {
-        fs::path dirPath = ".";
-        bool longFormat = false;
-        bool reverseOrder = false;
-        bool recursive = false;
-
-        // Check for options
-        for (size_t i = 1; i < tokens.size(); ++i) {
-            if (tokens[i] == "-l") {
-                longFormat = true;
-            } else if (tokens[i] == "-r") {
-                reverseOrder = true;
-            } else if (tokens[i] == "-R") {
-                recursive = true;
-            } else if (tokens[i] == "~") {
-                dirPath = getenv("HOME");
-            } else if (tokens[i] == "../") {
-                dirPath = "..";
-            } else if (tokens[i] == "--help") {
-                displayLsHelp();
-                return;
-            } else {
-                dirPath = tokens[i];
-            }
-        }
-
-        try {
-            if (fs::exists(dirPath) && fs::is_directory(dirPath)) {
-                if (recursive) {
-                    listDirectoryRecursive(dirPath, longFormat, reverseOrder);
-                } else {
-                    listDirectorySimple(dirPath, longFormat, reverseOrder);
-                }
-            } else {
-                std::cout << "Directory does not exist: " << dirPath.string() << std::endl;
-            }
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-
-    void listDirectorySimple(const fs::path& dirPath, bool longFormat, bool reverseOrder) {
-        std::vector<fs::path> entries;
-
-        for (const auto& entry : fs::directory_iterator(dirPath)) {
-            entries.push_back(entry.path());
-        }
-
-        if (reverseOrder) {
-            std::reverse(entries.begin(), entries.end());
-        }
-
-        for (const auto& entry : entries) {
-            if (longFormat) {
-                displayLongFormat(entry);
-            } else {
-                std::cout << entry.filename().string() << std::endl;
-            }
-        }
-    }
-
-    void listDirectoryRecursive(const fs::path& dirPath, bool longFormat, bool reverseOrder) {
-        for (const auto& entry : fs::recursive_directory_iterator(dirPath)) {
-            if (longFormat) {
-                displayLongFormat(entry.path());
-            } else {
-                std::cout << entry.path().string() << std::endl;
-            }
-        }
-    }
-
-    void displayLongFormat(const fs::path& filePath) {
-        try {
-            auto status = fs::status(filePath);
-            std::string type;
-            std::string perms;
-
-            switch (status.type()) {
-                case fs::file_type::regular:
-                    type = "-";
-                    break;
-                case fs::file_type::directory:
-                    type = "d";
-                    break;
-                case fs::file_type::symlink:
-                    type = "l";
-                    break;
-                default:
-                    type = "?";
-                    break;
-            }
-
-            perms += (status.permissions() & fs::perms::owner_read) != fs::perms::none ? "r" : "-";
-            perms += (status.permissions() & fs::perms::owner_write) != fs::perms::none ? "w" : "-";
-            perms += (status.permissions() & fs::perms::owner_exec) != fs::perms::none ? "x" : "-";
-            perms += (status.permissions() & fs::perms::group_read) != fs::perms::none ? "r" : "-";
-            perms += (status.permissions() & fs::perms::group_write) != fs::perms::none ? "w" : "-";
-            perms += (status.permissions() & fs::perms::group_exec) != fs::perms::none ? "x" : "-";
-            perms += (status.permissions() & fs::perms::others_read) != fs::perms::none ? "r" : "-";
-            perms += (status.permissions() & fs::perms::others_write) != fs::perms::none ? "w" : "-";
-            perms += (status.permissions() & fs::perms::others_exec) != fs::perms::none ? "x" : "-";
-
-            auto lastWriteTime = fs::last_write_time(filePath);
-            auto writeTime = std::chrono::time_point_cast<std::chrono::system_clock::duration>(lastWriteTime);
-           // auto time_t_writeTime = std::chrono::system_clock::to_time_t(writeTime);
-
-            std::cout << type << perms << " "
-                      //<< fs::hard_link_count(status) << " "
-                      << fs::file_size(filePath) << " "
-                     // << std::put_time(std::localtime(&time_t_writeTime), "%m/%d %H:%M") << " "
-                      << filePath.filename().string() << std::endl;
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-
-    void displayLsHelp() {
-        std::cout << "Usage: ls [options] <directory>" << std::endl;
-        std::cout << "Options:" << std::endl;
-        std::cout << "  -l                Show list in long format" << std::endl;
-        std::cout << "  -r                Print list in reverse order" << std::endl;
-        std::cout << "  -R                Display content of sub-directories also" << std::endl;
-        std::cout << "  ~                 Give the contents of home directory" << std::endl;
-        std::cout << "  ../               Give the contents of parent directory" << std::endl;
-        std::cout << "  --help            Display this help message" << std::endl;
-    }
-
-    void moveFile(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 3) {
-            std::cout << "Usage: mv [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        std::vector<std::string> options;
-        fs::path source;
-        fs::path destination;
-
-        // Separate options, source, and destination
-        size_t i = 1;
-        while (i < tokens.size() && tokens[i].substr(0, 1) == "-") {
-            options.push_back(tokens[i]);
-            ++i;
-        }
-
-        if (i < tokens.size()) {
-            source = tokens[i];
-            ++i;
-        } else {
-            std::cout << "Usage: mv [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        if (i < tokens.size()) {
-            destination = tokens[i];
-        } else {
-            std::cout << "Usage: mv [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        performMove(options, source, destination);
-    }
-
-    void performMove(const std::vector<std::string>& options, const fs::path& source, const fs::path& destination) {
-        try {
-            bool interactive = false;
-            bool wildcard = false;
-            bool suffixBackup = false;
-            bool onlyIfNotExists = false;
-
-            // Process options
-            for (const std::string& opt : options) {
-                if (opt == "-i") {
-                    interactive = true;
-                } else if (opt == "*") {
-                    wildcard = true;
-                } else if (opt == "--suffix") {
-                    suffixBackup = true;
-                } else if (opt == "-u") {
-                    onlyIfNotExists = true;
-                } else if (opt == "--help") {
-                    std::cout << "Usage: mv [options] <source> <destination>" << std::endl;
-                    std::cout << "Options:" << std::endl;
-                    std::cout << "  -i            Ask for permission to overwrite" << std::endl;
-                    std::cout << "  *             Move multiple files to a specific directory" << std::endl;
-                    std::cout << "  --suffix      Take backup before overwriting" << std::endl;
-                    std::cout << "  -u            Only move those files that don't exist" << std::endl;
-                    return;
-                } else {
-                    std::cout << "Unknown option: " << opt << std::endl;
-                    return;
-                }
-            }
-
-            if (wildcard) {
-                moveFilesWithWildcard(source, destination);
-            } else {
-                moveSingleFile(source, destination, interactive, suffixBackup, onlyIfNotExists);
-            }
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-
-    void moveSingleFile(const fs::path& source, const fs::path& destination, bool interactive, bool suffixBackup, bool onlyIfNotExists) {
-        if (onlyIfNotExists && fs::exists(destination / source.filename())) {
-            std::cout << "File already exists at the destination: " << destination.string() << std::endl;
-            return;
-        }
-
-        if (interactive && fs::exists(destination / source.filename())) {
-            std::string response;
-            std::cout << "Destination file already exists. Overwrite? (y/n): ";
-            std::getline(std::cin, response);
-            if (response != "y") {
-                std::cout << "Move operation canceled." << std::endl;
-                return;
-            }
-        }
-
-        fs::path destinationPath = destination / source.filename();
-
-        if (suffixBackup) {
-            // Create a backup by appending a suffix to the filename
-            fs::path backupPath = destination / (source.filename().stem().string() + "_backup" + source.filename().extension().string());
-            fs::rename(destinationPath, backupPath);
-        }
-
-        fs::rename(source, destinationPath);
-        std::cout << "Moved: " << source << " to " << destination << std::endl;
-    }
-
-    void moveFilesWithWildcard(const fs::path& source, const fs::path& destination) {
-        for (const auto& entry : fs::directory_iterator(source)) {
-            moveSingleFile(entry.path(), destination, false, false, false);
-        }
-    }
-
-    void removeFile(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 2) {
-            std::cout << "Usage: rm [options] <file/directory>" << std::endl;
-            return;
-        }
-
-        std::vector<std::string> options;
-        fs::path fileOrDir;
-
-        // Separate options and file/directory
-        size_t i = 1;
-        while (i < tokens.size() && tokens[i].substr(0, 1) == "-") {
-            options.push_back(tokens[i]);
-            ++i;
-        }
-
-        if (i < tokens.size()) {
-            fileOrDir = tokens[i];
-        } else {
-            std::cout << "Usage: rm [options] <file/directory>" << std::endl;
-            return;
-        }
-
-        performRemove(options, fileOrDir);
-    }
-
-    void performRemove(const std::vector<std::string>& options, const fs::path& fileOrDir) {
-        try {
-            bool recursive = false;
-            bool interactive = false;
-            bool force = false;
-            bool forceRecursive = false;
-
-            // Process options
-            for (const std::string& opt : options) {
-                if (opt == "-r" || opt == "-R") {
-                    recursive = true;
-                } else if (opt == "-i") {
-                    interactive = true;
-                } else if (opt == "-rf") {
-                    forceRecursive = true;
-                } else if (opt == "-f") {
-                    force = true;
-                } else if (opt == "--help") {
-                    std::cout << "Usage: rm [options] <file/directory>" << std::endl;
-                    std::cout << "Options:" << std::endl;
-                    std::cout << "  -r, -R        Remove directory recursively" << std::endl;
-                    std::cout << "  -i            Remove file interactively" << std::endl;
-                    std::cout << "  -rf           Remove directory forcefully" << std::endl;
-                    std::cout << "  -f            Force removal, ignores non-existent files and overrides prompts" << std::endl;
-                    return;
-                } else {
-                    std::cout << "Unknown option: " << opt << std::endl;
-                    return;
-                }
-            }
-
-            if (recursive && forceRecursive) {
-                std::cout << "Error: Options -r and -rf are mutually exclusive." << std::endl;
-                return;
-            }
-
-            if (forceRecursive) {
-                removeDirectoryForcefully(fileOrDir);
-            } else if (recursive) {
-                removeDirectoryRecursively(fileOrDir);
-            } else if (force) {
-                removeFileForcefully(fileOrDir);
-            } else if (interactive) {
-                removeFileInteractively(fileOrDir);
-            } else {
-                removeFileOrDirectory(fileOrDir);
-            }
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-
-    void removeFileOrDirectory(const fs::path& fileOrDir) {
-        if (fs::exists(fileOrDir)) {
-            if (fs::is_directory(fileOrDir)) {
-                fs::remove(fileOrDir);
-                std::cout << "Removed directory: " << fileOrDir << std::endl;
-            } else {
-                fs::remove(fileOrDir);
-                std::cout << "Removed file: " << fileOrDir << std::endl;
-            }
-        } else {
-            std::cout << "File or directory does not exist: " << fileOrDir << std::endl;
-        }
-    }
-
-    void removeFileInteractively(const fs::path& file) {
-        if (fs::exists(file)) {
-            std::string response;
-            std::cout << "Are you sure you want to remove '" << file << "'? (y/n): ";
-            std::getline(std::cin, response);
-            if (response == "y") {
-                fs::remove(file);
-                std::cout << "Removed file: " << file << std::endl;
-            } else {
-                std::cout << "Removal canceled." << std::endl;
-            }
-        } else {
-            std::cout << "File does not exist: " << file << std::endl;
-        }
-    }
-
-    void removeFileForcefully(const fs::path& file) {
-        if (fs::exists(file)) {
-            fs::remove(file);
-            std::cout << "Removed file: " << file << std::endl;
-        } else {
-            std::cout << "File does not exist: " << file << std::endl;
-        }
-    }
-
-    void removeDirectoryRecursively(const fs::path& dir) {
-        if (fs::exists(dir) && fs::is_directory(dir)) {
-            fs::remove_all(dir);
-            std::cout << "Removed directory recursively: " << dir << std::endl;
-        } else {
-            std::cout << "Directory does not exist: " << dir << std::endl;
-        }
-    }
-
-    void removeDirectoryForcefully(const fs::path& dir) {
-        try {
-            if (fs::exists(dir) && fs::is_directory(dir)) {
-                fs::remove_all(dir);
-                std::cout << "Removed directory forcefully: " << dir << std::endl;
-            } else {
-                std::cout << "Directory does not exist: " << dir << std::endl;
-            }
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-
-
-    void copyFile(const std::vector<std::string>& tokens) {
-        if (tokens.size() < 3) {
-            std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        std::vector<std::string> options;
-        fs::path source;
-        fs::path destination;
-
-        // Separate options, source, and destination
-        size_t i = 1;
-        while (i < tokens.size() && tokens[i].substr(0, 1) == "-") {
-            options.push_back(tokens[i]);
-            ++i;
-        }
-
-        if (i < tokens.size()) {
-            source = tokens[i];
-            ++i;
-        } else {
-            std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        if (i < tokens.size()) {
-            destination = tokens[i];
-        } else {
-            std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
-            return;
-        }
-
-        performCopy(options, source, destination);
-    }
-
-    void performCopy(const std::vector<std::string>& options, const fs::path& source, const fs::path& destination) {
-        try {
-            bool copyContents = false;
-            bool dereference = false;
-            bool linkFiles = false;
-            bool recursive = false;
-
-            // Process options
-            for (const std::string& opt : options) {
-                if (opt == "--copy-contents") {
-                    copyContents = true;
-                } else if (opt == "-d") {
-                    dereference = true;
-                } else if (opt == "--link" || opt == "-l") {
-                    linkFiles = true;
-                } else if (opt == "--recursive" || opt == "-r" || opt == "-R") {
-                    recursive = true;
-                } else if (opt == "--help") {
-                    std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
-                    std::cout << "Options:" << std::endl;
-                    std::cout << "  --copy-contents       Copy special file contents when recursive" << std::endl;
-                    std::cout << "  -d                    Equivalent to --no-dereference --preserve=links" << std::endl;
-                    std::cout << "  --link, -l            Specify hard link files rather than copying" << std::endl;
-                    std::cout << "  --recursive, -r, -R   Recursively copy directories" << std::endl;
-                    return;
-                } else {
-                    std::cout << "Unknown option: " << opt << std::endl;
-                    return;
-                }
-            }
-
-            if (linkFiles && recursive) {
-                std::cout << "Error: Options --link and --recursive are mutually exclusive." << std::endl;
-                return;
-            }
-
-            if (dereference) {
-                fs::copy_options copyOptions = fs::copy_options::none;
-                if (!copyContents) {
-                    copyOptions |= fs::copy_options::skip_symlinks;
-                }
-                if (linkFiles) {
-                    copyOptions |= fs::copy_options::create_hard_links;
-                }
-
-                fs::copy(source, destination, copyOptions);
-            } else {
-                if (recursive) {
-                    fs::copy(source, destination, fs::copy_options::recursive);
-                } else {
-                    fs::copy(source, destination);
-                }
-            }
-
-            std::cout << "Copied: " << source << " to " << destination << std::endl;
-        } catch (const fs::filesystem_error& ex) {
-            std::cout << "Error: " << ex.what() << std::endl;
-        }
-    }
-};
-
-int main() {
-    Shell myShell;
-    myShell.run();
-    return 0;
-}
+#include <iostream>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <algorithm>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <string_view>
+#include <cstring>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <charconv>
+#include <type_traits>
+#include <cstdio>
+#include <unordered_map>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <linux/fs.h>
+#include <bitset>
+#include <sys/inotify.h>
+#include <list>
+#include <climits>
+#include <clocale>
+#include <unordered_set>
+#include <cmath>
+#include <termios.h>
+#include <poll.h>
+
+namespace fs = std::filesystem;
+
+// Cancellation flag of the background job running on this thread, or null.
+// Long-running builtins poll it between entries; pool tasks inherit it from
+// the thread that submitted them.
+const std::atomic<bool>*& activeCancelFlag() {
+    thread_local const std::atomic<bool>* flag = nullptr;
+    return flag;
+}
+
+bool cancellationRequested() {
+    const std::atomic<bool>* flag = activeCancelFlag();
+    return flag != nullptr && flag->load(std::memory_order_relaxed);
+}
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its
+// own tasks at the front and, when empty, steals from the back of the others.
+// The thread calling wait() helps drain the queues instead of sleeping.
+class ThreadPool {
+
+public:
+    explicit ThreadPool(size_t threadCount) {
+        if (threadCount == 0) {
+            threadCount = 1;
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Number of submitted tasks that have not finished yet.
+    size_t pendingTasks() const {
+        return pending.load(std::memory_order_relaxed);
+    }
+
+    void submit(std::function<void()> task) {
+        if (const std::atomic<bool>* flag = activeCancelFlag()) {
+            task = [flag, inner = std::move(task)] {
+                const std::atomic<bool>* previous = activeCancelFlag();
+                activeCancelFlag() = flag;
+                inner();
+                activeCancelFlag() = previous;
+            };
+        }
+        pending.fetch_add(1, std::memory_order_relaxed);
+        if (currentPool == this) {
+            WorkerQueue& own = *queues[currentWorker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.tasks.push_front(std::move(task));
+        } else {
+            WorkerQueue& target = *queues[nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+            std::lock_guard<std::mutex> lock(target.mutex);
+            target.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            ++queued;
+        }
+        workAvailable.notify_one();
+    }
+
+    // Blocks until every submitted task (including tasks submitted by tasks) has finished.
+    void wait() {
+        std::function<void()> task;
+        while (pending.load(std::memory_order_acquire) != 0) {
+            if (takeTask(queues.size(), task)) {
+                runTask(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(stateMutex);
+            allDone.wait_for(lock, std::chrono::milliseconds(10), [this] {
+                return pending.load(std::memory_order_acquire) == 0 || queued != 0;
+            });
+        }
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void workerLoop(size_t index) {
+        currentPool = this;
+        currentWorker = index;
+        std::function<void()> task;
+        while (true) {
+            if (takeTask(index, task)) {
+                runTask(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(stateMutex);
+            workAvailable.wait(lock, [this] { return stopping || queued != 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+    // Pops from the worker's own queue first, then steals from the others.
+    bool takeTask(size_t self, std::function<void()>& task) {
+        if (self < queues.size()) {
+            WorkerQueue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                markDequeued();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset <= queues.size(); ++offset) {
+            WorkerQueue& victim = *queues[(self + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                markDequeued();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void markDequeued() {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        --queued;
+    }
+
+    void runTask(std::function<void()>& task) {
+        task();
+        task = nullptr;
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            allDone.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> nextQueue{0};
+    std::mutex stateMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    size_t queued = 0;
+    bool stopping = false;
+
+    static thread_local ThreadPool* currentPool;
+    static thread_local size_t currentWorker;
+};
+
+thread_local ThreadPool* ThreadPool::currentPool = nullptr;
+thread_local size_t ThreadPool::currentWorker = 0;
+
+size_t defaultThreadCount() {
+    unsigned int count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+// Files and directory entries the builtins have read, stat'ed or copied, for
+// the per-command statistics. Walks add to it once per directory or batch.
+std::atomic<uint64_t>& touchedFileCount() {
+    static std::atomic<uint64_t> count{0};
+    return count;
+}
+
+// System calls the builtins issue on the hot paths of a walk, by kind, so
+// `time` can tell a stat-bound command from an output-bound one. Requests
+// sent through io_uring count under their own kind; the submissions count
+// as io_uring_enter.
+enum class SyscallKind { Getdents, Statx, Unlinkat, IoUringEnter, Count };
+
+constexpr const char* syscallNames[] = {"getdents64", "statx", "unlinkat", "io_uring_enter"};
+static_assert(std::size(syscallNames) == static_cast<size_t>(SyscallKind::Count), "every syscall kind needs a name");
+
+std::atomic<uint64_t>& syscallCount(SyscallKind kind) {
+    static std::atomic<uint64_t> counts[static_cast<size_t>(SyscallKind::Count)];
+    return counts[static_cast<size_t>(kind)];
+}
+
+void countSyscall(SyscallKind kind) {
+    syscallCount(kind).fetch_add(1, std::memory_order_relaxed);
+}
+
+enum class ReflinkMode { Auto, Always, Never };
+
+enum class CopyMethod { Reflink, CopyFileRange, Sendfile, ReadWrite, Count };
+
+const char* copyMethodName(CopyMethod method) {
+    switch (method) {
+        case CopyMethod::Reflink:
+            return "reflink";
+        case CopyMethod::CopyFileRange:
+            return "copy_file_range";
+        case CopyMethod::Sendfile:
+            return "sendfile";
+        default:
+            return "read/write";
+    }
+}
+
+// Closes a file descriptor when it goes out of scope.
+class FileDescriptor {
+
+public:
+    explicit FileDescriptor(int fd = -1) : fd(fd) {}
+
+    ~FileDescriptor() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    FileDescriptor(FileDescriptor&& other) noexcept : fd(other.release()) {}
+
+    FileDescriptor& operator=(FileDescriptor&& other) noexcept {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const {
+        return fd;
+    }
+
+    int release() {
+        int released = fd;
+        fd = -1;
+        return released;
+    }
+
+    void reset(int newFd = -1) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        fd = newFd;
+    }
+
+private:
+    int fd;
+};
+
+// Minimal io_uring driver on raw system calls (no liburing). Each thread gets
+// its own ring on first use; forThread() returns nullptr when the kernel does
+// not support io_uring or MYSHELL_IO_URING=0 is set, and callers then fall
+// back to the synchronous calls.
+class IoUring {
+
+public:
+    static constexpr unsigned int queueDepth = 64;
+
+    static IoUring* forThread() {
+        static const bool enabled = [] {
+            const char* setting = getenv("MYSHELL_IO_URING");
+            return setting == nullptr || std::string(setting) != "0";
+        }();
+        thread_local std::unique_ptr<IoUring> ring;
+        thread_local bool probed = false;
+        if (!enabled) {
+            return nullptr;
+        }
+        if (!probed) {
+            probed = true;
+            auto candidate = std::unique_ptr<IoUring>(new IoUring());
+            if (candidate->ringFd.get() >= 0) {
+                ring = std::move(candidate);
+            }
+        }
+        if (ring && ring->broken) {
+            ring.reset();
+        }
+        return ring.get();
+    }
+
+    ~IoUring() {
+        if (sqes != nullptr) {
+            ::munmap(sqes, sqeBytes);
+        }
+        if (cqRing != nullptr && cqRing != sqRing) {
+            ::munmap(cqRing, cqRingBytes);
+        }
+        if (sqRing != nullptr) {
+            ::munmap(sqRing, sqRingBytes);
+        }
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool supports(unsigned char opcode) const {
+        return opcode < supportedOps.size() && supportedOps[opcode];
+    }
+
+    // Runs `count` independent requests keeping up to queueDepth in flight.
+    // prepare(i, sqe) fills the request for index i, complete(i, res) receives
+    // the CQE result (negative errno on failure). If the ring itself fails,
+    // fallback(i) is called for every request that never completed.
+    template <typename Prepare, typename Complete, typename Fallback>
+    void runBatch(size_t count, Prepare prepare, Complete complete, Fallback fallback) {
+        std::vector<bool> completed(count, false);
+        size_t next = 0;
+        size_t inFlight = 0;
+        while (next < count || inFlight != 0) {
+            size_t queued = 0;
+            while (next < count && inFlight + queued < sqEntries) {
+                io_uring_sqe* sqe = nextSqe();
+                prepare(next, sqe);
+                sqe->user_data = next;
+                ++next;
+                ++queued;
+            }
+
+            if (!enter(static_cast<unsigned int>(queued), 1)) {
+                broken = true;
+                for (size_t i = 0; i < count; ++i) {
+                    if (!completed[i]) {
+                        fallback(i);
+                    }
+                }
+                return;
+            }
+            inFlight += queued;
+
+            unsigned int head = *cqHead;
+            unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                completed[cqe.user_data] = true;
+                complete(static_cast<size_t>(cqe.user_data), cqe.res);
+                --inFlight;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    static void prepareStatx(io_uring_sqe* sqe, int dirFd, const char* path, int flags, unsigned int mask, struct statx* result) {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirFd;
+        sqe->addr = reinterpret_cast<uintptr_t>(path);
+        sqe->len = mask;
+        sqe->off = reinterpret_cast<uintptr_t>(result);
+        sqe->statx_flags = flags;
+    }
+
+    static void prepareOpenat(io_uring_sqe* sqe, int dirFd, const char* path, int flags, mode_t mode) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirFd;
+        sqe->addr = reinterpret_cast<uintptr_t>(path);
+        sqe->len = mode;
+        sqe->open_flags = flags;
+    }
+
+    static void prepareUnlinkat(io_uring_sqe* sqe, int dirFd, const char* path, int flags) {
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = dirFd;
+        sqe->addr = reinterpret_cast<uintptr_t>(path);
+        sqe->unlink_flags = flags;
+    }
+
+    static void prepareRenameat(io_uring_sqe* sqe, int oldDirFd, const char* oldPath, int newDirFd, const char* newPath, unsigned int flags) {
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = oldDirFd;
+        sqe->addr = reinterpret_cast<uintptr_t>(oldPath);
+        sqe->len = newDirFd;
+        sqe->addr2 = reinterpret_cast<uintptr_t>(newPath);
+        sqe->rename_flags = flags;
+    }
+
+    static void prepareRead(io_uring_sqe* sqe, int fd, void* buffer, unsigned int length, uint64_t offset) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+        sqe->len = length;
+        sqe->off = offset;
+    }
+
+    static void prepareWrite(io_uring_sqe* sqe, int fd, const void* buffer, unsigned int length, uint64_t offset) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(buffer);
+        sqe->len = length;
+        sqe->off = offset;
+    }
+
+private:
+    IoUring() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ringFd.reset(static_cast<int>(::syscall(__NR_io_uring_setup, queueDepth, &params)));
+        if (ringFd.get() < 0) {
+            return;
+        }
+
+        sqEntries = params.sq_entries;
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) {
+            sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        }
+
+        sqRing = map(sqRingBytes, IORING_OFF_SQ_RING);
+        cqRing = singleMap ? sqRing : map(cqRingBytes, IORING_OFF_CQ_RING);
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqeBytes, IORING_OFF_SQES));
+        if (sqRing == nullptr || cqRing == nullptr || sqes == nullptr) {
+            ringFd.reset();
+            return;
+        }
+
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        probeOpcodes();
+    }
+
+    void* map(size_t bytes, off_t offset) {
+        void* address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd.get(), offset);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    void probeOpcodes() {
+        constexpr unsigned int probeOps = 64;
+        std::vector<char> storage(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op), 0);
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (::syscall(__NR_io_uring_register, ringFd.get(), IORING_REGISTER_PROBE, probe, probeOps) < 0) {
+            return;
+        }
+        supportedOps.assign(probe->last_op + 1, false);
+        for (unsigned int i = 0; i < probe->ops_len && i < probeOps; ++i) {
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) {
+                supportedOps[probe->ops[i].op] = true;
+            }
+        }
+    }
+
+    io_uring_sqe* nextSqe() {
+        unsigned int index = localTail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        ++localTail;
+        return sqe;
+    }
+
+    bool enter(unsigned int toSubmit, unsigned int waitFor) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        while (true) {
+            long submitted = ::syscall(__NR_io_uring_enter, ringFd.get(), toSubmit, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0);
+            countSyscall(SyscallKind::IoUringEnter);
+            if (submitted >= 0) {
+                toSubmit -= std::min<unsigned int>(toSubmit, static_cast<unsigned int>(submitted));
+                if (toSubmit == 0) {
+                    return true;
+                }
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                return false;
+            }
+        }
+    }
+
+    FileDescriptor ringFd;
+    unsigned int sqEntries = 0;
+    unsigned int localTail = 0;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingBytes = 0;
+    size_t cqRingBytes = 0;
+    size_t sqeBytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned int* sqTail = nullptr;
+    unsigned int* sqMask = nullptr;
+    unsigned int* sqArray = nullptr;
+    unsigned int* cqHead = nullptr;
+    unsigned int* cqTail = nullptr;
+    unsigned int* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    std::vector<bool> supportedOps;
+    bool broken = false;
+};
+
+// Errors that mean "this kernel path is not available here, try the next one".
+bool isUnsupportedCopyError(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP
+        || error == ENOTTY || error == EPERM || error == EBADF;
+}
+
+bool copyWithCopyFileRange(int in, int out, uintmax_t size, uintmax_t& copied, int& error) {
+    while (copied < size) {
+        ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        copied += n;
+    }
+    return true;
+}
+
+bool copyWithSendfile(int in, int out, uintmax_t size, uintmax_t& copied, int& error) {
+    while (copied < size) {
+        ssize_t n = ::sendfile(out, in, nullptr, std::min<uintmax_t>(size - copied, 1u << 30));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        copied += n;
+    }
+    return true;
+}
+
+bool copyWithReadWrite(int in, int out, uintmax_t& copied, int& error) {
+    thread_local std::vector<char> buffer(1 << 20);
+    while (true) {
+        ssize_t n = ::read(in, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = ::write(out, buffer.data() + written, n - written);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error = errno;
+                return false;
+            }
+            written += w;
+        }
+        copied += n;
+    }
+}
+
+// Read/write copy through io_uring: a window of chunks is read in parallel at
+// explicit offsets, then written back in parallel. Returns false with error 0
+// when the ring cannot finish the job so the caller can continue synchronously
+// from `copied`.
+bool copyWithUring(IoUring& ring, int in, int out, uintmax_t size, uintmax_t& copied, int& error) {
+    constexpr size_t chunkSize = 512 * 1024;
+    constexpr size_t windowChunks = 8;
+    thread_local std::vector<char> buffer(chunkSize * windowChunks);
+
+    while (copied < size) {
+        size_t chunks = std::min<uintmax_t>(windowChunks, (size - copied + chunkSize - 1) / chunkSize);
+        std::vector<int> lengths(chunks, 0);
+        bool ringFailed = false;
+        auto chunkLength = [&](size_t i) {
+            return static_cast<unsigned int>(std::min<uintmax_t>(chunkSize, size - copied - i * chunkSize));
+        };
+
+        ring.runBatch(chunks,
+            [&](size_t i, io_uring_sqe* sqe) {
+                IoUring::prepareRead(sqe, in, buffer.data() + i * chunkSize, chunkLength(i), copied + i * chunkSize);
+            },
+            [&](size_t i, int res) { lengths[i] = res; },
+            [&](size_t) { ringFailed = true; });
+        for (size_t i = 0; i < chunks && !ringFailed; ++i) {
+            if (lengths[i] < 0) {
+                error = -lengths[i];
+                return false;
+            }
+            // A short read means the file changed size; let the caller finish
+            if (static_cast<unsigned int>(lengths[i]) != chunkLength(i)) {
+                ringFailed = true;
+            }
+        }
+        if (ringFailed) {
+            return false;
+        }
+
+        ring.runBatch(chunks,
+            [&](size_t i, io_uring_sqe* sqe) {
+                IoUring::prepareWrite(sqe, out, buffer.data() + i * chunkSize, chunkLength(i), copied + i * chunkSize);
+            },
+            [&](size_t i, int res) { lengths[i] = res; },
+            [&](size_t) { ringFailed = true; });
+        for (size_t i = 0; i < chunks && !ringFailed; ++i) {
+            if (lengths[i] < 0) {
+                error = -lengths[i];
+                return false;
+            }
+            if (static_cast<unsigned int>(lengths[i]) != chunkLength(i)) {
+                ringFailed = true;
+            }
+        }
+        if (ringFailed) {
+            return false;
+        }
+
+        for (size_t i = 0; i < chunks; ++i) {
+            copied += chunkLength(i);
+        }
+    }
+    return true;
+}
+
+// The part of copyFileData after both files are open, for callers that open
+// files in batches. `out` was created by the caller; it is closed on success
+// and the destination removed on failure.
+CopyMethod copyOpenedFile(int in, const struct stat& st, FileDescriptor& out, const fs::path& destination,
+                          ReflinkMode mode, uintmax_t& bytesCopied, std::error_code& ec) {
+    bytesCopied = 0;
+    ec.clear();
+    auto fail = [&](int error) {
+        ec.assign(error, std::generic_category());
+        ::unlink(destination.c_str());
+        return CopyMethod::ReadWrite;
+    };
+
+    CopyMethod method = CopyMethod::Reflink;
+    int error = 0;
+    bool done = false;
+
+    if (mode != ReflinkMode::Never && S_ISREG(st.st_mode)) {
+        if (::ioctl(out.get(), FICLONE, in) == 0) {
+            bytesCopied = st.st_size;
+            done = true;
+        } else if (mode == ReflinkMode::Always) {
+            return fail(errno);
+        }
+    }
+
+    // copy_file_range may itself reflink on some filesystems, so it is skipped
+    // when reflinks were explicitly refused.
+    if (!done && mode != ReflinkMode::Never && S_ISREG(st.st_mode) && st.st_size > 0) {
+        method = CopyMethod::CopyFileRange;
+        done = copyWithCopyFileRange(in, out.get(), st.st_size, bytesCopied, error);
+        if (!done && (bytesCopied != 0 || !isUnsupportedCopyError(error))) {
+            return fail(error);
+        }
+    }
+
+    if (!done && S_ISREG(st.st_mode) && st.st_size > 0) {
+        method = CopyMethod::Sendfile;
+        done = copyWithSendfile(in, out.get(), st.st_size, bytesCopied, error);
+        if (!done && (bytesCopied != 0 || !isUnsupportedCopyError(error))) {
+            return fail(error);
+        }
+    }
+
+    // Empty or special files (e.g. /proc) report size 0 but may still have data
+    if (!done || st.st_size == 0) {
+        method = CopyMethod::ReadWrite;
+        IoUring* ring = IoUring::forThread();
+        if (ring != nullptr && st.st_size > 0 && ring->supports(IORING_OP_READ) && ring->supports(IORING_OP_WRITE)) {
+            done = copyWithUring(*ring, in, out.get(), st.st_size, bytesCopied, error);
+            if (!done && error != 0) {
+                return fail(error);
+            }
+        }
+        if (!done) {
+            // Continue synchronously from wherever the previous path stopped
+            ::lseek(in, bytesCopied, SEEK_SET);
+            ::lseek(out.get(), bytesCopied, SEEK_SET);
+            if (!copyWithReadWrite(in, out.get(), bytesCopied, error)) {
+                return fail(error);
+            }
+        }
+    }
+
+    if (::fchmod(out.get(), st.st_mode & 07777) != 0 || ::close(out.release()) != 0) {
+        return fail(errno);
+    }
+    return method;
+}
+
+// Copies the contents of a regular file, keeping the data inside the kernel
+// whenever possible: FICLONE reflink, then copy_file_range, then sendfile,
+// then a large-buffer read/write loop. The destination must not exist.
+// Returns the method that moved the data; on failure ec is set.
+CopyMethod copyFileData(const fs::path& source, const fs::path& destination, ReflinkMode mode,
+                        uintmax_t& bytesCopied, std::error_code& ec) {
+    bytesCopied = 0;
+    ec.clear();
+    touchedFileCount().fetch_add(1, std::memory_order_relaxed);
+
+    FileDescriptor in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (in.get() < 0 || ::fstat(in.get(), &st) != 0) {
+        ec.assign(errno, std::generic_category());
+        return CopyMethod::ReadWrite;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        ec = std::make_error_code(std::errc::is_a_directory);
+        return CopyMethod::ReadWrite;
+    }
+
+    FileDescriptor out(::open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777));
+    if (out.get() < 0) {
+        ec.assign(errno, std::generic_category());
+        return CopyMethod::ReadWrite;
+    }
+    return copyOpenedFile(in.get(), st, out, destination, mode, bytesCopied, ec);
+}
+
+// Recursive copy that walks the source tree and copies files in parallel.
+// Each directory is a task: it creates its destination directory, then
+// submits one task per sub-directory and one per batch of files. A batch
+// opens its sources with one io_uring submission and creates the
+// destinations with another, then hands each pair of descriptors to a task
+// of its own, so the data of large files is still copied in parallel.
+class ParallelCopier {
+
+public:
+    ParallelCopier(size_t threadCount, ReflinkMode reflinkMode) : pool(threadCount), reflinkMode(reflinkMode) {}
+
+    void copyTree(const fs::path& source, const fs::path& destination) {
+        auto start = std::chrono::steady_clock::now();
+        pool.submit([this, source, destination] { copyDirectory(source, destination); });
+        pool.wait();
+        elapsed = std::chrono::steady_clock::now() - start;
+
+        // Report failures sorted by path so the output does not depend on scheduling
+        std::sort(errors.begin(), errors.end());
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& getErrors() const {
+        return errors;
+    }
+
+    uintmax_t filesCopied() const {
+        return files.load();
+    }
+
+    uintmax_t bytesCopied() const {
+        return bytes.load();
+    }
+
+    double seconds() const {
+        return elapsed.count();
+    }
+
+    size_t threads() const {
+        return pool.size();
+    }
+
+    uintmax_t filesCopiedWith(CopyMethod method) const {
+        return methodCounts[static_cast<size_t>(method)].load();
+    }
+
+private:
+    void copyDirectory(const fs::path& source, const fs::path& destination) {
+        std::error_code ec;
+        if (!fs::is_directory(destination, ec)) {
+            fs::create_directory(destination, source, ec);
+            if (ec) {
+                recordError(destination, ec);
+                return;
+            }
+        }
+
+        fs::directory_iterator it(source, ec);
+        if (ec) {
+            recordError(source, ec);
+            return;
+        }
+        std::vector<std::pair<fs::path, fs::path>> batch;
+        for (const fs::directory_iterator end; it != end && !cancellationRequested(); it.increment(ec)) {
+            if (ec) {
+                recordError(source, ec);
+                break;
+            }
+            const fs::directory_entry& entry = *it;
+            fs::path target = destination / entry.path().filename();
+            bool isLink = entry.is_symlink(ec);
+            bool isDirectory = !ec && !isLink && entry.is_directory(ec);
+            if (ec) {
+                // Copying an entry whose type we could not read would guess wrong
+                recordError(entry.path(), ec);
+                ec.clear();
+                continue;
+            }
+            if (isLink) {
+                pool.submit([this, from = entry.path(), target] { copyLink(from, target); });
+            } else if (isDirectory) {
+                pool.submit([this, from = entry.path(), target] { copyDirectory(from, target); });
+            } else {
+                batch.emplace_back(entry.path(), std::move(target));
+                if (batch.size() == openBatchSize) {
+                    submitFiles(batch);
+                }
+            }
+        }
+        submitFiles(batch);
+    }
+
+    void submitFiles(std::vector<std::pair<fs::path, fs::path>>& batch) {
+        if (!batch.empty()) {
+            pool.submit([this, batch = std::move(batch)] { copyRegularFiles(batch); });
+            batch.clear();
+        }
+    }
+
+    // Opens the batch through the ring and copies each file as its own task.
+    // Without a ring that can open files, each file is opened by its task.
+    void copyRegularFiles(const std::vector<std::pair<fs::path, fs::path>>& batch) {
+        IoUring* ring = IoUring::forThread();
+        if (ring == nullptr || !ring->supports(IORING_OP_OPENAT)) {
+            for (const auto& file : batch) {
+                pool.submit([this, file] { copyRegularFile(file.first, file.second); });
+            }
+            return;
+        }
+        if (cancellationRequested()) {
+            return;
+        }
+        touchedFileCount().fetch_add(batch.size(), std::memory_order_relaxed);
+
+        struct OpenFile {
+            std::shared_ptr<FileDescriptor> in;
+            std::shared_ptr<FileDescriptor> out;
+            struct stat st;
+            int error = 0;
+        };
+        std::vector<OpenFile> opened(batch.size());
+        auto setResult = [](std::shared_ptr<FileDescriptor>& fd, int& error, int result) {
+            if (result < 0) {
+                error = -result;
+            } else {
+                fd = std::make_shared<FileDescriptor>(result);
+            }
+        };
+
+        ring->runBatch(batch.size(),
+            [&](size_t i, io_uring_sqe* sqe) {
+                IoUring::prepareOpenat(sqe, AT_FDCWD, batch[i].first.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            },
+            [&](size_t i, int res) { setResult(opened[i].in, opened[i].error, res); },
+            [&](size_t i) {
+                int fd = ::open(batch[i].first.c_str(), O_RDONLY | O_CLOEXEC);
+                setResult(opened[i].in, opened[i].error, fd < 0 ? -errno : fd);
+            });
+
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (opened[i].error != 0) {
+                continue;
+            }
+            if (::fstat(opened[i].in->get(), &opened[i].st) != 0) {
+                opened[i].error = errno;
+            } else if (S_ISDIR(opened[i].st.st_mode)) {
+                opened[i].error = EISDIR;
+            } else {
+                ready.push_back(i);
+            }
+        }
+
+        constexpr int createFlags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+        ring->runBatch(ready.size(),
+            [&](size_t k, io_uring_sqe* sqe) {
+                size_t i = ready[k];
+                IoUring::prepareOpenat(sqe, AT_FDCWD, batch[i].second.c_str(), createFlags, opened[i].st.st_mode & 07777);
+            },
+            [&](size_t k, int res) { setResult(opened[ready[k]].out, opened[ready[k]].error, res); },
+            [&](size_t k) {
+                size_t i = ready[k];
+                int fd = ::open(batch[i].second.c_str(), createFlags, opened[i].st.st_mode & 07777);
+                setResult(opened[i].out, opened[i].error, fd < 0 ? -errno : fd);
+            });
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (opened[i].error != 0) {
+                recordError(batch[i].first, std::error_code(opened[i].error, std::generic_category()));
+                continue;
+            }
+            pool.submit([this, file = batch[i], handles = opened[i]] {
+                if (cancellationRequested()) {
+                    // Created by the batch, so nobody else's file
+                    ::unlink(file.second.c_str());
+                    return;
+                }
+                std::error_code ec;
+                uintmax_t size = 0;
+                CopyMethod method = copyOpenedFile(handles.in->get(), handles.st, *handles.out, file.second, reflinkMode, size, ec);
+                recordCopy(file.first, method, size, ec);
+            });
+        }
+    }
+
+    void copyRegularFile(const fs::path& source, const fs::path& destination) {
+        if (cancellationRequested()) {
+            return;
+        }
+        std::error_code ec;
+        uintmax_t size = 0;
+        CopyMethod method = copyFileData(source, destination, reflinkMode, size, ec);
+        recordCopy(source, method, size, ec);
+    }
+
+    void recordCopy(const fs::path& source, CopyMethod method, uintmax_t size, const std::error_code& ec) {
+        if (ec) {
+            recordError(source, ec);
+            return;
+        }
+        methodCounts[static_cast<size_t>(method)].fetch_add(1, std::memory_order_relaxed);
+        files.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void copyLink(const fs::path& source, const fs::path& destination) {
+        std::error_code ec;
+        fs::copy_symlink(source, destination, ec);
+        if (ec) {
+            recordError(source, ec);
+            return;
+        }
+        files.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordError(const fs::path& path, const std::error_code& ec) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.emplace_back(path.string(), ec.message());
+    }
+
+    // Files per batch; the ring keeps up to IoUring::queueDepth opens in flight
+    static constexpr size_t openBatchSize = 64;
+
+    ThreadPool pool;
+    ReflinkMode reflinkMode;
+    std::atomic<uintmax_t> methodCounts[static_cast<size_t>(CopyMethod::Count)] = {};
+    std::atomic<uintmax_t> files{0};
+    std::atomic<uintmax_t> bytes{0};
+    std::mutex errorMutex;
+    std::vector<std::pair<std::string, std::string>> errors;
+    std::chrono::duration<double> elapsed{0};
+};
+
+// Reads directory entries straight from getdents64 into a large buffer.
+// Names are returned as views into that buffer and stay valid until the next
+// call to next(). Buffers are recycled per thread, so opening many readers in
+// a loop does not allocate.
+class DirectoryReader {
+
+public:
+    // The reader does not take ownership of fd
+    explicit DirectoryReader(int fd) : fd(fd), buffer(acquireBuffer()) {}
+
+    ~DirectoryReader() {
+        freeBuffers().push_back(std::move(buffer));
+        touchedFileCount().fetch_add(entriesRead, std::memory_order_relaxed);
+    }
+
+    DirectoryReader(const DirectoryReader&) = delete;
+    DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+    // Skips "." and "..". Returns false at the end of the directory or on
+    // error; error() tells the two apart.
+    bool next(std::string_view& name, unsigned char& type) {
+        while (true) {
+            if (position >= available) {
+                long n = ::syscall(SYS_getdents64, fd, buffer.get(), bufferSize);
+                countSyscall(SyscallKind::Getdents);
+                if (n <= 0) {
+                    lastError = n < 0 ? errno : 0;
+                    return false;
+                }
+                position = 0;
+                available = static_cast<size_t>(n);
+            }
+
+            const Entry* entry = reinterpret_cast<const Entry*>(buffer.get() + position);
+            position += entry->reclen;
+
+            const char* entryName = entry->name;
+            if (entryName[0] == '.' && (entryName[1] == '\0' || (entryName[1] == '.' && entryName[2] == '\0'))) {
+                continue;
+            }
+            name = std::string_view(entryName);
+            type = entry->type;
+            ++entriesRead;
+            return true;
+        }
+    }
+
+    int error() const {
+        return lastError;
+    }
+
+private:
+    struct Entry {
+        uint64_t ino;
+        int64_t off;
+        unsigned short reclen;
+        unsigned char type;
+        char name[1];
+    };
+
+    static constexpr size_t bufferSize = 256 * 1024;
+
+    static std::vector<std::unique_ptr<char[]>>& freeBuffers() {
+        thread_local std::vector<std::unique_ptr<char[]>> buffers;
+        return buffers;
+    }
+
+    static std::unique_ptr<char[]> acquireBuffer() {
+        auto& buffers = freeBuffers();
+        if (buffers.empty()) {
+            return std::unique_ptr<char[]>(new char[bufferSize]);
+        }
+        std::unique_ptr<char[]> reused = std::move(buffers.back());
+        buffers.pop_back();
+        return reused;
+    }
+
+    int fd;
+    std::unique_ptr<char[]> buffer;
+    size_t position = 0;
+    size_t available = 0;
+    int lastError = 0;
+    uint64_t entriesRead = 0;
+};
+
+// Stores directory entry names back to back in one allocation. Each name is
+// NUL-terminated so it can be passed to *at() system calls directly.
+class NameArena {
+
+public:
+    void add(std::string_view name, unsigned char type) {
+        offsets.push_back(static_cast<uint32_t>(data.size()));
+        types.push_back(type);
+        data.append(name.data(), name.size());
+        data.push_back('\0');
+    }
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    std::string_view name(size_t index) const {
+        size_t end = index + 1 < offsets.size() ? offsets[index + 1] - 1 : data.size() - 1;
+        return std::string_view(data.data() + offsets[index], end - offsets[index]);
+    }
+
+    const char* c_str(size_t index) const {
+        return data.c_str() + offsets[index];
+    }
+
+    unsigned char type(size_t index) const {
+        return types[index];
+    }
+
+    size_t memoryUsage() const {
+        return data.capacity() + offsets.capacity() * sizeof(uint32_t) + types.capacity();
+    }
+
+    void clear() {
+        data.clear();
+        offsets.clear();
+        types.clear();
+    }
+
+private:
+    std::string data;
+    std::vector<uint32_t> offsets;
+    std::vector<unsigned char> types;
+};
+
+// Metadata for one directory entry as returned by statx; error is the errno
+// of a failed lookup, or 0.
+struct EntryMetadata {
+    struct statx stx;
+    int error;
+};
+
+// Fields ls -l needs: one statx per entry instead of status + size + mtime.
+constexpr unsigned int longFormatStatxMask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_SIZE | STATX_MTIME;
+
+void fetchEntryMetadata(int dirFd, const char* name, unsigned int mask, EntryMetadata& result) {
+    countSyscall(SyscallKind::Statx);
+    result.error = ::statx(dirFd, name, AT_SYMLINK_NOFOLLOW, mask, &result.stx) == 0 ? 0 : errno;
+}
+
+// Stats every name in the arena relative to dirFd. With io_uring all requests
+// go through one ring with many in flight; otherwise large directories are
+// split into chunks fanned out across a small pool. On network filesystems
+// each statx is a round trip, so the pool is allowed to exceed the core count.
+std::vector<EntryMetadata> fetchDirectoryMetadata(int dirFd, const NameArena& names, unsigned int mask) {
+    constexpr size_t parallelThreshold = 512;
+    constexpr size_t chunkSize = 256;
+
+    std::vector<EntryMetadata> results(names.size());
+    touchedFileCount().fetch_add(names.size(), std::memory_order_relaxed);
+    IoUring* ring = IoUring::forThread();
+    if (ring != nullptr && names.size() > 1 && ring->supports(IORING_OP_STATX)) {
+        ring->runBatch(names.size(),
+            [&](size_t i, io_uring_sqe* sqe) {
+                IoUring::prepareStatx(sqe, dirFd, names.c_str(i), AT_SYMLINK_NOFOLLOW, mask, &results[i].stx);
+            },
+            [&](size_t i, int res) {
+                countSyscall(SyscallKind::Statx);
+                results[i].error = res < 0 ? -res : 0;
+            },
+            [&](size_t i) { fetchEntryMetadata(dirFd, names.c_str(i), mask, results[i]); });
+        return results;
+    }
+
+    if (names.size() < parallelThreshold) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            fetchEntryMetadata(dirFd, names.c_str(i), mask, results[i]);
+        }
+        return results;
+    }
+
+    size_t chunks = (names.size() + chunkSize - 1) / chunkSize;
+    ThreadPool pool(std::min<size_t>(chunks, std::max<size_t>(8, defaultThreadCount())));
+    for (size_t begin = 0; begin < names.size(); begin += chunkSize) {
+        size_t end = std::min(begin + chunkSize, names.size());
+        pool.submit([&, begin, end] {
+            for (size_t i = begin; i < end; ++i) {
+                fetchEntryMetadata(dirFd, names.c_str(i), mask, results[i]);
+            }
+        });
+    }
+    pool.wait();
+    return results;
+}
+
+// Appends one ls -l line: type and permissions, link count, size,
+// modification time and name.
+void appendLongFormat(const struct statx& stx, std::string_view name, std::string& text) {
+    char type;
+    switch (stx.stx_mode & S_IFMT) {
+        case S_IFREG:
+            type = '-';
+            break;
+        case S_IFDIR:
+            type = 'd';
+            break;
+        case S_IFLNK:
+            type = 'l';
+            break;
+        case S_IFCHR:
+            type = 'c';
+            break;
+        case S_IFBLK:
+            type = 'b';
+            break;
+        case S_IFIFO:
+            type = 'p';
+            break;
+        case S_IFSOCK:
+            type = 's';
+            break;
+        default:
+            type = '?';
+            break;
+    }
+
+    text += type;
+    const char* letters = "rwxrwxrwx";
+    for (int bit = 0; bit < 9; ++bit) {
+        text += (stx.stx_mode & (0400 >> bit)) ? letters[bit] : '-';
+    }
+
+    char digits[24];
+    text += ' ';
+    text.append(digits, std::to_chars(digits, digits + sizeof(digits), stx.stx_nlink).ptr - digits);
+    text += ' ';
+    text.append(digits, std::to_chars(digits, digits + sizeof(digits), stx.stx_size).ptr - digits);
+    text += ' ';
+
+    time_t writeTime = stx.stx_mtime.tv_sec;
+    struct tm localWriteTime;
+    char timeText[32];
+    if (::localtime_r(&writeTime, &localWriteTime) == nullptr
+        || std::strftime(timeText, sizeof(timeText), "%m/%d %H:%M", &localWriteTime) == 0) {
+        std::strcpy(timeText, "-");
+    }
+    text += timeText;
+    text += ' ';
+    text += name;
+    text += '\n';
+}
+
+enum class SortKey { Unsorted, Name, Natural, Time, Size, Extension };
+
+// Orders directory entries for ls. Keys are extracted once into flat arrays
+// (collation keys, 64-bit times or sizes, extensions), so comparisons
+// never re-stat or re-transform a name. Name order uses a merge sort whose
+// runs are sorted in parallel for large directories; time and size order is
+// a stable LSD radix pass over that, so ties stay in name order.
+class EntrySorter {
+
+public:
+    // Returns the indices of names in display order. Time and size need
+    // metadata for every entry.
+    static std::vector<uint32_t> sort(const NameArena& names, const std::vector<EntryMetadata>* metadata, SortKey key, size_t threads) {
+        std::vector<uint32_t> order(names.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        if (key == SortKey::Unsorted || names.size() < 2) {
+            return order;
+        }
+
+        // Collation keys: the names themselves in the C locale, otherwise
+        // strxfrm output, which compares correctly with memcmp
+        NameArena transformed;
+        const NameArena* keys = &names;
+        if (key == SortKey::Natural) {
+            buildNaturalKeys(names, transformed);
+            keys = &transformed;
+        } else if (!byteCollation()) {
+            buildCollationKeys(names, transformed);
+            keys = &transformed;
+        }
+        std::vector<std::string_view> nameKeys(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            nameKeys[i] = keys->name(i);
+        }
+
+        if (key == SortKey::Extension) {
+            std::vector<std::string_view> extensions(names.size());
+            for (size_t i = 0; i < names.size(); ++i) {
+                extensions[i] = extensionOf(names.name(i));
+            }
+            parallelSort(order, threads, [&](uint32_t a, uint32_t b) {
+                int compared = extensions[a].compare(extensions[b]);
+                if (compared == 0) {
+                    compared = nameKeys[a].compare(nameKeys[b]);
+                }
+                return compared != 0 ? compared < 0 : a < b;
+            });
+            return order;
+        }
+
+        // Equal keys ("07" and "7" naturally) keep directory order, so the
+        // result does not depend on how the runs were split
+        parallelSort(order, threads, [&](uint32_t a, uint32_t b) {
+            int compared = nameKeys[a].compare(nameKeys[b]);
+            return compared != 0 ? compared < 0 : a < b;
+        });
+
+        if ((key == SortKey::Time || key == SortKey::Size) && metadata != nullptr) {
+            // Newest or largest first: radix sort on the inverted key
+            std::vector<uint64_t> numbers(names.size());
+            for (size_t i = 0; i < names.size(); ++i) {
+                const EntryMetadata& entry = (*metadata)[i];
+                int64_t value = 0;
+                if (entry.error == 0) {
+                    value = key == SortKey::Size ? static_cast<int64_t>(entry.stx.stx_size)
+                                                 : entry.stx.stx_mtime.tv_sec * 1000000000LL + entry.stx.stx_mtime.tv_nsec;
+                }
+                numbers[i] = ~(static_cast<uint64_t>(value) ^ (uint64_t(1) << 63));
+            }
+            radixSort(order, numbers);
+        }
+        return order;
+    }
+
+private:
+    static constexpr size_t parallelThreshold = 1 << 16;
+
+    static bool byteCollation() {
+        const char* locale = std::setlocale(LC_COLLATE, nullptr);
+        return locale == nullptr || std::strcmp(locale, "C") == 0 || std::strcmp(locale, "POSIX") == 0;
+    }
+
+    static void buildCollationKeys(const NameArena& names, NameArena& keys) {
+        std::vector<char> buffer(256);
+        for (size_t i = 0; i < names.size(); ++i) {
+            size_t length = std::strxfrm(buffer.data(), names.c_str(i), buffer.size());
+            if (length >= buffer.size()) {
+                buffer.resize(length + 1);
+                std::strxfrm(buffer.data(), names.c_str(i), buffer.size());
+            }
+            keys.add(std::string_view(buffer.data(), length), 0);
+        }
+    }
+
+    // Rewrites every run of digits as '0', its significant length, then the
+    // digits, so plain byte comparison orders "file9" before "file10".
+    static void buildNaturalKeys(const NameArena& names, NameArena& keys) {
+        std::string key;
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::string_view name = names.name(i);
+            key.clear();
+            for (size_t p = 0; p < name.size();) {
+                if (name[p] < '0' || name[p] > '9') {
+                    key += name[p++];
+                    continue;
+                }
+                size_t start = p;
+                while (p < name.size() && name[p] >= '0' && name[p] <= '9') {
+                    ++p;
+                }
+                size_t first = start;
+                while (first + 1 < p && name[first] == '0') {
+                    ++first;
+                }
+                key += '0';
+                key += static_cast<char>(std::min<size_t>(p - first, 255));
+                key.append(name.data() + first, p - first);
+            }
+            keys.add(key, 0);
+        }
+    }
+
+    // Text after the last dot; hidden names without another dot have none
+    static std::string_view extensionOf(std::string_view name) {
+        size_t dot = name.rfind('.');
+        return dot == std::string_view::npos || dot == 0 ? std::string_view() : name.substr(dot + 1);
+    }
+
+    // Sorts runs on a pool, then merges them pairwise
+    template <typename Less>
+    static void parallelSort(std::vector<uint32_t>& order, size_t threads, Less less) {
+        if (order.size() < parallelThreshold || threads < 2) {
+            std::sort(order.begin(), order.end(), less);
+            return;
+        }
+
+        size_t runs = std::min<size_t>(threads, order.size() / (parallelThreshold / 4));
+        std::vector<size_t> bounds;
+        for (size_t r = 0; r <= runs; ++r) {
+            bounds.push_back(order.size() * r / runs);
+        }
+
+        ThreadPool pool(threads);
+        for (size_t r = 0; r < runs; ++r) {
+            pool.submit([&, r] { std::sort(order.begin() + bounds[r], order.begin() + bounds[r + 1], less); });
+        }
+        pool.wait();
+
+        std::vector<uint32_t> buffer(order.size());
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged;
+            for (size_t r = 0; r + 1 < bounds.size(); r += 2) {
+                size_t begin = bounds[r];
+                size_t middle = bounds[r + 1];
+                size_t end = r + 2 < bounds.size() ? bounds[r + 2] : middle;
+                pool.submit([&, begin, middle, end] {
+                    std::merge(order.begin() + begin, order.begin() + middle, order.begin() + middle, order.begin() + end,
+                               buffer.begin() + begin, less);
+                });
+                merged.push_back(begin);
+            }
+            merged.push_back(order.size());
+            pool.wait();
+            order.swap(buffer);
+            bounds.swap(merged);
+        }
+    }
+
+    // Stable LSD radix sort of order by keys[order[i]], one byte per pass;
+    // passes where every key has the same byte are skipped
+    static void radixSort(std::vector<uint32_t>& order, const std::vector<uint64_t>& keys) {
+        std::vector<uint32_t> buffer(order.size());
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[257] = {};
+            for (uint32_t index : order) {
+                ++counts[((keys[index] >> shift) & 0xff) + 1];
+            }
+            if (std::find(std::begin(counts) + 1, std::end(counts), order.size()) != std::end(counts)) {
+                continue;
+            }
+            for (size_t b = 1; b < 257; ++b) {
+                counts[b] += counts[b - 1];
+            }
+            for (uint32_t index : order) {
+                buffer[counts[(keys[index] >> shift) & 0xff]++] = index;
+            }
+            order.swap(buffer);
+        }
+    }
+};
+
+// Raises the soft open-file limit to the hard limit; fd-relative tree walks
+// keep one descriptor open per directory still being processed.
+void raiseOpenFileLimit() {
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Recursive delete that works on directory file descriptors. Every directory
+// is opened with openat(O_NOFOLLOW) relative to its already-open parent and
+// its entries are removed with unlinkat, so a directory swapped for a symlink
+// during the walk is unlinked rather than followed. Sub-directories are
+// processed in parallel; a directory is removed by whichever task finishes
+// its last child.
+class ParallelRemover {
+
+public:
+    explicit ParallelRemover(size_t threadCount) : pool(threadCount) {
+        raiseOpenFileLimit();
+    }
+
+    // Removes the directory `name` inside the open directory `parentFd`.
+    void removeTree(int parentFd, const fs::path& path) {
+        auto start = std::chrono::steady_clock::now();
+
+        auto root = std::make_shared<DirNode>();
+        root->fd.reset(::dup(parentFd));
+        root->path = path.parent_path().string();
+        root->pending = 1;
+
+        std::vector<PendingDirectory> stack;
+        removeEntry(root, path.filename().string(), DT_DIR, stack);
+        drain(stack);
+        pool.wait();
+        elapsed = std::chrono::steady_clock::now() - start;
+
+        std::sort(errors.begin(), errors.end());
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& getErrors() const {
+        return errors;
+    }
+
+    uintmax_t entriesRemoved() const {
+        return removed.load();
+    }
+
+    double seconds() const {
+        return elapsed.count();
+    }
+
+private:
+    struct DirNode {
+        FileDescriptor fd;
+        std::shared_ptr<DirNode> parent;
+        std::string name;
+        std::string path;
+        // Children still being removed, plus one for this directory's own scan
+        std::atomic<size_t> pending{0};
+        // Children on the scanning thread's stack that are not opened yet.
+        // Once they all are, fd is closed until a child is removed, which
+        // reopens it through the child's "..", checked by device and inode.
+        size_t stacked = 0;
+        std::mutex fdMutex;
+        dev_t device = 0;
+        ino_t inode = 0;
+    };
+
+    // A sub-directory left on a thread's own work stack. It is opened only
+    // when its turn comes, so waiting siblings hold no descriptors.
+    struct PendingDirectory {
+        std::shared_ptr<DirNode> parent;
+        std::string name;
+    };
+
+    // Above this many queued tasks, sub-directories stay on the current
+    // thread's stack instead of being queued, to bound the number of open
+    // directory descriptors.
+    static constexpr size_t maxQueuedDirectories = 256;
+    static constexpr size_t unlinkBatchSize = 256;
+
+    void removeEntry(const std::shared_ptr<DirNode>& parent, const std::string& name, unsigned char type,
+                     std::vector<PendingDirectory>& stack) {
+        if (type != DT_DIR && type != DT_UNKNOWN) {
+            unlinkFile(parent, name);
+        } else if (pool.pendingTasks() >= maxQueuedDirectories) {
+            parent->pending.fetch_add(1, std::memory_order_relaxed);
+            ++parent->stacked;
+            stack.push_back(PendingDirectory{parent, name});
+        } else if (std::shared_ptr<DirNode> node = openDirectory(parent, name)) {
+            parent->pending.fetch_add(1, std::memory_order_relaxed);
+            pool.submit([this, node] { removeDirectories(node); });
+        }
+    }
+
+    // Opens `name` for scanning. Entries that turn out not to be directories
+    // are unlinked as files and yield nullptr, as do errors.
+    std::shared_ptr<DirNode> openDirectory(const std::shared_ptr<DirNode>& parent, const std::string& name) {
+        int fd = ::openat(parent->fd.get(), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOTDIR || errno == ELOOP) {
+                unlinkFile(parent, name);
+            } else {
+                recordError(parent, name, errno);
+            }
+            return nullptr;
+        }
+        auto node = std::make_shared<DirNode>();
+        node->fd.reset(fd);
+        node->parent = parent;
+        node->name = name;
+        node->path = parent->path.empty() ? name : parent->path + "/" + name;
+        node->pending = 1;
+        return node;
+    }
+
+    void unlinkFile(const std::shared_ptr<DirNode>& parent, const std::string& name) {
+        countSyscall(SyscallKind::Unlinkat);
+        if (::unlinkat(parent->fd.get(), name.c_str(), 0) == 0) {
+            removed.fetch_add(1, std::memory_order_relaxed);
+        } else if (errno != ENOENT) {
+            recordError(parent, name, errno);
+        }
+    }
+
+    // Scans `node`, then depth first the sub-directories this thread kept
+    // for itself. The explicit stack keeps deep trees off the call stack,
+    // and closing directories that only wait for their children keeps a
+    // deep chain from holding a descriptor per level.
+    void removeDirectories(const std::shared_ptr<DirNode>& node) {
+        std::vector<PendingDirectory> stack;
+        scanDirectory(node, stack);
+        drain(stack);
+    }
+
+    void drain(std::vector<PendingDirectory>& stack) {
+        while (!stack.empty() && !cancellationRequested()) {
+            PendingDirectory next = std::move(stack.back());
+            stack.pop_back();
+            std::shared_ptr<DirNode> node = openDirectory(next.parent, next.name);
+            --next.parent->stacked;
+            if (node == nullptr) {
+                finish(next.parent);
+                continue;
+            }
+            if (next.parent->stacked == 0) {
+                closeWaiting(*next.parent, 0);
+            }
+            scanDirectory(node, stack);
+        }
+    }
+
+    void scanDirectory(const std::shared_ptr<DirNode>& node, std::vector<PendingDirectory>& stack) {
+        IoUring* ring = IoUring::forThread();
+        bool batchUnlinks = ring != nullptr && ring->supports(IORING_OP_UNLINKAT);
+        NameArena files;
+
+        DirectoryReader reader(node->fd.get());
+        std::string_view name;
+        unsigned char type;
+        while (!cancellationRequested() && reader.next(name, type)) {
+            if (batchUnlinks && type != DT_DIR && type != DT_UNKNOWN) {
+                files.add(name, type);
+                if (files.size() == unlinkBatchSize) {
+                    unlinkBatch(*ring, node, files, stack);
+                }
+            } else {
+                removeEntry(node, std::string(name), type, stack);
+            }
+        }
+        if (files.size() != 0) {
+            unlinkBatch(*ring, node, files, stack);
+        }
+        if (reader.error() != 0) {
+            recordError(node->parent, node->name, reader.error());
+        }
+        if (node->stacked == 0) {
+            closeWaiting(*node, 1);
+        }
+        finish(node);
+    }
+
+    // Unlinks a batch of non-directory entries through io_uring and clears it.
+    // Entries replaced by a directory since they were listed are removed
+    // after the batch, so nothing re-enters the ring while it is reaping.
+    void unlinkBatch(IoUring& ring, const std::shared_ptr<DirNode>& node, NameArena& files,
+                     std::vector<PendingDirectory>& stack) {
+        std::vector<size_t> directories;
+        ring.runBatch(files.size(),
+            [&](size_t i, io_uring_sqe* sqe) { IoUring::prepareUnlinkat(sqe, node->fd.get(), files.c_str(i), 0); },
+            [&](size_t i, int res) {
+                countSyscall(SyscallKind::Unlinkat);
+                if (res == 0) {
+                    removed.fetch_add(1, std::memory_order_relaxed);
+                } else if (res == -EISDIR) {
+                    directories.push_back(i);
+                } else if (res != -ENOENT) {
+                    recordError(node, std::string(files.name(i)), -res);
+                }
+            },
+            [&](size_t i) { unlinkFile(node, std::string(files.name(i))); });
+        for (size_t i : directories) {
+            removeEntry(node, std::string(files.name(i)), DT_DIR, stack);
+        }
+        files.clear();
+    }
+
+    // Closes a directory that has been scanned and opened all its
+    // sub-directories, if some of them are still being removed; `held` is
+    // the number of references the caller still holds. The directory is not
+    // needed again until one of its sub-directories is removed.
+    void closeWaiting(DirNode& node, size_t held) {
+        std::lock_guard<std::mutex> lock(node.fdMutex);
+        struct stat st;
+        if (node.pending.load(std::memory_order_relaxed) > held && ::fstat(node.fd.get(), &st) == 0) {
+            node.device = st.st_dev;
+            node.inode = st.st_ino;
+            node.fd.reset();
+        }
+    }
+
+    // Drops one pending reference; the last one removes the directory itself
+    // and propagates completion to its parent. References are dropped under
+    // the directory's lock, so the last one always finds its fd open.
+    void finish(std::shared_ptr<DirNode> node) {
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(node->fdMutex);
+            last = node->pending.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+        while (last && node->parent) {
+            // A cancelled walk leaves the directory behind, not empty
+            if (cancellationRequested()) {
+                return;
+            }
+            DirNode& parent = *node->parent;
+            std::lock_guard<std::mutex> lock(parent.fdMutex);
+            if (parent.fd.get() < 0) {
+                FileDescriptor reopened(::openat(node->fd.get(), "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                struct stat st;
+                if (reopened.get() < 0 || ::fstat(reopened.get(), &st) != 0) {
+                    recordError(node->parent, node->name, errno);
+                    return;
+                } else if (st.st_dev != parent.device || st.st_ino != parent.inode) {
+                    // Moved while we were inside it
+                    recordError(node->parent, node->name, ESTALE);
+                    return;
+                }
+                parent.fd = std::move(reopened);
+            }
+            node->fd.reset();
+            countSyscall(SyscallKind::Unlinkat);
+            if (::unlinkat(parent.fd.get(), node->name.c_str(), AT_REMOVEDIR) == 0) {
+                removed.fetch_add(1, std::memory_order_relaxed);
+            } else if (errno != ENOENT) {
+                recordError(node->parent, node->name, errno);
+            }
+            last = parent.pending.fetch_sub(1, std::memory_order_acq_rel) == 1;
+            node = node->parent;
+        }
+    }
+
+    void recordError(const std::shared_ptr<DirNode>& parent, const std::string& name, int error) {
+        std::string path = parent->path.empty() ? name : parent->path + "/" + name;
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.emplace_back(path, std::generic_category().message(error));
+    }
+
+    ThreadPool pool;
+    std::atomic<uintmax_t> removed{0};
+    std::mutex errorMutex;
+    std::vector<std::pair<std::string, std::string>> errors;
+    std::chrono::duration<double> elapsed{0};
+};
+
+// renameat2 that degrades on file systems rejecting RENAME_NOREPLACE: the
+// target is then checked separately, which is only as racy as plain rename.
+// Returns 0 or an errno value.
+int renameEntry(int oldDirFd, const char* oldName, int newDirFd, const char* newName, unsigned int flags) {
+    if (::renameat2(oldDirFd, oldName, newDirFd, newName, flags) == 0) {
+        return 0;
+    }
+    int error = errno;
+    if (error == EINVAL && (flags & RENAME_NOREPLACE) != 0) {
+        struct stat st;
+        if (::fstatat(newDirFd, newName, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            return EEXIST;
+        }
+        return ::renameat(oldDirFd, oldName, newDirFd, newName) == 0 ? 0 : errno;
+    }
+    return error;
+}
+
+// Moves entries to another file system. Each one is copied under a hidden
+// temporary name next to its target, renamed into place with the caller's
+// flags, and the source is removed only after that succeeded. Files are
+// moved in parallel on a pool; a directory is copied with ParallelCopier and
+// removed with ParallelRemover, which are parallel themselves.
+class CrossDeviceMover {
+
+public:
+    struct Item {
+        fs::path source;
+        fs::path target;
+        unsigned char type;
+        unsigned int flags;
+    };
+
+    CrossDeviceMover(size_t threadCount) : pool(threadCount), jobs(threadCount) {}
+
+    // Calls report() on this thread about once a second while files are
+    // still being copied
+    void run(const std::vector<Item>& items, const std::function<void()>& report) {
+        auto start = std::chrono::steady_clock::now();
+        total = items.size();
+        for (const Item& item : items) {
+            if (item.type != DT_DIR) {
+                pool.submit([this, &item] {
+                    moveFile(item);
+                    finishItem();
+                });
+            }
+        }
+
+        for (const Item& item : items) {
+            if (item.type == DT_DIR) {
+                moveDirectory(item);
+                finishItem();
+                report();
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(progressMutex);
+        while (finished < total) {
+            if (!progress.wait_for(lock, std::chrono::seconds(1), [this] { return finished == total; })) {
+                lock.unlock();
+                report();
+                lock.lock();
+            }
+        }
+        lock.unlock();
+        pool.wait();
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::sort(errors.begin(), errors.end());
+    }
+
+    size_t itemsFinished() {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        return finished;
+    }
+
+    size_t itemCount() const {
+        return total;
+    }
+
+    uintmax_t filesMoved() const {
+        return files.load();
+    }
+
+    uintmax_t bytesMoved() const {
+        return bytes.load();
+    }
+
+    double seconds() const {
+        return elapsed.count();
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& getErrors() const {
+        return errors;
+    }
+
+    // Items whose target already existed and RENAME_NOREPLACE was set
+    const std::vector<fs::path>& skippedTargets() const {
+        return skipped;
+    }
+
+private:
+    static fs::path temporaryPath(const fs::path& target) {
+        return target.parent_path() / ("." + target.filename().string() + ".mv-" + std::to_string(::getpid()));
+    }
+
+    void moveFile(const Item& item) {
+        if (cancellationRequested()) {
+            return;
+        }
+        fs::path temporary = temporaryPath(item.target);
+        std::error_code ec;
+        uintmax_t size = 0;
+        struct stat st;
+        if (::lstat(item.source.c_str(), &st) != 0) {
+            recordError(item.source, errno);
+            return;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+            fs::copy_symlink(item.source, temporary, ec);
+        } else {
+            copyFileData(item.source, temporary, ReflinkMode::Auto, size, ec);
+            if (!ec) {
+                // Keep the times, as a rename would
+                struct timespec times[2] = {st.st_atim, st.st_mtim};
+                ::utimensat(AT_FDCWD, temporary.c_str(), times, 0);
+            }
+        }
+        if (ec) {
+            recordError(item.source, ec.value());
+            return;
+        }
+
+        if (!placeTemporary(item, temporary)) {
+            ::unlink(temporary.c_str());
+            return;
+        }
+        if (::unlink(item.source.c_str()) != 0) {
+            recordError(item.source, errno);
+            return;
+        }
+        files.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void moveDirectory(const Item& item) {
+        if (cancellationRequested()) {
+            return;
+        }
+        fs::path temporary = temporaryPath(item.target);
+        ParallelCopier copier(jobs, ReflinkMode::Auto);
+        copier.copyTree(item.source, temporary);
+
+        bool copied = copier.getErrors().empty() && !cancellationRequested();
+        for (const auto& error : copier.getErrors()) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            errors.push_back(error);
+        }
+        if (!copied || !placeTemporary(item, temporary)) {
+            // Leave the source alone and drop the partial copy, also when
+            // the copy was cancelled half-way
+            const std::atomic<bool>* flag = activeCancelFlag();
+            activeCancelFlag() = nullptr;
+            removeTree(temporary);
+            activeCancelFlag() = flag;
+            return;
+        }
+        removeTree(item.source);
+        files.fetch_add(copier.filesCopied(), std::memory_order_relaxed);
+        bytes.fetch_add(copier.bytesCopied(), std::memory_order_relaxed);
+    }
+
+    bool placeTemporary(const Item& item, const fs::path& temporary) {
+        int error = renameEntry(AT_FDCWD, temporary.c_str(), AT_FDCWD, item.target.c_str(), item.flags);
+        if (error == EEXIST && (item.flags & RENAME_NOREPLACE) != 0) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            skipped.push_back(item.target);
+            return false;
+        }
+        if (error != 0) {
+            recordError(item.target, error);
+            return false;
+        }
+        return true;
+    }
+
+    void removeTree(const fs::path& path) {
+        fs::path parent = path.parent_path().empty() ? fs::path(".") : path.parent_path();
+        FileDescriptor parentFd(::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (parentFd.get() < 0) {
+            recordError(parent, errno);
+            return;
+        }
+        ParallelRemover remover(jobs);
+        remover.removeTree(parentFd.get(), path);
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.insert(errors.end(), remover.getErrors().begin(), remover.getErrors().end());
+    }
+
+    void finishItem() {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        if (++finished == total) {
+            progress.notify_all();
+        }
+    }
+
+    void recordError(const fs::path& path, int error) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.emplace_back(path.string(), std::generic_category().message(error));
+    }
+
+    ThreadPool pool;
+    size_t jobs;
+    size_t total = 0;
+    size_t finished = 0;
+    std::mutex progressMutex;
+    std::condition_variable progress;
+    std::atomic<uintmax_t> files{0};
+    std::atomic<uintmax_t> bytes{0};
+    std::mutex errorMutex;
+    std::vector<std::pair<std::string, std::string>> errors;
+    std::vector<fs::path> skipped;
+    std::chrono::duration<double> elapsed{0};
+};
+
+// Fixed-point number for OutputWriter, e.g. out() << fixed(seconds, 3).
+struct FixedPoint {
+    double value;
+    int decimals;
+};
+
+FixedPoint fixed(double value, int decimals) {
+    return FixedPoint{value, decimals};
+}
+
+// Buffered writer for everything the shell prints. Output is collected in a
+// large buffer and written with one write(2) when the buffer fills, when a
+// command finishes and before the prompt. When the target is a terminal a
+// completed line is flushed right away so interactive output is not delayed.
+// Numbers are formatted with to_chars, bypassing iostream locale handling.
+class OutputWriter {
+
+public:
+    explicit OutputWriter(int fd) : fd(fd), lineFlush(::isatty(fd) == 1) {
+        buffer.reserve(bufferSize);
+    }
+
+    ~OutputWriter() {
+        flush();
+    }
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    OutputWriter& operator<<(std::string_view text) {
+        if (buffer.size() + text.size() > bufferSize) {
+            flush();
+            if (text.size() > bufferSize) {
+                writeAll(text.data(), text.size());
+                return *this;
+            }
+        }
+        buffer.append(text.data(), text.size());
+        if (lineFlush && !text.empty() && text.back() == '\n') {
+            flush();
+        }
+        return *this;
+    }
+
+    OutputWriter& operator<<(const std::string& text) {
+        return *this << std::string_view(text);
+    }
+
+    OutputWriter& operator<<(const char* text) {
+        return *this << std::string_view(text);
+    }
+
+    OutputWriter& operator<<(char c) {
+        if (buffer.size() + 1 > bufferSize) {
+            flush();
+        }
+        buffer.push_back(c);
+        if (lineFlush && c == '\n') {
+            flush();
+        }
+        return *this;
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char> && !std::is_same_v<T, bool>>>
+    OutputWriter& operator<<(T value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, result.ptr - digits);
+    }
+
+    OutputWriter& operator<<(FixedPoint number) {
+        char digits[64];
+        int length = std::snprintf(digits, sizeof(digits), "%.*f", number.decimals, number.value);
+        return *this << std::string_view(digits, std::max(0, std::min<int>(length, sizeof(digits) - 1)));
+    }
+
+    // Paths are quoted the same way std::ostream prints them
+    OutputWriter& operator<<(const fs::path& path) {
+        std::ostringstream quoted;
+        quoted << path;
+        return *this << quoted.str();
+    }
+
+    int fileDescriptor() const {
+        return fd;
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            writeAll(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+private:
+    static constexpr size_t bufferSize = 64 * 1024;
+
+    void writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Reader went away (e.g. closed pipe): drop the output
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    int fd;
+    bool lineFlush;
+    std::string buffer;
+};
+
+OutputWriter*& activeOutput() {
+    thread_local OutputWriter* active = nullptr;
+    return active;
+}
+
+// The writer for the current thread: stdout, unless a pipeline stage has
+// redirected this thread's output.
+OutputWriter& out() {
+    static OutputWriter writer(STDOUT_FILENO);
+    OutputWriter* active = activeOutput();
+    return active != nullptr ? *active : writer;
+}
+
+int& activeInputFd() {
+    thread_local int fd = STDIN_FILENO;
+    return fd;
+}
+
+// Reads the answer to a confirmation prompt from the builtin's input: the
+// terminal in the foreground, the pipe in a pipeline, and /dev/null in a
+// background job, where the empty answer means no. The shell's own stdin
+// goes through std::cin, which may already hold the next lines.
+std::string readAnswer() {
+    std::string answer;
+    int fd = activeInputFd();
+    if (fd == STDIN_FILENO) {
+        std::getline(std::cin, answer);
+        return answer;
+    }
+    char c;
+    ssize_t result;
+    while ((result = ::read(fd, &c, 1)) == 1 || (result < 0 && errno == EINTR)) {
+        if (result == 1) {
+            if (c == '\n') {
+                break;
+            }
+            answer += c;
+        }
+    }
+    return answer;
+}
+
+// Exit status of the builtin running on this thread; builtins set it to 1
+// when they report an error.
+int& builtinStatus() {
+    thread_local int status = 0;
+    return status;
+}
+
+// Points out() and the builtin input at other descriptors for the lifetime
+// of the object, so builtins can run as pipeline stages without forking.
+class StageRedirect {
+
+public:
+    StageRedirect(int inFd, int outFd) : previousOutput(activeOutput()), previousInput(activeInputFd()) {
+        if (inFd >= 0) {
+            activeInputFd() = inFd;
+        }
+        if (outFd >= 0) {
+            writer = std::make_unique<OutputWriter>(outFd);
+            activeOutput() = writer.get();
+        }
+    }
+
+    ~StageRedirect() {
+        if (writer) {
+            writer->flush();
+        }
+        activeOutput() = previousOutput;
+        activeInputFd() = previousInput;
+    }
+
+    StageRedirect(const StageRedirect&) = delete;
+    StageRedirect& operator=(const StageRedirect&) = delete;
+
+private:
+    std::unique_ptr<OutputWriter> writer;
+    OutputWriter* previousOutput;
+    int previousInput;
+};
+
+// Moves everything readable from `in` to `out`. When either side is a pipe the
+// data is spliced inside the kernel; file to non-pipe uses sendfile; anything
+// else falls back to read/write.
+bool transferData(int in, int out, int& error) {
+    struct stat inStat;
+    struct stat outStat;
+    if (::fstat(in, &inStat) != 0 || ::fstat(out, &outStat) != 0) {
+        error = errno;
+        return false;
+    }
+
+    uintmax_t copied = 0;
+    if (S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode)) {
+        while (true) {
+            ssize_t n = ::splice(in, nullptr, out, nullptr, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n > 0) {
+                copied += n;
+                continue;
+            }
+            if (n == 0) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (copied != 0 || !isUnsupportedCopyError(errno)) {
+                error = errno;
+                return false;
+            }
+            break;
+        }
+    } else if (S_ISREG(inStat.st_mode)) {
+        while (true) {
+            ssize_t n = ::sendfile(out, in, nullptr, 1 << 30);
+            if (n > 0) {
+                copied += n;
+                continue;
+            }
+            if (n == 0) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (copied != 0 || !isUnsupportedCopyError(errno)) {
+                error = errno;
+                return false;
+            }
+            break;
+        }
+    }
+    return copyWithReadWrite(in, out, copied, error);
+}
+
+// Parallel directory tree walk for the recursive builtins. Every directory
+// is a task on a work-stealing pool. A task opens its directory with openat
+// relative to its parent's descriptor, reads it with getdents64 and hands
+// the entries to the visitor. The visitor writes that directory's output to
+// a buffer and picks the sub-directories to walk into. Buffers are spliced
+// together in the order a serial depth-first walk produces and streamed to
+// the sink once everything before them is out. The output is therefore the
+// same as a serial walk's.
+//
+// Directories the cursor has not reached yet keep their output buffered, so
+// workers must not run too far ahead of it. Once the buffers pass
+// maxBufferedBytes, a worker that takes a new task first walks the directory
+// the cursor waits for, or sleeps until the directory being walked there is
+// done. The queue is bounded too: above maxQueuedDirectories, children are
+// walked inline, first child first.
+//
+// With a thread count of 0 the walk is serial: every directory is visited
+// on the calling thread in output order, for visitors whose side effects
+// must happen in that order (find -exec).
+class TreeWalker {
+
+public:
+    // One directory as seen by the visitor
+    struct Directory {
+        int fd;
+        // The root as given, then root/a/b
+        const std::string& path;
+        size_t depth;
+        const NameArena& names;
+        // Empty unless the walker was given a statx mask
+        const std::vector<EntryMetadata>& metadata;
+        std::string& output;
+        std::vector<std::pair<size_t, uint32_t>>& descents;
+
+        // Walks into entry `index`; its output is spliced in at the current
+        // end of `output`
+        void descend(size_t index) {
+            descents.emplace_back(output.size(), static_cast<uint32_t>(index));
+        }
+
+        void appendPath(size_t index, std::string& text) const {
+            appendChildPath(path, names.name(index), text);
+        }
+    };
+
+    using Visitor = std::function<void(Directory&)>;
+    using Sink = std::function<void(std::string_view)>;
+
+    // Entries are stat'ed with `statxMask` before the visitor sees them,
+    // unless it is 0. Types that getdents64 leaves unknown are always filled
+    // in, so DT_DIR can be trusted.
+    TreeWalker(size_t threadCount, unsigned int statxMask) : statxMask(statxMask) {
+        if (threadCount > 0) {
+            pool = std::make_unique<ThreadPool>(threadCount);
+        }
+        raiseOpenFileLimit();
+    }
+
+    void walk(const std::string& root, OutputWriter& output, const Visitor& visit) {
+        walk(root, [&output](std::string_view text) { output << text; }, visit);
+    }
+
+    // Hands the output to `output` piece by piece, in serial walk order and
+    // one piece at a time. A piece never splits what the visitor wrote
+    // between two descend() calls.
+    void walk(const std::string& root, const Sink& output, const Visitor& visit) {
+        sink = &output;
+        visitor = &visit;
+        auto node = std::make_shared<Node>();
+        node->name = root;
+        node->path = root;
+        cursor.assign(1, Frame{node});
+        bufferedBytes = 0;
+        if (pool) {
+            node->claimed = true;
+            pool->submit([this, node] { visitNode(node); });
+            pool->wait();
+        } else {
+            visitNode(node);
+        }
+        std::sort(errors.begin(), errors.end());
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& getErrors() const {
+        return errors;
+    }
+
+    static void appendChildPath(const std::string& parent, std::string_view name, std::string& text) {
+        text += parent;
+        if (!parent.empty() && parent.back() != '/') {
+            text += '/';
+        }
+        text += name;
+    }
+
+private:
+    struct Node {
+        // The parent's descriptor, held until this directory is opened
+        std::shared_ptr<FileDescriptor> parentFd;
+        std::string name;
+        std::string path;
+        size_t depth = 0;
+        std::string output;
+        // Offset in output where each child's output goes
+        std::vector<std::pair<size_t, std::shared_ptr<Node>>> children;
+        // Set by the one thread that walks this directory
+        std::atomic<bool> claimed{false};
+        // Guarded by emitMutex
+        bool visited = false;
+    };
+
+    // Position of the in-order output cursor within one directory
+    struct Frame {
+        std::shared_ptr<Node> node;
+        size_t child = 0;
+        size_t offset = 0;
+    };
+
+    // Above this many queued tasks, sub-directories are walked inline to
+    // bound the number of open descriptors and buffered directories.
+    static constexpr size_t maxQueuedDirectories = 256;
+    // Above this much output waiting for the cursor, workers help the cursor
+    // instead of starting new directories.
+    static constexpr size_t maxBufferedBytes = 16 << 20;
+
+    // A task on the pool. The cursor may have walked the directory already.
+    void runTask(const std::shared_ptr<Node>& node) {
+        helpCursor();
+        if (!node->claimed.exchange(true)) {
+            visitNode(node);
+        }
+    }
+
+    // Walks the directories the cursor waits for until the buffered output
+    // is back under the limit
+    void helpCursor() {
+        std::unique_lock<std::mutex> lock(emitMutex);
+        while (bufferedBytes > maxBufferedBytes && !cursor.empty()) {
+            // After advance() the cursor always waits for an unvisited node;
+            // if it is claimed, its thread is scanning it and will notify
+            std::shared_ptr<Node> next = cursor.back().node;
+            if (next->claimed.exchange(true)) {
+                emitted.wait(lock);
+                continue;
+            }
+            lock.unlock();
+            visitNode(next);
+            lock.lock();
+        }
+    }
+
+    void visitNode(const std::shared_ptr<Node>& node) {
+        if (!cancellationRequested()) {
+            scan(*node);
+        }
+        std::vector<std::shared_ptr<Node>> children;
+        for (const auto& child : node->children) {
+            children.push_back(child.second);
+        }
+        {
+            std::lock_guard<std::mutex> lock(emitMutex);
+            node->visited = true;
+            bufferedBytes += node->output.size();
+            advance();
+        }
+
+        if (!pool) {
+            for (const auto& child : children) {
+                visitNode(child);
+            }
+            return;
+        }
+        emitted.notify_all();
+
+        // Own tasks run last-in first-out, so submitting the last child first
+        // makes the first one, which the cursor waits for, run next. When the
+        // queue is full the remaining children, the first ones, are walked
+        // here in order.
+        std::vector<std::shared_ptr<Node>> inlined;
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            if (pool->pendingTasks() < maxQueuedDirectories) {
+                pool->submit([this, child = *it] { runTask(child); });
+            } else {
+                inlined.push_back(*it);
+            }
+        }
+        for (auto it = inlined.rbegin(); it != inlined.rend(); ++it) {
+            if (!(*it)->claimed.exchange(true)) {
+                visitNode(*it);
+            }
+        }
+    }
+
+    void scan(Node& node) {
+        int parentFd = node.parentFd ? node.parentFd->get() : AT_FDCWD;
+        int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (node.parentFd ? O_NOFOLLOW : 0);
+        auto fd = std::make_shared<FileDescriptor>(::openat(parentFd, node.name.c_str(), flags));
+        node.parentFd.reset();
+        if (fd->get() < 0) {
+            recordError(node.path, errno);
+            return;
+        }
+
+        NameArena names;
+        DirectoryReader reader(fd->get());
+        std::string_view name;
+        unsigned char type;
+        while (reader.next(name, type)) {
+            if (type == DT_UNKNOWN) {
+                type = resolveType(fd->get(), name.data());
+            }
+            names.add(name, type);
+        }
+        if (reader.error() != 0) {
+            recordError(node.path, reader.error());
+        }
+
+        std::vector<EntryMetadata> metadata;
+        if (statxMask != 0) {
+            metadata = fetchDirectoryMetadata(fd->get(), names, statxMask);
+        }
+        std::vector<std::pair<size_t, uint32_t>> descents;
+        Directory directory{fd->get(), node.path, node.depth, names, metadata, node.output, descents};
+        (*visitor)(directory);
+
+        for (const auto& descent : descents) {
+            auto child = std::make_shared<Node>();
+            child->parentFd = fd;
+            child->name = names.name(descent.second);
+            appendChildPath(node.path, child->name, child->path);
+            child->depth = node.depth + 1;
+            node.children.emplace_back(descent.first, std::move(child));
+        }
+    }
+
+    // Writes out everything that is ready in serial walk order; emitMutex held
+    void advance() {
+        while (!cursor.empty()) {
+            Frame& frame = cursor.back();
+            Node& node = *frame.node;
+            if (!node.visited) {
+                return;
+            }
+            size_t end = frame.child < node.children.size() ? node.children[frame.child].first : node.output.size();
+            if (end > frame.offset) {
+                (*sink)(std::string_view(node.output).substr(frame.offset, end - frame.offset));
+                bufferedBytes -= end - frame.offset;
+                frame.offset = end;
+            }
+            if (frame.child < node.children.size()) {
+                std::shared_ptr<Node> child = std::move(node.children[frame.child++].second);
+                cursor.push_back(Frame{std::move(child)});
+                continue;
+            }
+            std::string().swap(node.output);
+            cursor.pop_back();
+        }
+    }
+
+    static unsigned char resolveType(int dirFd, const char* name) {
+        struct stat st;
+        if (::fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return DT_UNKNOWN;
+        }
+        return IFTODT(st.st_mode);
+    }
+
+    void recordError(const std::string& path, int error) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.emplace_back(path, std::generic_category().message(error));
+    }
+
+    // Null for a serial walk
+    std::unique_ptr<ThreadPool> pool;
+    unsigned int statxMask;
+    const Sink* sink = nullptr;
+    const Visitor* visitor = nullptr;
+    std::mutex emitMutex;
+    std::condition_variable emitted;
+    std::vector<Frame> cursor;
+    // Output of visited directories that the cursor has not written yet
+    size_t bufferedBytes = 0;
+    std::mutex errorMutex;
+    std::vector<std::pair<std::string, std::string>> errors;
+};
+
+// Files seen so far by device and inode, so du counts every hard-linked file
+// once: at the first of its names in walk order.
+class InodeSet {
+
+public:
+    static uint64_t deviceOf(const struct statx& stx) {
+        return (static_cast<uint64_t>(stx.stx_dev_major) << 32) | stx.stx_dev_minor;
+    }
+
+    // True the first time a file is seen
+    bool insert(uint64_t device, uint64_t inode) {
+        return keys.insert(Key{device, inode}).second;
+    }
+
+private:
+    struct Key {
+        uint64_t device;
+        uint64_t inode;
+
+        bool operator==(const Key& other) const {
+            return device == other.device && inode == other.inode;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            uint64_t hash = (key.inode ^ (key.device * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+            return static_cast<size_t>(hash ^ (hash >> 32));
+        }
+    };
+
+    std::unordered_set<Key, KeyHash> keys;
+};
+
+// Streaming 64-bit content hash for cp --sync --verify. This is XXH64: four
+// independent 64-bit lanes, each a multiply-rotate round per 8 bytes, so the
+// rounds overlap in the pipeline and hashing runs at memory bandwidth.
+class ContentHash {
+
+public:
+    void update(const void* data, size_t size) {
+        const unsigned char* input = static_cast<const unsigned char*>(data);
+        total += size;
+        if (buffered + size < stripeSize) {
+            std::memcpy(buffer + buffered, input, size);
+            buffered += size;
+            return;
+        }
+        if (buffered != 0) {
+            size_t fill = stripeSize - buffered;
+            std::memcpy(buffer + buffered, input, fill);
+            consume(buffer);
+            input += fill;
+            size -= fill;
+            buffered = 0;
+        }
+        for (; size >= stripeSize; input += stripeSize, size -= stripeSize) {
+            consume(input);
+        }
+        std::memcpy(buffer, input, size);
+        buffered = size;
+    }
+
+    uint64_t digest() const {
+        uint64_t hash;
+        if (total >= stripeSize) {
+            hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+            for (uint64_t lane : lanes) {
+                hash = (hash ^ round(0, lane)) * prime1 + prime4;
+            }
+        } else {
+            hash = prime5;
+        }
+        hash += total;
+
+        const unsigned char* tail = buffer;
+        size_t left = buffered;
+        for (; left >= 8; tail += 8, left -= 8) {
+            hash = rotate(hash ^ round(0, load<uint64_t>(tail)), 27) * prime1 + prime4;
+        }
+        if (left >= 4) {
+            hash = rotate(hash ^ (load<uint32_t>(tail) * prime1), 23) * prime2 + prime3;
+            tail += 4;
+            left -= 4;
+        }
+        for (; left > 0; ++tail, --left) {
+            hash = rotate(hash ^ (*tail * prime5), 11) * prime1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= prime2;
+        hash ^= hash >> 29;
+        hash *= prime3;
+        return hash ^ (hash >> 32);
+    }
+
+private:
+    static constexpr uint64_t prime1 = 11400714785074694791ull;
+    static constexpr uint64_t prime2 = 14029467366897019727ull;
+    static constexpr uint64_t prime3 = 1609587929392839161ull;
+    static constexpr uint64_t prime4 = 9650029242287828579ull;
+    static constexpr uint64_t prime5 = 2870177450012600261ull;
+    static constexpr size_t stripeSize = 32;
+
+    static uint64_t rotate(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t round(uint64_t lane, uint64_t input) {
+        return rotate(lane + input * prime2, 31) * prime1;
+    }
+
+    template <typename T>
+    static T load(const unsigned char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    void consume(const unsigned char* stripe) {
+        for (size_t lane = 0; lane < 4; ++lane) {
+            lanes[lane] = round(lanes[lane], load<uint64_t>(stripe + 8 * lane));
+        }
+    }
+
+    uint64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    unsigned char buffer[stripeSize];
+    size_t buffered = 0;
+    uint64_t total = 0;
+};
+
+// Progress of a cp --sync run, kept next to the destination so an
+// interrupted run can resume. Records are NUL-terminated and appended with
+// O_APPEND, so threads write them without a lock: a header naming the
+// source and the time the first run started, one record per directory whose
+// files are all in sync, and checkpoints every few hundred MiB inside large
+// files. A run that finishes without errors removes the journal; one that
+// fails keeps it, but only for maxAge, and only as a hint. A directory
+// record holds a fingerprint of its source files' names, sizes and mtimes,
+// and even then only destination files whose size and mtime still equal
+// the source's are skipped. A checkpoint holds the size and mtime of the
+// source and of the destination as the run left it, and is dropped if
+// either has changed since, so anything changed is compared again.
+class SyncJournal {
+
+public:
+    // Journals of runs that started longer ago than this are started afresh
+    static constexpr int64_t maxAge = 24 * 60 * 60;
+
+    // Loads the records of a recent earlier run for the same source, if any,
+    // and opens the journal for appending
+    bool open(const std::string& journalPath, const std::string& source, std::string& error) {
+        path = journalPath;
+        std::string text;
+        FileDescriptor existing(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        char buffer[65536];
+        ssize_t n;
+        while (existing.get() >= 0 && (n = ::read(existing.get(), buffer, sizeof(buffer))) > 0) {
+            text.append(buffer, n);
+        }
+
+        size_t end = text.find('\0');
+        int64_t now = std::time(nullptr);
+        int64_t started = now;
+        bool resuming = end != std::string::npos && parseHeader(std::string_view(text).substr(0, end), source, started)
+                        && started <= now && now - started < maxAge;
+        if (!resuming) {
+            started = now;
+        }
+        for (size_t start = end + 1; resuming && (end = text.find('\0', start)) != std::string::npos; start = end + 1) {
+            load(std::string_view(text).substr(start, end - start));
+        }
+
+        fd.reset(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resuming ? 0 : O_TRUNC), 0644));
+        if (fd.get() < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        if (!resuming) {
+            append(std::string(headerPrefix) + std::to_string(started) + " " + source);
+        }
+        return true;
+    }
+
+    size_t resumedDirectories() const {
+        return doneDirectories.size();
+    }
+
+    // Whether an earlier run had the directory in sync, and its files still
+    // have the names, sizes and mtimes they had then
+    bool directoryDone(const std::string& relative, uint64_t fingerprint) const {
+        auto it = doneDirectories.find(relative);
+        return it != doneDirectories.end() && it->second == fingerprint;
+    }
+
+    // Order-independent hash of a directory's non-directory entries, from
+    // the same statx the sync compares files by
+    static uint64_t fingerprint(const NameArena& names, const std::vector<EntryMetadata>& metadata) {
+        uint64_t sum = names.size();
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (metadata[i].error != 0 || S_ISDIR(metadata[i].stx.stx_mode)) {
+                continue;
+            }
+            std::string_view name = names.name(i);
+            uint64_t fields[] = {metadata[i].stx.stx_mode, metadata[i].stx.stx_size, static_cast<uint64_t>(mtimeOf(metadata[i].stx))};
+            ContentHash hash;
+            hash.update(name.data(), name.size());
+            hash.update(fields, sizeof(fields));
+            sum += hash.digest();
+        }
+        return sum;
+    }
+
+    // Offset up to which a large file was already in sync, if neither the
+    // source nor the destination has changed since
+    uint64_t resumeOffset(const std::string& relative, const struct statx& source, const struct stat& destination) const {
+        auto it = checkpoints.find(relative);
+        if (it == checkpoints.end() || it->second.size != source.stx_size || it->second.mtime != mtimeOf(source)
+            || it->second.destinationSize != static_cast<uint64_t>(destination.st_size)
+            || it->second.destinationMtime != mtimeOf(destination)) {
+            return 0;
+        }
+        return it->second.offset;
+    }
+
+    void recordDirectory(const std::string& relative, uint64_t fingerprint) {
+        append("D " + std::to_string(fingerprint) + " " + relative);
+    }
+
+    void recordOffset(const std::string& relative, const struct statx& source, const struct stat& destination,
+                      uint64_t offset) {
+        append("B " + std::to_string(offset) + " " + std::to_string(source.stx_size) + " "
+               + std::to_string(mtimeOf(source)) + " " + std::to_string(destination.st_size) + " "
+               + std::to_string(mtimeOf(destination)) + " " + relative);
+    }
+
+    void remove() {
+        fd.reset();
+        ::unlink(path.c_str());
+    }
+
+private:
+    struct Checkpoint {
+        uint64_t offset;
+        uint64_t size;
+        int64_t mtime;
+        uint64_t destinationSize;
+        int64_t destinationMtime;
+    };
+
+    static constexpr std::string_view headerPrefix = "myshell-sync 3 ";
+
+    static int64_t mtimeOf(const struct statx& stx) {
+        return stx.stx_mtime.tv_sec * 1000000000ll + stx.stx_mtime.tv_nsec;
+    }
+
+    static int64_t mtimeOf(const struct stat& st) {
+        return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    }
+
+    // "myshell-sync 3 <started> <source>"
+    static bool parseHeader(std::string_view header, const std::string& source, int64_t& started) {
+        if (header.substr(0, headerPrefix.size()) != headerPrefix) {
+            return false;
+        }
+        const char* end = header.data() + header.size();
+        auto result = std::from_chars(header.data() + headerPrefix.size(), end, started);
+        return result.ec == std::errc() && result.ptr != end && *result.ptr == ' '
+               && std::string_view(result.ptr + 1, end - result.ptr - 1) == source;
+    }
+
+    void load(std::string_view record) {
+        if (record.substr(0, 2) == "D ") {
+            uint64_t fingerprint;
+            const char* end = record.data() + record.size();
+            auto result = std::from_chars(record.data() + 2, end, fingerprint);
+            if (result.ec == std::errc() && result.ptr != end) {
+                doneDirectories[std::string(result.ptr + 1, end)] = fingerprint;
+            }
+            return;
+        }
+        if (record.substr(0, 2) != "B ") {
+            return;
+        }
+        // "B <offset> <size> <mtime> <destination size> <destination mtime> <path>"
+        Checkpoint checkpoint;
+        const char* position = record.data() + 2;
+        const char* end = record.data() + record.size();
+        auto field = [&](auto& value) {
+            auto result = std::from_chars(position, end, value);
+            if (result.ec != std::errc() || result.ptr == end) {
+                return false;
+            }
+            position = result.ptr + 1;
+            return true;
+        };
+        if (field(checkpoint.offset) && field(checkpoint.size) && field(checkpoint.mtime)
+            && field(checkpoint.destinationSize) && field(checkpoint.destinationMtime)) {
+            checkpoints[std::string(position, end)] = checkpoint;
+        }
+    }
+
+    // A record is one write, so concurrent appends never interleave
+    void append(std::string record) {
+        record += '\0';
+        if (fd.get() >= 0) {
+            ssize_t ignored = ::write(fd.get(), record.data(), record.size());
+            (void)ignored;
+        }
+    }
+
+    std::string path;
+    FileDescriptor fd;
+    std::unordered_map<std::string, uint64_t> doneDirectories;
+    std::unordered_map<std::string, Checkpoint> checkpoints;
+};
+
+// Incremental tree copy for cp --sync. Each directory is a task on a
+// work-stealing pool. It lists the source, then stats the same names in the
+// source and the destination, batched like ls -l. Files whose size and
+// mtime match are skipped without being opened. With `verify` they are
+// hashed on both sides instead. Changed files are copied, and large ones
+// only in the blocks that differ. A copied file gets the source's mtime
+// last, so a file cut short by an interruption never looks in sync.
+class TreeSyncer {
+
+public:
+    TreeSyncer(size_t threadCount, bool verify, ReflinkMode reflinkMode, SyncJournal* journal)
+        : pool(threadCount), verify(verify), reflinkMode(reflinkMode), journal(journal) {
+        raiseOpenFileLimit();
+    }
+
+    // Makes destination a copy of source, which may be a directory or a file
+    void sync(const std::string& source, const std::string& destination) {
+        auto start = std::chrono::steady_clock::now();
+        EntryMetadata metadata;
+        fetchEntryMetadata(AT_FDCWD, source.c_str(), syncStatxMask, metadata);
+        if (metadata.error != 0) {
+            recordError(source, metadata.error);
+        } else if (S_ISDIR(metadata.stx.stx_mode)) {
+            auto root = std::make_shared<Directory>();
+            root->source = source;
+            root->destination = destination;
+            root->mode = metadata.stx.stx_mode & 07777;
+            pool.submit([this, root] { syncDirectory(root); });
+        } else {
+            EntryMetadata target;
+            fetchEntryMetadata(AT_FDCWD, destination.c_str(), syncStatxMask, target);
+            syncEntry(nullptr, source, destination, std::string(), metadata.stx, target);
+        }
+        pool.wait();
+        elapsed = std::chrono::steady_clock::now() - start;
+        std::sort(errors.begin(), errors.end());
+    }
+
+    const std::vector<std::pair<std::string, std::string>>& getErrors() const {
+        return errors;
+    }
+
+    uintmax_t filesChecked() const {
+        return checked.load();
+    }
+
+    uintmax_t filesCopied() const {
+        return copied.load();
+    }
+
+    uintmax_t bytesWritten() const {
+        return written.load();
+    }
+
+    // Bytes of changed files that were already in place
+    uintmax_t bytesReused() const {
+        return reused.load();
+    }
+
+    double seconds() const {
+        return elapsed.count();
+    }
+
+    size_t threads() const {
+        return pool.size();
+    }
+
+private:
+    struct Directory {
+        std::string source;
+        std::string destination;
+        // Path below the root, as recorded in the journal
+        std::string relative;
+        mode_t mode = 0755;
+        // The journal has it as done already
+        bool resumed = false;
+        // SyncJournal::fingerprint of the source listing
+        uint64_t fingerprint = 0;
+        // The listing plus every file task still running
+        std::atomic<size_t> pending{1};
+        std::atomic<bool> failed{false};
+    };
+
+    static constexpr unsigned int syncStatxMask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+    // Files from this size on are compared and copied block by block
+    static constexpr uint64_t blockSize = 1 << 20;
+    static constexpr uint64_t largeFileSize = 8 * blockSize;
+    static constexpr uint64_t checkpointInterval = 256 * blockSize;
+
+    void syncDirectory(const std::shared_ptr<Directory>& dir) {
+        if (::mkdir(dir->destination.c_str(), dir->mode) != 0 && errno != EEXIST) {
+            recordError(dir->destination, errno);
+            return;
+        }
+        FileDescriptor sourceFd(::open(dir->source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        FileDescriptor destinationFd(::open(dir->destination.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (sourceFd.get() < 0 || destinationFd.get() < 0) {
+            recordError(sourceFd.get() < 0 ? dir->source : dir->destination, errno);
+            return;
+        }
+
+        NameArena names;
+        DirectoryReader reader(sourceFd.get());
+        std::string_view name;
+        unsigned char type;
+        while (reader.next(name, type)) {
+            names.add(name, type);
+        }
+        if (reader.error() != 0) {
+            recordError(dir->source, reader.error());
+            dir->failed = true;
+        }
+
+        // In a directory the journal has as done, with the same source files
+        // as then, files whose destination still matches are not verified
+        // again. The destination is always checked.
+        std::vector<EntryMetadata> sources = fetchDirectoryMetadata(sourceFd.get(), names, syncStatxMask);
+        if (journal != nullptr) {
+            dir->fingerprint = SyncJournal::fingerprint(names, sources);
+            dir->resumed = journal->directoryDone(dir->relative, dir->fingerprint);
+        }
+        std::vector<EntryMetadata> targets = fetchDirectoryMetadata(destinationFd.get(), names, syncStatxMask);
+
+        for (size_t i = 0; i < names.size() && !cancellationRequested(); ++i) {
+            std::string source = childPath(dir->source, names.name(i));
+            std::string destination = childPath(dir->destination, names.name(i));
+            std::string relative = dir->relative.empty() ? std::string(names.name(i)) : childPath(dir->relative, names.name(i));
+            if (sources[i].error != 0) {
+                recordError(source, sources[i].error);
+                dir->failed = true;
+            } else if (S_ISDIR(sources[i].stx.stx_mode)) {
+                auto child = std::make_shared<Directory>();
+                child->source = std::move(source);
+                child->destination = std::move(destination);
+                child->relative = std::move(relative);
+                child->mode = sources[i].stx.stx_mode & 07777;
+                pool.submit([this, child] { syncDirectory(child); });
+            } else {
+                syncEntry(dir, source, destination, relative, sources[i].stx, targets[i]);
+            }
+        }
+        finishOne(dir);
+    }
+
+    // Decides what a non-directory needs. Unchanged files are settled here;
+    // anything that reads file data becomes a task of its own.
+    void syncEntry(const std::shared_ptr<Directory>& dir, const std::string& source, const std::string& destination,
+                   const std::string& relative, const struct statx& from, const EntryMetadata& to) {
+        checked.fetch_add(1, std::memory_order_relaxed);
+        bool exists = to.error == 0;
+        if (exists && S_ISDIR(to.stx.stx_mode)) {
+            recordError(destination, EISDIR);
+            markFailed(dir);
+            return;
+        }
+
+        if (S_ISLNK(from.stx_mode)) {
+            if (!exists || !S_ISLNK(to.stx.stx_mode) || readLink(source) != readLink(destination)) {
+                syncLink(dir, source, destination);
+            }
+            return;
+        }
+        if (!S_ISREG(from.stx_mode)) {
+            // Devices, FIFOs and sockets are left alone
+            return;
+        }
+
+        bool unchanged = exists && S_ISREG(to.stx.stx_mode) && to.stx.stx_size == from.stx_size
+                         && to.stx.stx_mtime.tv_sec == from.stx_mtime.tv_sec
+                         && to.stx.stx_mtime.tv_nsec == from.stx_mtime.tv_nsec;
+        if (unchanged && (!verify || (dir && dir->resumed))) {
+            if ((to.stx.stx_mode & 07777) != (from.stx_mode & 07777)) {
+                ::chmod(destination.c_str(), from.stx_mode & 07777);
+            }
+            return;
+        }
+
+        if (dir) {
+            dir->pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        bool replace = exists && !S_ISREG(to.stx.stx_mode);
+        uint64_t existingSize = exists && !replace ? to.stx.stx_size : 0;
+        pool.submit([=] {
+            if (!cancellationRequested()) {
+                syncFile(dir, source, destination, relative, from, unchanged, replace, existingSize);
+            }
+            if (dir) {
+                finishOne(dir);
+            }
+        });
+    }
+
+    void syncFile(const std::shared_ptr<Directory>& dir, const std::string& source, const std::string& destination,
+                  const std::string& relative, const struct statx& from, bool unchanged, bool replace, uint64_t existingSize) {
+        if (unchanged) {
+            int error = 0;
+            uint64_t sourceHash;
+            uint64_t destinationHash;
+            if (!hashFile(source, sourceHash, error) || !hashFile(destination, destinationHash, error)) {
+                recordError(source, error);
+                markFailed(dir);
+                return;
+            }
+            if (sourceHash == destinationHash) {
+                return;
+            }
+        }
+
+        int error = 0;
+        if (replace && ::unlink(destination.c_str()) != 0) {
+            error = errno;
+        } else if (from.stx_size >= largeFileSize && existingSize > 0) {
+            error = syncBlocks(source, destination, relative, from);
+        } else {
+            // Small or new: a whole copy, which may be a reflink
+            if (existingSize > 0 && ::unlink(destination.c_str()) != 0) {
+                error = errno;
+            }
+            std::error_code ec;
+            uintmax_t bytes = 0;
+            if (error == 0) {
+                copyFileData(source, destination, reflinkMode, bytes, ec);
+                error = ec.value();
+                written.fetch_add(bytes, std::memory_order_relaxed);
+            }
+        }
+
+        struct timespec times[2] = {{0, UTIME_OMIT}, {from.stx_mtime.tv_sec, static_cast<long>(from.stx_mtime.tv_nsec)}};
+        if (error == 0 && ::utimensat(AT_FDCWD, destination.c_str(), times, 0) != 0) {
+            error = errno;
+        }
+        if (error == ECANCELED) {
+            markFailed(dir);
+            return;
+        }
+        if (error != 0) {
+            recordError(source, error);
+            markFailed(dir);
+            return;
+        }
+        copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Rewrites only the blocks of destination that differ from source,
+    // starting where the journal says an earlier run got to. Returns 0 or
+    // an errno.
+    int syncBlocks(const std::string& source, const std::string& destination, const std::string& relative,
+                   const struct statx& from) {
+        FileDescriptor in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+        FileDescriptor out(::open(destination.c_str(), O_RDWR | O_CLOEXEC));
+        if (in.get() < 0 || out.get() < 0) {
+            return errno;
+        }
+        ::posix_fadvise(in.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        ::posix_fadvise(out.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        touchedFileCount().fetch_add(1, std::memory_order_relaxed);
+
+        thread_local std::vector<char> sourceBlock(blockSize);
+        thread_local std::vector<char> destinationBlock(blockSize);
+        uint64_t size = from.stx_size;
+        struct stat to;
+        if (::fstat(out.get(), &to) != 0) {
+            return errno;
+        }
+        uint64_t offset = journal != nullptr ? journal->resumeOffset(relative, from, to) : 0;
+        reused.fetch_add(offset, std::memory_order_relaxed);
+        // The checkpoint records the destination as this run leaves it
+        auto checkpoint = [&] {
+            if (journal != nullptr && ::fstat(out.get(), &to) == 0) {
+                journal->recordOffset(relative, from, to, offset);
+            }
+        };
+        while (offset < size) {
+            if (cancellationRequested()) {
+                checkpoint();
+                return ECANCELED;
+            }
+            size_t length = static_cast<size_t>(std::min(blockSize, size - offset));
+            ssize_t got = readFully(in.get(), sourceBlock.data(), length, offset);
+            if (got != static_cast<ssize_t>(length)) {
+                return got < 0 ? errno : EIO;
+            }
+            ssize_t have = readFully(out.get(), destinationBlock.data(), length, offset);
+            if (have == got && std::memcmp(sourceBlock.data(), destinationBlock.data(), length) == 0) {
+                reused.fetch_add(length, std::memory_order_relaxed);
+            } else {
+                for (size_t done = 0; done < length;) {
+                    ssize_t n = ::pwrite(out.get(), sourceBlock.data() + done, length - done, offset + done);
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        return n < 0 ? errno : EIO;
+                    }
+                    done += n;
+                }
+                written.fetch_add(length, std::memory_order_relaxed);
+            }
+            offset += length;
+            if (offset % checkpointInterval == 0) {
+                checkpoint();
+            }
+        }
+        if (::ftruncate(out.get(), size) != 0) {
+            return errno;
+        }
+        if (::fchmod(out.get(), from.stx_mode & 07777) != 0 || ::close(out.release()) != 0) {
+            return errno;
+        }
+        return 0;
+    }
+
+    // Reads until `length` bytes or end of file; -1 on error
+    static ssize_t readFully(int fd, char* buffer, size_t length, uint64_t offset) {
+        size_t total = 0;
+        while (total < length) {
+            ssize_t n = ::pread(fd, buffer + total, length - total, offset + total);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            total += n;
+        }
+        return static_cast<ssize_t>(total);
+    }
+
+    static bool hashFile(const std::string& path, uint64_t& hash, int& error) {
+        FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            error = errno;
+            return false;
+        }
+        ::posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        touchedFileCount().fetch_add(1, std::memory_order_relaxed);
+        thread_local std::vector<char> block(blockSize);
+        ContentHash content;
+        for (uint64_t offset = 0;; offset += block.size()) {
+            ssize_t n = readFully(fd.get(), block.data(), block.size(), offset);
+            if (n < 0) {
+                error = errno;
+                return false;
+            }
+            content.update(block.data(), n);
+            if (static_cast<size_t>(n) < block.size()) {
+                break;
+            }
+        }
+        hash = content.digest();
+        return true;
+    }
+
+    static std::string readLink(const std::string& path) {
+        char target[PATH_MAX];
+        ssize_t n = ::readlink(path.c_str(), target, sizeof(target));
+        return n < 0 ? std::string() : std::string(target, n);
+    }
+
+    void syncLink(const std::shared_ptr<Directory>& dir, const std::string& source, const std::string& destination) {
+        std::string target = readLink(source);
+        if ((::unlink(destination.c_str()) != 0 && errno != ENOENT) || ::symlink(target.c_str(), destination.c_str()) != 0) {
+            recordError(destination, errno);
+            markFailed(dir);
+            return;
+        }
+        copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static std::string childPath(const std::string& parent, std::string_view name) {
+        std::string path;
+        TreeWalker::appendChildPath(parent, name, path);
+        return path;
+    }
+
+    static void markFailed(const std::shared_ptr<Directory>& dir) {
+        if (dir) {
+            dir->failed = true;
+        }
+    }
+
+    // The last one out records the directory as done, unless something in
+    // it failed or was cut short
+    void finishOne(const std::shared_ptr<Directory>& dir) {
+        if (dir->pending.fetch_sub(1, std::memory_order_acq_rel) == 1 && journal != nullptr && !dir->resumed
+            && !dir->failed && !cancellationRequested()) {
+            journal->recordDirectory(dir->relative, dir->fingerprint);
+        }
+    }
+
+    void recordError(const std::string& path, int error) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        errors.emplace_back(path, std::strerror(error));
+    }
+
+    ThreadPool pool;
+    bool verify;
+    ReflinkMode reflinkMode;
+    SyncJournal* journal;
+    std::atomic<uintmax_t> checked{0};
+    std::atomic<uintmax_t> copied{0};
+    std::atomic<uintmax_t> written{0};
+    std::atomic<uintmax_t> reused{0};
+    std::mutex errorMutex;
+    std::vector<std::pair<std::string, std::string>> errors;
+    std::chrono::duration<double> elapsed{0};
+};
+
+using Arguments = std::vector<std::string_view>;
+
+// Opt-in cache of directory listings for ls ("dircache on"). Listings are
+// keyed by absolute path. Each one is kept coherent with an inotify watch
+// that is added before the directory is read. Every lookup first drains
+// pending events with one non-blocking read and drops the listings they
+// touch, so a hit costs no other system call. The least recently used
+// listings are evicted once the memory budget is exceeded.
+class DirectoryCache {
+
+public:
+    struct Listing {
+        NameArena names;
+        std::vector<EntryMetadata> metadata;
+        bool hasMetadata = false;
+    };
+
+    // A listing being read; the watch is already in place
+    struct Fill {
+        std::string key;
+        int watch = -1;
+        uint64_t serial = 0;
+
+        bool active() const {
+            return watch >= 0;
+        }
+    };
+
+    static constexpr size_t defaultBudget = 64 << 20;
+
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return inotifyFd.get() >= 0;
+    }
+
+    // Returns 0, or the errno of inotify_init1
+    int enable() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (inotifyFd.get() < 0) {
+            inotifyFd.reset(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+            if (inotifyFd.get() < 0) {
+                return errno;
+            }
+            refreshWorkingDirectory();
+        }
+        return 0;
+    }
+
+    void disable() {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropAll();
+        inotifyFd.reset();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        dropAll();
+    }
+
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict();
+    }
+
+    // Called after the shell changes directory, since keys are absolute
+    void setWorkingDirectory() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (inotifyFd.get() >= 0) {
+            refreshWorkingDirectory();
+        }
+    }
+
+    // Builds the key for path. Returns false for paths that cannot be keyed
+    // lexically, i.e. a ".." after a component that may be a symlink.
+    bool keyFor(const fs::path& path, std::string& key) {
+        bool seenName = false;
+        for (const fs::path& part : path.relative_path()) {
+            if (part == "..") {
+                if (seenName) {
+                    return false;
+                }
+            } else if (part != ".") {
+                seenName = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        key = (path.is_absolute() ? path : fs::path(workingDirectory) / path).lexically_normal().string();
+        if (key.size() > 1 && key.back() == '/') {
+            key.pop_back();
+        }
+        return true;
+    }
+
+    std::shared_ptr<const Listing> find(const std::string& key, bool needMetadata) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drainEvents();
+        auto found = index.find(key);
+        if (found == index.end() || (needMetadata && !found->second->listing->hasMetadata)) {
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        lru.splice(lru.begin(), lru, found->second);
+        return found->second->listing;
+    }
+
+    // Adds the watch for key; the directory must be read after this call
+    Fill beginFill(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Fill fill;
+        fill.key = key;
+        if (inotifyFd.get() < 0) {
+            return fill;
+        }
+        drainEvents();
+        fill.watch = ::inotify_add_watch(inotifyFd.get(), key.c_str(), watchMask);
+        if (fill.watch >= 0) {
+            watches.emplace(fill.watch, Watch());
+            fill.serial = serial;
+        }
+        return fill;
+    }
+
+    // Stores a listing read after beginFill, unless the directory changed
+    // in the meantime
+    void store(const Fill& fill, std::shared_ptr<const Listing> listing) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (inotifyFd.get() < 0) {
+            return;
+        }
+        drainEvents();
+        auto watch = watches.find(fill.watch);
+        if (watch == watches.end()) {
+            return;
+        }
+        if (watch->second.lastEvent > fill.serial) {
+            releaseWatch(watch);
+            return;
+        }
+
+        // Claim the watch first: the listing being replaced may share it
+        ++watch->second.users;
+        auto existing = index.find(fill.key);
+        if (existing != index.end()) {
+            erase(existing->second);
+        }
+
+        size_t bytes = sizeof(Listing) + fill.key.size() + listing->names.memoryUsage()
+                       + listing->metadata.capacity() * sizeof(EntryMetadata);
+        lru.push_front(Entry{fill.key, fill.watch, std::move(listing), bytes});
+        index.emplace(fill.key, lru.begin());
+        usedBytes += bytes;
+        evict();
+    }
+
+    void writeStatus(OutputWriter& writer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drainEvents();
+        writer << "Directory cache: " << (inotifyFd.get() >= 0 ? "on" : "off") << ", "
+               << lru.size() << " directories, "
+               << fixed(usedBytes / (1024.0 * 1024.0), 1) << " of " << fixed(budget / (1024.0 * 1024.0), 1) << " MB, "
+               << hits << " hits, " << misses << " misses, "
+               << invalidations << " invalidations, " << evictions << " evictions" << '\n';
+    }
+
+private:
+    static constexpr uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY
+                                          | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    struct Entry {
+        std::string key;
+        int watch;
+        std::shared_ptr<const Listing> listing;
+        size_t bytes;
+    };
+
+    struct Watch {
+        uint64_t lastEvent = 0;
+        size_t users = 0;
+    };
+
+    void refreshWorkingDirectory() {
+        char buffer[PATH_MAX];
+        workingDirectory = ::getcwd(buffer, sizeof(buffer)) != nullptr ? buffer : "";
+    }
+
+    // Reads every pending event and drops the listings of the directories
+    // they name. Most calls find nothing and cost one read returning EAGAIN.
+    void drainEvents() {
+        alignas(struct inotify_event) char buffer[16384];
+        std::vector<int> changed;
+        bool overflow = false;
+        while (true) {
+            ssize_t n = ::read(inotifyFd.get(), buffer, sizeof(buffer));
+            if (n <= 0) {
+                break;
+            }
+            ++serial;
+            for (ssize_t offset = 0; offset < n;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                    continue;
+                }
+                auto watch = watches.find(event->wd);
+                if (watch != watches.end()) {
+                    watch->second.lastEvent = serial;
+                    if (watch->second.users != 0) {
+                        changed.push_back(event->wd);
+                    }
+                }
+            }
+        }
+
+        if (overflow) {
+            // Events were lost: nothing cached can be trusted
+            invalidations += lru.size();
+            dropAll();
+            return;
+        }
+        if (changed.empty()) {
+            return;
+        }
+        std::sort(changed.begin(), changed.end());
+        for (auto it = lru.begin(); it != lru.end();) {
+            auto next = std::next(it);
+            if (std::binary_search(changed.begin(), changed.end(), it->watch)) {
+                ++invalidations;
+                erase(it);
+            }
+            it = next;
+        }
+    }
+
+    void erase(std::list<Entry>::iterator entry) {
+        usedBytes -= entry->bytes;
+        index.erase(entry->key);
+        auto watch = watches.find(entry->watch);
+        lru.erase(entry);
+        if (watch != watches.end() && --watch->second.users == 0) {
+            releaseWatch(watch);
+        }
+    }
+
+    void releaseWatch(std::unordered_map<int, Watch>::iterator watch) {
+        if (watch->second.users == 0) {
+            ::inotify_rm_watch(inotifyFd.get(), watch->first);
+            watches.erase(watch);
+        }
+    }
+
+    void evict() {
+        while (usedBytes > budget && !lru.empty()) {
+            ++evictions;
+            erase(std::prev(lru.end()));
+        }
+    }
+
+    void dropAll() {
+        for (const auto& watch : watches) {
+            ::inotify_rm_watch(inotifyFd.get(), watch.first);
+        }
+        watches.clear();
+        index.clear();
+        lru.clear();
+        usedBytes = 0;
+    }
+
+    std::mutex mutex;
+    FileDescriptor inotifyFd;
+    std::string workingDirectory;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::unordered_map<int, Watch> watches;
+    uint64_t serial = 0;
+    size_t budget = defaultBudget;
+    size_t usedBytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+};
+
+// Characters with a meaning in glob patterns. The lexer escapes quoted ones
+// with a backslash so the pattern compiler treats them literally.
+bool isGlobSpecial(char c) {
+    return c == '*' || c == '?' || c == '[' || c == ']' || c == '{' || c == '}' || c == ',' || c == '\\';
+}
+
+void removeGlobEscapes(std::string& text) {
+    size_t write = 0;
+    for (size_t read = 0; read < text.size(); ++read) {
+        if (text[read] == '\\' && read + 1 < text.size()) {
+            ++read;
+        }
+        text[write++] = text[read];
+    }
+    text.resize(write);
+}
+
+// Glob pattern compiled once into per-segment matchers. Supports *, ?, [...]
+// (negated with ! or ^, with ranges), {a,b} alternatives and ** for any number
+// of directories. The walk opens literal segments directly instead of
+// reading their parent, reads each other directory once, and decides whether
+// to descend from d_type, so matching never needs a stat of its own.
+class GlobPattern {
+
+public:
+    class NameMatcher;
+
+    explicit GlobPattern(std::string_view pattern) : text(pattern) {
+        literalText = text;
+        removeGlobEscapes(literalText);
+
+        // Alternatives that span directories become separate branches; the
+        // rest are matched inside their segment
+        std::vector<std::string> expanded;
+        expandBraces(text, 0, true, expanded);
+        for (const std::string& branchText : expanded) {
+            branches.push_back(compileBranch(branchText));
+        }
+    }
+
+    // False when the pattern has no special characters left after escapes,
+    // in which case it names exactly literal()
+    bool hasWildcards() const {
+        if (branches.size() != 1) {
+            return true;
+        }
+        for (const Segment& segment : branches[0].segments) {
+            if (segment.kind != SegmentKind::Literal || segment.literals.size() != 1) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::string& literal() const {
+        return literalText;
+    }
+
+    // Calls emit(std::string_view) for every existing path that matches, in
+    // directory order. Branches may produce the same path twice.
+    template <typename Emit>
+    void expand(Emit&& emit) {
+        for (const Branch& branch : branches) {
+            FileDescriptor root(::open(branch.absolute ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (root.get() < 0 || branch.segments.empty()) {
+                continue;
+            }
+            current = &branch;
+            path.assign(branch.absolute ? "/" : "");
+            walk(root.get(), 0, emit);
+        }
+    }
+
+private:
+    enum class OpKind : unsigned char { Literal, AnyChar, AnyString, Class };
+
+    struct Op {
+        OpKind kind;
+        std::string literal;
+        std::bitset<256> members;
+    };
+
+    struct Program {
+        std::vector<Op> ops;
+        // Hidden names only match patterns that start with a literal dot
+        bool matchesHidden = false;
+    };
+
+    enum class SegmentKind : unsigned char { Literal, Pattern, GlobStar };
+
+    struct Segment {
+        SegmentKind kind;
+        std::vector<std::string> literals;
+        std::vector<Program> programs;
+
+        bool matches(std::string_view name) const {
+            for (const Program& program : programs) {
+                if ((name[0] != '.' || program.matchesHidden) && matchProgram(program.ops, name)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    struct Branch {
+        bool absolute = false;
+        // A trailing slash only matches directories
+        bool directoriesOnly = false;
+        std::vector<Segment> segments;
+    };
+
+    // Appends every brace expansion of text to out. With slashOnly, only
+    // groups containing a '/' are expanded.
+    static void expandBraces(const std::string& pattern, size_t from, bool slashOnly, std::vector<std::string>& out) {
+        for (size_t brace = from; brace < pattern.size(); ++brace) {
+            if (pattern[brace] == '\\') {
+                ++brace;
+                continue;
+            }
+            if (pattern[brace] != '{') {
+                continue;
+            }
+
+            std::vector<size_t> commas;
+            size_t close = std::string::npos;
+            bool hasSlash = false;
+            int depth = 0;
+            for (size_t i = brace + 1; i < pattern.size() && close == std::string::npos; ++i) {
+                char c = pattern[i];
+                if (c == '\\') {
+                    ++i;
+                } else if (c == '{') {
+                    ++depth;
+                } else if (c == '}') {
+                    if (depth == 0) {
+                        close = i;
+                    } else {
+                        --depth;
+                    }
+                } else if (c == ',' && depth == 0) {
+                    commas.push_back(i);
+                } else if (c == '/') {
+                    hasSlash = true;
+                }
+            }
+            if (close == std::string::npos || commas.empty() || (slashOnly && !hasSlash)) {
+                continue;
+            }
+
+            commas.push_back(close);
+            size_t start = brace + 1;
+            for (size_t comma : commas) {
+                std::string alternative = pattern.substr(0, brace);
+                alternative.append(pattern, start, comma - start);
+                alternative.append(pattern, close + 1, std::string::npos);
+                expandBraces(alternative, brace, slashOnly, out);
+                start = comma + 1;
+            }
+            return;
+        }
+        out.push_back(pattern);
+    }
+
+    static Branch compileBranch(const std::string& branchText) {
+        Branch branch;
+        branch.absolute = !branchText.empty() && branchText[0] == '/';
+        branch.directoriesOnly = branchText.size() > 1 && branchText.back() == '/';
+
+        size_t start = 0;
+        for (size_t i = 0; i <= branchText.size(); ++i) {
+            if (i < branchText.size() && branchText[i] == '\\') {
+                ++i;
+                continue;
+            }
+            if (i < branchText.size() && branchText[i] != '/') {
+                continue;
+            }
+            if (i > start) {
+                Segment segment = compileSegment(branchText.substr(start, i - start));
+                bool repeatedGlobStar = segment.kind == SegmentKind::GlobStar && !branch.segments.empty()
+                                        && branch.segments.back().kind == SegmentKind::GlobStar;
+                if (!repeatedGlobStar) {
+                    branch.segments.push_back(std::move(segment));
+                }
+            }
+            start = i + 1;
+        }
+        return branch;
+    }
+
+    static Segment compileSegment(const std::string& segmentText) {
+        Segment segment;
+        if (segmentText == "**") {
+            segment.kind = SegmentKind::GlobStar;
+            return segment;
+        }
+
+        std::vector<std::string> alternatives;
+        expandBraces(segmentText, 0, false, alternatives);
+        bool allLiteral = true;
+        for (const std::string& alternative : alternatives) {
+            Program program = compileProgram(alternative);
+            if (program.ops.size() > 1 || (program.ops.size() == 1 && program.ops[0].kind != OpKind::Literal)) {
+                allLiteral = false;
+            }
+            segment.programs.push_back(std::move(program));
+        }
+
+        if (allLiteral) {
+            // Looked up directly, without reading the directory
+            segment.kind = SegmentKind::Literal;
+            for (const Program& program : segment.programs) {
+                if (!program.ops.empty()) {
+                    segment.literals.push_back(program.ops[0].literal);
+                }
+            }
+            segment.programs.clear();
+        } else {
+            segment.kind = SegmentKind::Pattern;
+        }
+        return segment;
+    }
+
+    static Program compileProgram(const std::string& pattern) {
+        Program program;
+        program.matchesHidden = !pattern.empty() && pattern[0] == '.';
+        auto appendLiteral = [&](char c) {
+            if (program.ops.empty() || program.ops.back().kind != OpKind::Literal) {
+                program.ops.push_back(Op{OpKind::Literal, {}, {}});
+            }
+            program.ops.back().literal += c;
+        };
+
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            if (c == '\\' && i + 1 < pattern.size()) {
+                appendLiteral(pattern[++i]);
+            } else if (c == '*') {
+                if (program.ops.empty() || program.ops.back().kind != OpKind::AnyString) {
+                    program.ops.push_back(Op{OpKind::AnyString, {}, {}});
+                }
+            } else if (c == '?') {
+                program.ops.push_back(Op{OpKind::AnyChar, {}, {}});
+            } else if (c == '[') {
+                Op op{OpKind::Class, {}, {}};
+                size_t end = compileClass(pattern, i + 1, op.members);
+                if (end == std::string::npos) {
+                    appendLiteral(c);
+                } else {
+                    program.ops.push_back(std::move(op));
+                    i = end;
+                }
+            } else {
+                appendLiteral(c);
+            }
+        }
+        return program;
+    }
+
+    // Parses a bracket expression starting after the '['. Returns the index
+    // of the closing ']', or npos if there is none.
+    static size_t compileClass(const std::string& pattern, size_t i, std::bitset<256>& members) {
+        bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+        if (negate) {
+            ++i;
+        }
+
+        size_t first = i;
+        for (; i < pattern.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(pattern[i]);
+            if (c == ']' && i != first) {
+                if (negate) {
+                    members.flip();
+                }
+                return i;
+            }
+            if (c == '\\' && i + 1 < pattern.size()) {
+                c = static_cast<unsigned char>(pattern[++i]);
+            }
+            if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                unsigned char last = static_cast<unsigned char>(pattern[i + 2]);
+                for (unsigned int member = c; member <= last; ++member) {
+                    members.set(member);
+                }
+                i += 2;
+            } else {
+                members.set(c);
+            }
+        }
+        return std::string::npos;
+    }
+
+    // Iterative matcher: on a mismatch only the most recent '*' is retried
+    // one character further, which keeps matching linear in practice.
+    static bool matchProgram(const std::vector<Op>& ops, std::string_view name) {
+        size_t op = 0;
+        size_t position = 0;
+        size_t starOp = std::string::npos;
+        size_t starPosition = 0;
+        while (true) {
+            if (op < ops.size()) {
+                const Op& current = ops[op];
+                if (current.kind == OpKind::AnyString) {
+                    starOp = op++;
+                    starPosition = position;
+                    continue;
+                }
+                if (position < name.size()) {
+                    bool matched = false;
+                    size_t length = 1;
+                    if (current.kind == OpKind::Literal) {
+                        length = current.literal.size();
+                        matched = name.compare(position, length, current.literal) == 0;
+                    } else if (current.kind == OpKind::AnyChar) {
+                        matched = true;
+                    } else {
+                        matched = current.members.test(static_cast<unsigned char>(name[position]));
+                    }
+                    if (matched) {
+                        ++op;
+                        position += length;
+                        continue;
+                    }
+                }
+            } else if (position == name.size()) {
+                return true;
+            }
+
+            if (starOp == std::string::npos || starPosition >= name.size()) {
+                return false;
+            }
+            op = starOp + 1;
+            position = ++starPosition;
+        }
+    }
+
+    // True if the entry can be descended into; only links and file systems
+    // without d_type need a stat
+    static bool isDirectory(int dirFd, const char* name, unsigned char type, bool followLinks) {
+        if (type == DT_DIR) {
+            return true;
+        }
+        if (type != DT_UNKNOWN && (type != DT_LNK || !followLinks)) {
+            return false;
+        }
+        struct stat st;
+        return ::fstatat(dirFd, name, &st, followLinks ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    template <typename Emit>
+    void walk(int dirFd, size_t index, Emit& emit) {
+        const Segment& segment = current->segments[index];
+        if (segment.kind == SegmentKind::Literal) {
+            for (const std::string& name : segment.literals) {
+                struct stat st;
+                if (index + 1 < current->segments.size() || ::fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    visit(dirFd, name.c_str(), name, DT_UNKNOWN, index, emit);
+                }
+            }
+            return;
+        }
+
+        NameArena entries;
+        {
+            DirectoryReader reader(dirFd);
+            std::string_view name;
+            unsigned char type;
+            while (reader.next(name, type)) {
+                if (segment.kind == SegmentKind::GlobStar ? name[0] != '.' : segment.matches(name)) {
+                    entries.add(name, type);
+                }
+            }
+        }
+
+        if (segment.kind == SegmentKind::Pattern) {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                visit(dirFd, entries.c_str(i), entries.name(i), entries.type(i), index, emit);
+            }
+            return;
+        }
+
+        // ** matches zero directories here, then recurses into each one
+        bool last = index + 1 == current->segments.size();
+        if (last) {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (!current->directoriesOnly || isDirectory(dirFd, entries.c_str(i), entries.type(i), false)) {
+                    emitPath(entries.name(i), emit);
+                }
+            }
+        } else if (current->segments[index + 1].kind == SegmentKind::Literal) {
+            walk(dirFd, index + 1, emit);
+        } else {
+            const Segment& next = current->segments[index + 1];
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (next.matches(entries.name(i))) {
+                    visit(dirFd, entries.c_str(i), entries.name(i), entries.type(i), index + 1, emit);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            // Like other shells, ** does not follow symbolic links
+            if (isDirectory(dirFd, entries.c_str(i), entries.type(i), false)) {
+                descend(dirFd, entries.c_str(i), entries.name(i), index, O_NOFOLLOW, emit);
+            }
+        }
+    }
+
+    // Handles a name that matched segment `index`
+    template <typename Emit>
+    void visit(int dirFd, const char* cName, std::string_view name, unsigned char type, size_t index, Emit& emit) {
+        if (index + 1 < current->segments.size()) {
+            if (type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN) {
+                descend(dirFd, cName, name, index + 1, 0, emit);
+            }
+        } else if (!current->directoriesOnly || isDirectory(dirFd, cName, type, true)) {
+            emitPath(name, emit);
+        }
+    }
+
+    template <typename Emit>
+    void descend(int dirFd, const char* cName, std::string_view name, size_t index, int flags, Emit& emit) {
+        FileDescriptor fd(::openat(dirFd, cName, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags));
+        if (fd.get() < 0) {
+            return;
+        }
+        size_t mark = path.size();
+        path.append(name.data(), name.size());
+        path += '/';
+        walk(fd.get(), index, emit);
+        path.resize(mark);
+    }
+
+    template <typename Emit>
+    void emitPath(std::string_view name, Emit& emit) {
+        size_t mark = path.size();
+        path.append(name.data(), name.size());
+        if (current->directoriesOnly) {
+            path += '/';
+        }
+        emit(std::string_view(path));
+        path.resize(mark);
+    }
+
+    std::string text;
+    std::string literalText;
+    std::vector<Branch> branches;
+    const Branch* current = nullptr;
+    std::string path;
+};
+
+// One pattern matched against whole strings, for find -name and -path. The
+// same compiled programs as above, except that '/' and leading dots are
+// ordinary characters here.
+class GlobPattern::NameMatcher {
+
+public:
+    explicit NameMatcher(std::string_view pattern) {
+        std::vector<std::string> alternatives;
+        expandBraces(std::string(pattern), 0, false, alternatives);
+        for (const std::string& alternative : alternatives) {
+            programs.push_back(compileProgram(alternative));
+        }
+    }
+
+    bool matches(std::string_view name) const {
+        for (const Program& program : programs) {
+            if (matchProgram(program.ops, name)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<Program> programs;
+};
+
+// find expression compiled once into a flat program. Tests and actions set a
+// result register; -a and -o become jumps over their right operand when the
+// left one already decides the result, so an entry is evaluated by one loop
+// over the ops, with no recursion and no parsing per entry.
+class FindProgram {
+
+public:
+    enum class OpKind : unsigned char {
+        Name, Path, Type, Size, Mtime, True, Not, JumpIfFalse, JumpIfTrue, Print, Print0, Delete, Exec
+    };
+
+    struct Op {
+        OpKind kind;
+        // Sign of a numeric argument: -1 for -N, 1 for +N, 0 for exactly N
+        int compare = 0;
+        // Jump target, or index into the patterns or exec commands
+        uint32_t index = 0;
+        // Bit per DT_* value for -type
+        uint32_t types = 0;
+        int64_t number = 0;
+        // Bytes per unit for -size
+        int64_t unit = 1;
+    };
+
+    // What the program needs to know about one entry
+    struct Entry {
+        // Where the entry can be reached by `cName`, for -delete
+        int dirFd;
+        const char* cName;
+        std::string_view name;
+        const std::string& path;
+        unsigned char type;
+        // Only filled in for the fields in statxMask()
+        const EntryMetadata& metadata;
+    };
+
+    // Walks never go below maxDepth; entries above minDepth are walked
+    // through but not evaluated
+    size_t minDepth = 0;
+    size_t maxDepth = SIZE_MAX;
+
+    // Whether `word` starts the expression; the words before it are paths
+    static bool startsExpression(std::string_view word) {
+        return (word.size() > 1 && word[0] == '-') || word == "(" || word == "!";
+    }
+
+    bool compile(const Arguments& expression, std::string& error) {
+        words = &expression;
+        position = 0;
+        now = std::time(nullptr);
+        if (!words->empty() && !parseOr(error)) {
+            return false;
+        }
+        if (position < words->size()) {
+            error = "unexpected '" + std::string((*words)[position]) + "'";
+            return false;
+        }
+        if (!hasAction) {
+            // Entries the expression accepts are printed
+            size_t jump = ops.empty() ? SIZE_MAX : emitJump(OpKind::JumpIfFalse);
+            ops.push_back(Op{OpKind::Print});
+            if (jump != SIZE_MAX) {
+                ops[jump].index = static_cast<uint32_t>(ops.size());
+            }
+        }
+        return true;
+    }
+
+    unsigned int statxMask() const {
+        return mask;
+    }
+
+    // -exec runs commands whose order matters, so the walk must be serial
+    bool runsCommands() const {
+        return !commands.empty();
+    }
+
+    bool deletes() const {
+        return hasDelete;
+    }
+
+    const std::vector<std::string>& command(uint32_t index) const {
+        return commands[index];
+    }
+
+    // Evaluates the program for one entry. Actions are handed to
+    // act(const Op&, const Entry&), which returns their result.
+    template <typename Act>
+    bool run(const Entry& entry, Act&& act) const {
+        bool result = true;
+        size_t pc = 0;
+        while (pc < ops.size()) {
+            const Op& op = ops[pc++];
+            switch (op.kind) {
+                case OpKind::Name:
+                    result = patterns[op.index].matches(entry.name);
+                    break;
+                case OpKind::Path:
+                    result = patterns[op.index].matches(entry.path);
+                    break;
+                case OpKind::Type:
+                    result = entry.type < 32 && (op.types & (1u << entry.type)) != 0;
+                    break;
+                case OpKind::Size:
+                    result = entry.metadata.error == 0
+                             && compare(op, (static_cast<int64_t>(entry.metadata.stx.stx_size) + op.unit - 1) / op.unit);
+                    break;
+                case OpKind::Mtime: {
+                    // Whole days since the last change, rounded down
+                    int64_t age = now - entry.metadata.stx.stx_mtime.tv_sec;
+                    int64_t days = age >= 0 ? age / 86400 : -((-age + 86399) / 86400);
+                    result = entry.metadata.error == 0 && compare(op, days);
+                    break;
+                }
+                case OpKind::True:
+                    result = true;
+                    break;
+                case OpKind::Not:
+                    result = !result;
+                    break;
+                case OpKind::JumpIfFalse:
+                    if (!result) {
+                        pc = op.index;
+                    }
+                    break;
+                case OpKind::JumpIfTrue:
+                    if (result) {
+                        pc = op.index;
+                    }
+                    break;
+                default:
+                    result = act(op, entry);
+                    break;
+            }
+        }
+        return result;
+    }
+
+private:
+    static bool compare(const Op& op, int64_t value) {
+        return op.compare < 0 ? value < op.number : op.compare > 0 ? value > op.number : value == op.number;
+    }
+
+    bool atOperator(std::string_view name) const {
+        return position < words->size() && (*words)[position] == name;
+    }
+
+    // or := and { (-o | -or) and }
+    bool parseOr(std::string& error) {
+        if (!parseAnd(error)) {
+            return false;
+        }
+        while (atOperator("-o") || atOperator("-or")) {
+            ++position;
+            size_t jump = emitJump(OpKind::JumpIfTrue);
+            if (!parseAnd(error)) {
+                return false;
+            }
+            ops[jump].index = static_cast<uint32_t>(ops.size());
+        }
+        return true;
+    }
+
+    // and := unary { [-a | -and] unary }
+    bool parseAnd(std::string& error) {
+        if (!parseUnary(error)) {
+            return false;
+        }
+        while (position < words->size() && !atOperator("-o") && !atOperator("-or") && !atOperator(")")) {
+            if (atOperator("-a") || atOperator("-and")) {
+                ++position;
+            }
+            size_t jump = emitJump(OpKind::JumpIfFalse);
+            if (!parseUnary(error)) {
+                return false;
+            }
+            ops[jump].index = static_cast<uint32_t>(ops.size());
+        }
+        return true;
+    }
+
+    // unary := (! | -not) unary | ( or ) | primary
+    bool parseUnary(std::string& error) {
+        if (position >= words->size()) {
+            error = "expected an expression at the end";
+            return false;
+        }
+        if (atOperator("!") || atOperator("-not")) {
+            ++position;
+            if (!parseUnary(error)) {
+                return false;
+            }
+            ops.push_back(Op{OpKind::Not});
+            return true;
+        }
+        if (atOperator("(")) {
+            ++position;
+            if (!parseOr(error)) {
+                return false;
+            }
+            if (!atOperator(")")) {
+                error = "missing ')'";
+                return false;
+            }
+            ++position;
+            return true;
+        }
+        return parsePrimary(error);
+    }
+
+    bool parsePrimary(std::string& error) {
+        std::string_view name = (*words)[position++];
+        if (name == "-print" || name == "-print0") {
+            ops.push_back(Op{name == "-print" ? OpKind::Print : OpKind::Print0});
+            hasAction = true;
+            return true;
+        }
+        if (name == "-delete") {
+            ops.push_back(Op{OpKind::Delete});
+            hasAction = hasDelete = true;
+            return true;
+        }
+        if (name == "-exec") {
+            return parseExec(error);
+        }
+        if (name == "-true" || name == "-false") {
+            ops.push_back(Op{OpKind::True});
+            if (name == "-false") {
+                ops.push_back(Op{OpKind::Not});
+            }
+            return true;
+        }
+
+        static constexpr std::string_view withArgument[] = {"-name", "-path", "-type", "-size", "-mtime", "-maxdepth", "-mindepth"};
+        if (std::find(std::begin(withArgument), std::end(withArgument), name) == std::end(withArgument)) {
+            error = "unknown predicate '" + std::string(name) + "'";
+            return false;
+        }
+        if (position >= words->size()) {
+            error = "missing argument to " + std::string(name);
+            return false;
+        }
+        std::string_view argument = (*words)[position++];
+        Op op{OpKind::True};
+        if (name == "-name" || name == "-path") {
+            op.kind = name == "-name" ? OpKind::Name : OpKind::Path;
+            op.index = static_cast<uint32_t>(patterns.size());
+            patterns.emplace_back(argument);
+        } else if (name == "-type") {
+            op.kind = OpKind::Type;
+            if (!parseTypes(argument, op.types)) {
+                error = "invalid argument '" + std::string(argument) + "' to -type";
+                return false;
+            }
+        } else if (name == "-size") {
+            op.kind = OpKind::Size;
+            mask |= STATX_SIZE;
+            if (!parseNumber(argument, true, op)) {
+                error = "invalid argument '" + std::string(argument) + "' to -size";
+                return false;
+            }
+        } else if (name == "-mtime") {
+            op.kind = OpKind::Mtime;
+            mask |= STATX_MTIME;
+            if (!parseNumber(argument, false, op)) {
+                error = "invalid argument '" + std::string(argument) + "' to -mtime";
+                return false;
+            }
+        } else if (name == "-maxdepth" || name == "-mindepth") {
+            // Options rather than tests; they always hold
+            size_t depth;
+            auto result = std::from_chars(argument.data(), argument.data() + argument.size(), depth);
+            if (result.ec != std::errc() || result.ptr != argument.data() + argument.size()) {
+                error = "invalid argument '" + std::string(argument) + "' to " + std::string(name);
+                return false;
+            }
+            (name == "-maxdepth" ? maxDepth : minDepth) = depth;
+        }
+        ops.push_back(std::move(op));
+        return true;
+    }
+
+    // -exec command [argument...] ; with {} replaced by the path
+    bool parseExec(std::string& error) {
+        std::vector<std::string> command;
+        while (position < words->size() && (*words)[position] != ";") {
+            command.emplace_back((*words)[position++]);
+        }
+        if (position >= words->size() || command.empty()) {
+            error = "-exec needs a command terminated by ';'";
+            return false;
+        }
+        ++position;
+        Op op{OpKind::Exec};
+        op.index = static_cast<uint32_t>(commands.size());
+        commands.push_back(std::move(command));
+        ops.push_back(op);
+        hasAction = true;
+        return true;
+    }
+
+    // A comma-separated list of f, d, l, b, c, p and s
+    static bool parseTypes(std::string_view text, uint32_t& types) {
+        for (size_t i = 0; i < text.size(); i += 2) {
+            static constexpr std::pair<char, unsigned char> letters[] = {
+                {'f', DT_REG}, {'d', DT_DIR}, {'l', DT_LNK}, {'b', DT_BLK}, {'c', DT_CHR}, {'p', DT_FIFO}, {'s', DT_SOCK},
+            };
+            auto letter = std::find_if(std::begin(letters), std::end(letters), [&](const auto& entry) {
+                return entry.first == text[i];
+            });
+            if (letter == std::end(letters) || (i + 1 < text.size() && text[i + 1] != ',')) {
+                return false;
+            }
+            types |= 1u << letter->second;
+        }
+        return !text.empty() && text.back() != ',';
+    }
+
+    // [+-]N, for -size followed by an optional unit: c (bytes), w (2), b
+    // (512, the default), k, M or G
+    static bool parseNumber(std::string_view text, bool withUnit, Op& op) {
+        if (!text.empty() && (text[0] == '+' || text[0] == '-')) {
+            op.compare = text[0] == '+' ? 1 : -1;
+            text.remove_prefix(1);
+        }
+        if (withUnit) {
+            op.unit = 512;
+            static constexpr std::pair<char, int64_t> units[] = {
+                {'c', 1}, {'w', 2}, {'b', 512}, {'k', 1024}, {'M', 1024 * 1024}, {'G', 1024 * 1024 * 1024},
+            };
+            for (const auto& unit : units) {
+                if (!text.empty() && text.back() == unit.first) {
+                    op.unit = unit.second;
+                    text.remove_suffix(1);
+                }
+            }
+        }
+        auto result = std::from_chars(text.data(), text.data() + text.size(), op.number);
+        return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size() && op.number >= 0;
+    }
+
+    size_t emitJump(OpKind kind) {
+        ops.push_back(Op{kind});
+        return ops.size() - 1;
+    }
+
+    const Arguments* words = nullptr;
+    size_t position = 0;
+    std::time_t now = 0;
+    std::vector<Op> ops;
+    std::vector<GlobPattern::NameMatcher> patterns;
+    std::vector<std::vector<std::string>> commands;
+    unsigned int mask = 0;
+    bool hasAction = false;
+    bool hasDelete = false;
+};
+
+// Bump allocator for the few words that cannot point into the input line
+// (quoted, escaped or containing $VAR). reset() keeps the first block, so a
+// shell reading line after line settles at zero allocations.
+class TextArena {
+
+public:
+    std::string_view store(std::string_view text) {
+        if (activeBlocks == 0 || used + text.size() > blockSizes[activeBlocks - 1]) {
+            size_t size = std::max<size_t>(defaultBlockSize, text.size());
+            if (blocks.size() > activeBlocks) {
+                // Reuse a block kept from an earlier line if it is large enough
+                if (blockSizes[activeBlocks] < size) {
+                    blocks[activeBlocks].reset(new char[size]);
+                    blockSizes[activeBlocks] = size;
+                }
+            } else {
+                blocks.emplace_back(new char[size]);
+                blockSizes.push_back(size);
+            }
+            ++activeBlocks;
+            used = 0;
+        }
+        char* destination = blocks[activeBlocks - 1].get() + used;
+        std::memcpy(destination, text.data(), text.size());
+        used += text.size();
+        return std::string_view(destination, text.size());
+    }
+
+    void reset() {
+        activeBlocks = 0;
+        used = 0;
+    }
+
+private:
+    static constexpr size_t defaultBlockSize = 4096;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> blockSizes;
+    size_t activeBlocks = 0;
+    size_t used = 0;
+};
+
+enum class TokenKind { Word, Pipe, Input, Output, Append, ErrorOutput, ErrorToOutput, Separator, Background, End };
+
+struct Token {
+    TokenKind kind;
+    std::string_view text;
+    // The word has unquoted glob characters; quoted ones in text are
+    // escaped with a backslash
+    bool glob = false;
+};
+
+// Single-pass lexer. Words are views into the input line unless quoting,
+// escapes or variable expansion change their text, in which case the result
+// is built in a reused scratch string and copied into the arena. Words with
+// unquoted glob characters are flagged for expansion by the parser.
+class Lexer {
+
+public:
+    Lexer(TextArena& arena, std::string& scratch) : arena(arena), scratch(scratch) {}
+
+    void reset(std::string_view line) {
+        input = line;
+        position = 0;
+    }
+
+    // Value substituted for $?
+    void setLastStatus(int status) {
+        lastStatus = status;
+    }
+
+    // Returns false on a syntax error, with the message in `error`.
+    bool next(Token& token, const char*& error) {
+        while (position < input.size() && isBlank(input[position])) {
+            ++position;
+        }
+        if (position >= input.size() || input[position] == '#') {
+            token = Token{TokenKind::End, {}, false};
+            return true;
+        }
+
+        char c = input[position];
+        if (c == '|') {
+            return emit(token, TokenKind::Pipe, 1);
+        } else if (c == ';') {
+            return emit(token, TokenKind::Separator, 1);
+        } else if (c == '&') {
+            return emit(token, TokenKind::Background, 1);
+        } else if (c == '<') {
+            return emit(token, TokenKind::Input, 1);
+        } else if (c == '>') {
+            return next(1) == '>' ? emit(token, TokenKind::Append, 2) : emit(token, TokenKind::Output, 1);
+        } else if (c == '2' && next(1) == '>' && (position + 2 >= input.size() || input[position + 2] != '>')) {
+            if (input.compare(position + 2, 2, "&1") == 0) {
+                return emit(token, TokenKind::ErrorToOutput, 4);
+            }
+            return emit(token, TokenKind::ErrorOutput, 2);
+        }
+        return lexWord(token, error);
+    }
+
+private:
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool isOperator(char c) {
+        return c == '|' || c == ';' || c == '&' || c == '<' || c == '>';
+    }
+
+    static bool isNameChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    char next(size_t offset) const {
+        return position + offset < input.size() ? input[position + offset] : '\0';
+    }
+
+    bool emit(Token& token, TokenKind kind, size_t length) {
+        token = Token{kind, input.substr(position, length), false};
+        position += length;
+        return true;
+    }
+
+    bool lexWord(Token& token, const char*& error) {
+        size_t start = position;
+
+        // Fast path: plain words are returned as views into the input
+        bool glob = false;
+        while (position < input.size() && !isBlank(input[position]) && !isOperator(input[position])
+               && input[position] != '\'' && input[position] != '"' && input[position] != '\\' && input[position] != '$') {
+            glob |= isGlobTrigger(input[position]);
+            ++position;
+        }
+        if (position >= input.size() || isBlank(input[position]) || isOperator(input[position])) {
+            token = Token{TokenKind::Word, input.substr(start, position - start), glob};
+            return true;
+        }
+
+        scratch.assign(input.data() + start, position - start);
+        bool quoted = false;
+        bool escaped = false;
+        // Quoted characters that are special to globbing keep a backslash
+        // until we know whether the word is a pattern
+        auto appendQuoted = [&](char c) {
+            if (isGlobSpecial(c)) {
+                scratch += '\\';
+                escaped = true;
+            }
+            scratch += c;
+        };
+        while (position < input.size() && !isBlank(input[position]) && !isOperator(input[position])) {
+            char c = input[position];
+            if (c == '\'') {
+                quoted = true;
+                size_t end = input.find('\'', position + 1);
+                if (end == std::string_view::npos) {
+                    error = "unterminated single quote";
+                    return false;
+                }
+                for (size_t i = position + 1; i < end; ++i) {
+                    appendQuoted(input[i]);
+                }
+                position = end + 1;
+            } else if (c == '"') {
+                quoted = true;
+                ++position;
+                while (position < input.size() && input[position] != '"') {
+                    char d = input[position];
+                    if (d == '\\' && position + 1 < input.size()
+                        && (input[position + 1] == '"' || input[position + 1] == '\\' || input[position + 1] == '$')) {
+                        appendQuoted(input[position + 1]);
+                        position += 2;
+                    } else if (d == '$') {
+                        escaped |= expandVariable(true, glob);
+                    } else {
+                        appendQuoted(d);
+                        ++position;
+                    }
+                }
+                if (position >= input.size()) {
+                    error = "unterminated double quote";
+                    return false;
+                }
+                ++position;
+            } else if (c == '\\') {
+                quoted = true;
+                if (position + 1 < input.size()) {
+                    appendQuoted(input[position + 1]);
+                }
+                position += 2;
+            } else if (c == '$') {
+                escaped |= expandVariable(false, glob);
+            } else {
+                glob |= isGlobTrigger(c);
+                scratch += c;
+                ++position;
+            }
+        }
+
+        if (scratch.empty() && !quoted) {
+            // An unquoted variable that expanded to nothing is not a word
+            return next(token, error);
+        }
+        if (escaped && !glob) {
+            removeGlobEscapes(scratch);
+        }
+        token = Token{TokenKind::Word, arena.store(scratch), glob};
+        return true;
+    }
+
+    // Characters that make an unquoted word a glob pattern
+    static bool isGlobTrigger(char c) {
+        return c == '*' || c == '?' || c == '[' || c == '{';
+    }
+
+    // Expands $NAME, ${NAME} or $? at the current position into scratch.
+    // Unquoted values may contain glob characters, which set `glob`. Returns
+    // true if a backslash escape was added.
+    bool expandVariable(bool quoted, bool& glob) {
+        ++position;
+        if (position < input.size() && input[position] == '?') {
+            ++position;
+            char digits[16];
+            auto result = std::to_chars(digits, digits + sizeof(digits), lastStatus);
+            scratch.append(digits, result.ptr - digits);
+            return false;
+        }
+
+        bool braced = position < input.size() && input[position] == '{';
+        size_t nameStart = braced ? position + 1 : position;
+        size_t nameEnd = nameStart;
+        while (nameEnd < input.size() && isNameChar(input[nameEnd])) {
+            ++nameEnd;
+        }
+        if (nameEnd == nameStart || (braced && (nameEnd >= input.size() || input[nameEnd] != '}'))) {
+            // Not a variable reference: keep the dollar sign literally
+            scratch += '$';
+            return false;
+        }
+
+        char name[256];
+        size_t length = std::min(nameEnd - nameStart, sizeof(name) - 1);
+        std::memcpy(name, input.data() + nameStart, length);
+        name[length] = '\0';
+        bool escaped = false;
+        if (const char* value = getenv(name)) {
+            for (; *value != '\0'; ++value) {
+                if (quoted ? isGlobSpecial(*value) : *value == '\\') {
+                    scratch += '\\';
+                    escaped = true;
+                } else if (!quoted) {
+                    glob |= isGlobTrigger(*value);
+                }
+                scratch += *value;
+            }
+        }
+        position = braced ? nameEnd + 1 : nameEnd;
+        return escaped;
+    }
+
+    std::string_view input;
+    size_t position = 0;
+    TextArena& arena;
+    std::string& scratch;
+    int lastStatus = 0;
+};
+
+// One command of a pipeline with its redirections. Empty file names mean the
+// command inherits the shell's descriptor.
+struct CommandNode {
+    Arguments argv;
+    std::string_view inputFile;
+    std::string_view outputFile;
+    bool append = false;
+    std::string_view errorFile;
+    bool errorToOutput = false;
+
+    bool hasRedirections() const {
+        return !inputFile.empty() || !outputFile.empty() || !errorFile.empty() || errorToOutput;
+    }
+};
+
+// Parses an input line one pipeline at a time, so variables are expanded
+// only after the commands before the ';' have run. The nodes of the current
+// pipeline are kept between calls and only their contents cleared, so
+// re-parsing does not allocate once capacities settle.
+class Parser {
+
+public:
+    Parser() : lexer(arena, scratch) {}
+
+    // Starts a new line; the parsed commands hold views into it.
+    void start(std::string_view line) {
+        arena.reset();
+        lexer.reset(line);
+    }
+
+    // Parses the next pipeline. Returns false at the end of the line, or on a
+    // syntax error with the message in `error`.
+    bool nextPipeline(int lastStatus, std::string& error) {
+        usedCommands = 0;
+        runInBackground = false;
+        lexer.setLastStatus(lastStatus);
+
+        Token token;
+        const char* lexError = nullptr;
+        CommandNode* command = nullptr;
+        bool afterPipe = false;
+        while (true) {
+            if (!lexer.next(token, lexError)) {
+                error = lexError;
+                return false;
+            }
+
+            if (token.kind == TokenKind::Pipe) {
+                if (command == nullptr || command->argv.empty()) {
+                    error = "missing command before '|'";
+                    return false;
+                }
+                command = nullptr;
+                afterPipe = true;
+                continue;
+            }
+
+            if (token.kind == TokenKind::Separator || token.kind == TokenKind::Background || token.kind == TokenKind::End) {
+                if (afterPipe || (command != nullptr && command->argv.empty())) {
+                    error = "missing command";
+                    return false;
+                }
+                if (token.kind == TokenKind::Background && usedCommands == 0) {
+                    error = "missing command before '&'";
+                    return false;
+                }
+                if (usedCommands != 0) {
+                    runInBackground = token.kind == TokenKind::Background;
+                    return true;
+                }
+                if (token.kind == TokenKind::End) {
+                    return false;
+                }
+                continue;
+            }
+
+            if (command == nullptr) {
+                command = &startCommand();
+                afterPipe = false;
+            }
+
+            if (token.kind == TokenKind::Word) {
+                if (token.glob) {
+                    expandGlob(command->argv, token.text);
+                } else {
+                    command->argv.push_back(token.text);
+                }
+            } else if (token.kind == TokenKind::ErrorToOutput) {
+                command->errorToOutput = true;
+            } else {
+                Token target;
+                if (!lexer.next(target, lexError)) {
+                    error = lexError;
+                    return false;
+                }
+                if (target.kind != TokenKind::Word) {
+                    error = "missing file name after '" + std::string(token.text) + "'";
+                    return false;
+                }
+                if (target.glob) {
+                    // Redirection targets are not expanded
+                    scratch.assign(target.text.data(), target.text.size());
+                    removeGlobEscapes(scratch);
+                    target.text = arena.store(scratch);
+                }
+                if (token.kind == TokenKind::Input) {
+                    command->inputFile = target.text;
+                } else if (token.kind == TokenKind::ErrorOutput) {
+                    command->errorFile = target.text;
+                } else {
+                    command->outputFile = target.text;
+                    command->append = token.kind == TokenKind::Append;
+                }
+            }
+        }
+    }
+
+    // Removes the first word of the pipeline, e.g. a "time" prefix
+    void dropLeadingWord() {
+        commands[0].argv.erase(commands[0].argv.begin());
+    }
+
+    // Commands of the pipeline returned by the last nextPipeline() call
+    size_t commandCount() const {
+        return usedCommands;
+    }
+
+    const CommandNode& command(size_t index) const {
+        return commands[index];
+    }
+
+    // The pipeline ended with '&'
+    bool background() const {
+        return runInBackground;
+    }
+
+private:
+    // Replaces a pattern with its matches in sorted order, or with the
+    // pattern itself when nothing matches
+    void expandGlob(Arguments& argv, std::string_view word) {
+        GlobPattern pattern(word);
+        if (pattern.hasWildcards()) {
+            size_t first = argv.size();
+            pattern.expand([&](std::string_view path) { argv.push_back(arena.store(path)); });
+            if (argv.size() != first) {
+                std::sort(argv.begin() + first, argv.end());
+                argv.erase(std::unique(argv.begin() + first, argv.end()), argv.end());
+                return;
+            }
+        }
+        argv.push_back(arena.store(pattern.literal()));
+    }
+
+    CommandNode& startCommand() {
+        if (usedCommands == commands.size()) {
+            commands.emplace_back();
+        }
+        CommandNode& node = commands[usedCommands++];
+        node.argv.clear();
+        node.inputFile = node.outputFile = node.errorFile = std::string_view();
+        node.append = node.errorToOutput = false;
+        return node;
+    }
+
+    TextArena arena;
+    std::string scratch;
+    Lexer lexer;
+    std::vector<CommandNode> commands;
+    size_t usedCommands = 0;
+    bool runInBackground = false;
+};
+
+// Option schemas. Each builtin lists its options with an id; the generic
+// parser turns the command line into a ParsedArguments once, and the builtin
+// reads it into its own options struct.
+enum class ValueKind { None, Required, Optional };
+
+struct OptionSpec {
+    std::string_view name;
+    unsigned int id;
+    // Required values may be attached (-j8, --opt=x) or follow (-j 8);
+    // optional values must be attached with '='.
+    ValueKind value;
+};
+
+constexpr unsigned int helpOption = 31;
+
+struct ParsedArguments {
+    std::string_view command;
+    uint32_t flags = 0;
+    std::string_view values[32];
+    Arguments operands;
+
+    bool has(unsigned int id) const {
+        return (flags & (1u << id)) != 0;
+    }
+
+    std::string_view value(unsigned int id) const {
+        return values[id];
+    }
+};
+
+// Fills `parsed` from argv according to `specs`. Options may appear anywhere;
+// "--" ends option parsing and "-" on its own is an operand. Returns false
+// with a message in `error` for unknown options or missing values.
+bool parseArguments(const Arguments& argv, const OptionSpec* specs, size_t specCount,
+                    ParsedArguments& parsed, std::string& error) {
+    parsed.command = argv[0];
+    parsed.flags = 0;
+    parsed.operands.clear();
+
+    bool optionsEnded = false;
+    for (size_t i = 1; i < argv.size(); ++i) {
+        std::string_view arg = argv[i];
+        if (optionsEnded || arg.size() < 2 || arg[0] != '-') {
+            parsed.operands.push_back(arg);
+            continue;
+        }
+        if (arg == "--") {
+            optionsEnded = true;
+            continue;
+        }
+
+        const OptionSpec* match = nullptr;
+        std::string_view attached;
+        bool hasAttached = false;
+        for (size_t s = 0; s < specCount && match == nullptr; ++s) {
+            const OptionSpec& spec = specs[s];
+            if (arg == spec.name) {
+                match = &spec;
+            } else if (spec.value != ValueKind::None && arg.size() > spec.name.size() && arg.substr(0, spec.name.size()) == spec.name) {
+                std::string_view rest = arg.substr(spec.name.size());
+                if (rest[0] == '=') {
+                    match = &spec;
+                    attached = rest.substr(1);
+                    hasAttached = true;
+                } else if (spec.value == ValueKind::Required && spec.name.size() == 2) {
+                    // Short option with the value glued on, e.g. -j8
+                    match = &spec;
+                    attached = rest;
+                    hasAttached = true;
+                }
+            }
+        }
+
+        if (match == nullptr) {
+            error = "Unknown option: " + std::string(arg);
+            return false;
+        }
+        if (match->value == ValueKind::None && hasAttached) {
+            error = "Option " + std::string(match->name) + " does not take a value";
+            return false;
+        }
+        if (match->value == ValueKind::Required && !hasAttached) {
+            if (i + 1 >= argv.size()) {
+                error = "Option " + std::string(match->name) + " requires a value";
+                return false;
+            }
+            attached = argv[++i];
+            hasAttached = true;
+        }
+
+        parsed.flags |= 1u << match->id;
+        parsed.values[match->id] = hasAttached ? attached : std::string_view();
+    }
+    return true;
+}
+
+enum CdOption : unsigned int { CdHelp = helpOption };
+constexpr OptionSpec cdOptionSpecs[] = {
+    {"--help", CdHelp, ValueKind::None},
+};
+
+enum LsOption : unsigned int {
+    LsLong, LsReverse, LsRecursive, LsTime, LsSize, LsExtension, LsNatural, LsUnsorted, LsHelp = helpOption
+};
+constexpr OptionSpec lsOptionSpecs[] = {
+    {"-l", LsLong, ValueKind::None},
+    {"-r", LsReverse, ValueKind::None},
+    {"-R", LsRecursive, ValueKind::None},
+    {"-t", LsTime, ValueKind::None},
+    {"-S", LsSize, ValueKind::None},
+    {"-X", LsExtension, ValueKind::None},
+    {"-v", LsNatural, ValueKind::None},
+    {"-U", LsUnsorted, ValueKind::None},
+    {"--help", LsHelp, ValueKind::None},
+};
+
+enum MvOption : unsigned int { MvInteractive, MvSuffix, MvUpdate, MvHelp = helpOption };
+constexpr OptionSpec mvOptionSpecs[] = {
+    {"-i", MvInteractive, ValueKind::None},
+    {"--suffix", MvSuffix, ValueKind::None},
+    {"-u", MvUpdate, ValueKind::None},
+    {"--help", MvHelp, ValueKind::None},
+};
+
+enum RmOption : unsigned int { RmRecursive, RmInteractive, RmForce, RmForceRecursive, RmHelp = helpOption };
+constexpr OptionSpec rmOptionSpecs[] = {
+    {"-r", RmRecursive, ValueKind::None},
+    {"-R", RmRecursive, ValueKind::None},
+    {"-i", RmInteractive, ValueKind::None},
+    {"-f", RmForce, ValueKind::None},
+    {"-rf", RmForceRecursive, ValueKind::None},
+    {"--help", RmHelp, ValueKind::None},
+};
+
+enum CpOption : unsigned int {
+    CpCopyContents, CpDereference, CpLink, CpRecursive, CpJobs, CpReflink, CpSync, CpVerify, CpHelp = helpOption
+};
+constexpr OptionSpec cpOptionSpecs[] = {
+    {"--copy-contents", CpCopyContents, ValueKind::None},
+    {"-d", CpDereference, ValueKind::None},
+    {"--link", CpLink, ValueKind::None},
+    {"-l", CpLink, ValueKind::None},
+    {"--recursive", CpRecursive, ValueKind::None},
+    {"-r", CpRecursive, ValueKind::None},
+    {"-R", CpRecursive, ValueKind::None},
+    {"-j", CpJobs, ValueKind::Required},
+    {"--reflink", CpReflink, ValueKind::Optional},
+    {"--sync", CpSync, ValueKind::None},
+    {"--verify", CpVerify, ValueKind::None},
+    {"--help", CpHelp, ValueKind::None},
+};
+
+enum HashOption : unsigned int { HashReset, HashHelp = helpOption };
+constexpr OptionSpec hashOptionSpecs[] = {
+    {"-r", HashReset, ValueKind::None},
+    {"--help", HashHelp, ValueKind::None},
+};
+
+enum StatsOption : unsigned int { StatsReset, StatsHelp = helpOption };
+constexpr OptionSpec statsOptionSpecs[] = {
+    {"-r", StatsReset, ValueKind::None},
+    {"--help", StatsHelp, ValueKind::None},
+};
+
+enum DircacheOption : unsigned int { DircacheReset, DircacheMemory, DircacheHelp = helpOption };
+constexpr OptionSpec dircacheOptionSpecs[] = {
+    {"-r", DircacheReset, ValueKind::None},
+    {"-m", DircacheMemory, ValueKind::Required},
+    {"--help", DircacheHelp, ValueKind::None},
+};
+
+enum JobsOption : unsigned int { JobsLong, JobsHelp = helpOption };
+constexpr OptionSpec jobsOptionSpecs[] = {
+    {"-l", JobsLong, ValueKind::None},
+    {"--help", JobsHelp, ValueKind::None},
+};
+
+enum KillOption : unsigned int { KillSignal, KillList, KillHelp = helpOption };
+constexpr OptionSpec killOptionSpecs[] = {
+    {"-s", KillSignal, ValueKind::Required},
+    {"-l", KillList, ValueKind::None},
+    {"--help", KillHelp, ValueKind::None},
+};
+
+enum DuOption : unsigned int { DuSummarize, DuHuman, DuMaxDepth, DuHelp = helpOption };
+constexpr OptionSpec duOptionSpecs[] = {
+    {"-s", DuSummarize, ValueKind::None},
+    {"-h", DuHuman, ValueKind::None},
+    {"-d", DuMaxDepth, ValueKind::Required},
+    {"--help", DuHelp, ValueKind::None},
+};
+
+enum HelpOnlyOption : unsigned int { HelpOnly = helpOption };
+constexpr OptionSpec helpOnlyOptionSpecs[] = {
+    {"--help", HelpOnly, ValueKind::None},
+};
+
+struct ListOptions {
+    bool longFormat = false;
+    bool reverseOrder = false;
+    bool recursive = false;
+    SortKey sortKey = SortKey::Name;
+};
+
+struct MoveOptions {
+    bool interactive = false;
+    bool suffixBackup = false;
+    bool onlyIfNotExists = false;
+};
+
+struct RemoveOptions {
+    bool recursive = false;
+    bool interactive = false;
+    bool force = false;
+    bool forceRecursive = false;
+};
+
+struct CopyOptions {
+    bool copyContents = false;
+    bool dereference = false;
+    bool linkFiles = false;
+    bool recursive = false;
+    size_t jobs = 0;
+    ReflinkMode reflinkMode = ReflinkMode::Auto;
+    bool sync = false;
+    bool verify = false;
+};
+
+// Builtin names, indexed by Builtin. Dispatch goes through a perfect hash of
+// these names computed at compile time: one hash and one string compare per
+// command, however many builtins there are.
+enum class Builtin : unsigned char {
+    Cd, Ls, Mv, Rm, Cp, Cat, Hash, Export, Exit, Time, Stats, Dircache, Jobs, Fg, Bg, Wait, Kill, Find, Du, Count
+};
+
+constexpr std::string_view builtinNames[] = {"cd", "ls", "mv", "rm", "cp", "cat", "hash", "export", "exit", "time",
+                                             "stats", "dircache", "jobs", "fg", "bg", "wait", "kill", "find", "du"};
+static_assert(std::size(builtinNames) == static_cast<size_t>(Builtin::Count), "every builtin needs a name");
+
+constexpr uint32_t hashBuiltinName(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+constexpr size_t builtinTableSize = 64;
+static_assert(builtinTableSize >= 2 * std::size(builtinNames), "keep the hash table at most half full");
+
+constexpr bool builtinSeedIsPerfect(uint32_t seed) {
+    bool used[builtinTableSize] = {};
+    for (std::string_view name : builtinNames) {
+        size_t slot = hashBuiltinName(name, seed) & (builtinTableSize - 1);
+        if (used[slot]) {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t findBuiltinSeed() {
+    uint32_t seed = 0;
+    while (!builtinSeedIsPerfect(seed)) {
+        ++seed;
+    }
+    return seed;
+}
+
+constexpr uint32_t builtinSeed = findBuiltinSeed();
+
+struct BuiltinSlots {
+    // Builtin index + 1 per slot; 0 marks an empty slot
+    unsigned char entries[builtinTableSize] = {};
+};
+
+constexpr BuiltinSlots makeBuiltinSlots() {
+    BuiltinSlots slots;
+    for (size_t i = 0; i < std::size(builtinNames); ++i) {
+        slots.entries[hashBuiltinName(builtinNames[i], builtinSeed) & (builtinTableSize - 1)] = static_cast<unsigned char>(i + 1);
+    }
+    return slots;
+}
+
+constexpr BuiltinSlots builtinSlots = makeBuiltinSlots();
+
+// Returns the builtin called `name`, or Builtin::Count if there is none.
+constexpr Builtin findBuiltin(std::string_view name) {
+    unsigned char entry = builtinSlots.entries[hashBuiltinName(name, builtinSeed) & (builtinTableSize - 1)];
+    if (entry != 0 && builtinNames[entry - 1] == name) {
+        return static_cast<Builtin>(entry - 1);
+    }
+    return Builtin::Count;
+}
+
+static_assert(findBuiltin("ls") == Builtin::Ls && findBuiltin("export") == Builtin::Export, "builtin hash table is broken");
+static_assert(findBuiltin("lsx") == Builtin::Count, "builtin hash table is broken");
+
+// Process counters sampled before and after a command. CPU time includes
+// waited-for children; bytes and syscalls come from /proc/self/io and only
+// cover the shell itself, including builtin threads.
+struct ResourceSample {
+    std::chrono::steady_clock::time_point wall;
+    struct rusage self;
+    struct rusage children;
+    uint64_t readBytes = 0;
+    uint64_t writtenBytes = 0;
+    uint64_t readSyscalls = 0;
+    uint64_t writeSyscalls = 0;
+    uint64_t filesTouched = 0;
+    uint64_t syscalls[static_cast<size_t>(SyscallKind::Count)] = {};
+    // Bytes returned by the read of /proc/self/io itself
+    uint64_t probeBytes = 0;
+
+    static ResourceSample take() {
+        ResourceSample sample;
+        sample.wall = std::chrono::steady_clock::now();
+        ::getrusage(RUSAGE_SELF, &sample.self);
+        ::getrusage(RUSAGE_CHILDREN, &sample.children);
+        sample.filesTouched = touchedFileCount().load(std::memory_order_relaxed);
+        for (size_t kind = 0; kind < std::size(sample.syscalls); ++kind) {
+            sample.syscalls[kind] = syscallCount(static_cast<SyscallKind>(kind)).load(std::memory_order_relaxed);
+        }
+
+        FileDescriptor fd(::open("/proc/self/io", O_RDONLY | O_CLOEXEC));
+        char text[512];
+        ssize_t n = fd.get() < 0 ? -1 : ::read(fd.get(), text, sizeof(text) - 1);
+        if (n > 0) {
+            text[n] = '\0';
+            sample.probeBytes = n;
+            sample.readBytes = field(text, "rchar: ");
+            sample.writtenBytes = field(text, "wchar: ");
+            sample.readSyscalls = field(text, "syscr: ");
+            sample.writeSyscalls = field(text, "syscw: ");
+        }
+        return sample;
+    }
+
+    static uint64_t field(const char* text, const char* name) {
+        const char* found = std::strstr(text, name);
+        return found != nullptr ? std::strtoull(found + std::strlen(name), nullptr, 10) : 0;
+    }
+};
+
+double toSeconds(const struct timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+// Resources used by one command, or summed over several
+struct ResourceUsage {
+    double wallSeconds = 0;
+    double userSeconds = 0;
+    double systemSeconds = 0;
+    uint64_t readBytes = 0;
+    uint64_t writtenBytes = 0;
+    uint64_t readSyscalls = 0;
+    uint64_t writeSyscalls = 0;
+    uint64_t filesTouched = 0;
+    uint64_t syscalls[static_cast<size_t>(SyscallKind::Count)] = {};
+    long minorFaults = 0;
+    long majorFaults = 0;
+    long voluntarySwitches = 0;
+    long involuntarySwitches = 0;
+
+    static ResourceUsage between(const ResourceSample& before, const ResourceSample& after) {
+        ResourceUsage usage;
+        usage.wallSeconds = std::chrono::duration<double>(after.wall - before.wall).count();
+        usage.userSeconds = toSeconds(after.self.ru_utime) - toSeconds(before.self.ru_utime)
+                            + toSeconds(after.children.ru_utime) - toSeconds(before.children.ru_utime);
+        usage.systemSeconds = toSeconds(after.self.ru_stime) - toSeconds(before.self.ru_stime)
+                              + toSeconds(after.children.ru_stime) - toSeconds(before.children.ru_stime);
+        // The earlier sample's own read of /proc/self/io is not the command's
+        usage.readBytes = after.readBytes - before.readBytes - std::min(before.probeBytes, after.readBytes - before.readBytes);
+        usage.writtenBytes = after.writtenBytes - before.writtenBytes;
+        usage.readSyscalls = after.readSyscalls - before.readSyscalls - (after.readSyscalls > before.readSyscalls ? 1 : 0);
+        usage.writeSyscalls = after.writeSyscalls - before.writeSyscalls;
+        usage.filesTouched = after.filesTouched - before.filesTouched;
+        for (size_t kind = 0; kind < std::size(usage.syscalls); ++kind) {
+            usage.syscalls[kind] = after.syscalls[kind] - before.syscalls[kind];
+        }
+        usage.minorFaults = after.self.ru_minflt - before.self.ru_minflt + after.children.ru_minflt - before.children.ru_minflt;
+        usage.majorFaults = after.self.ru_majflt - before.self.ru_majflt + after.children.ru_majflt - before.children.ru_majflt;
+        usage.voluntarySwitches = after.self.ru_nvcsw - before.self.ru_nvcsw + after.children.ru_nvcsw - before.children.ru_nvcsw;
+        usage.involuntarySwitches = after.self.ru_nivcsw - before.self.ru_nivcsw + after.children.ru_nivcsw - before.children.ru_nivcsw;
+        return usage;
+    }
+
+    void add(const ResourceUsage& other) {
+        wallSeconds += other.wallSeconds;
+        userSeconds += other.userSeconds;
+        systemSeconds += other.systemSeconds;
+        readBytes += other.readBytes;
+        writtenBytes += other.writtenBytes;
+        readSyscalls += other.readSyscalls;
+        writeSyscalls += other.writeSyscalls;
+        filesTouched += other.filesTouched;
+        for (size_t kind = 0; kind < std::size(syscalls); ++kind) {
+            syscalls[kind] += other.syscalls[kind];
+        }
+        minorFaults += other.minorFaults;
+        majorFaults += other.majorFaults;
+        voluntarySwitches += other.voluntarySwitches;
+        involuntarySwitches += other.involuntarySwitches;
+    }
+};
+
+// Totals and a latency histogram per command name. Bucket i counts commands
+// that took less than 2^i microseconds (and at least 2^(i-1)).
+class CommandStats {
+
+public:
+    static constexpr size_t bucketCount = 40;
+
+    void record(std::string_view name, const ResourceUsage& usage) {
+        Entry* entry = nullptr;
+        for (Entry& existing : entries) {
+            if (existing.name == name) {
+                entry = &existing;
+                break;
+            }
+        }
+        if (entry == nullptr) {
+            entry = &entries.emplace_back();
+            entry->name = name;
+        }
+
+        ++entry->count;
+        entry->total.add(usage);
+        entry->maxSeconds = std::max(entry->maxSeconds, usage.wallSeconds);
+        uint64_t micros = static_cast<uint64_t>(usage.wallSeconds * 1e6);
+        size_t bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+        ++entry->buckets[std::min(bucket, bucketCount - 1)];
+    }
+
+    void reset() {
+        entries.clear();
+    }
+
+    void writeJson(OutputWriter& writer) const {
+        writer << "{\"commands\": [";
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry& entry = entries[i];
+            const ResourceUsage& total = entry.total;
+            writer << (i == 0 ? "\n" : ",\n")
+                   << "  {\"name\": \"" << entry.name << "\", \"count\": " << entry.count
+                   << ", \"wall_seconds\": " << fixed(total.wallSeconds, 6)
+                   << ", \"max_wall_seconds\": " << fixed(entry.maxSeconds, 6)
+                   << ", \"user_seconds\": " << fixed(total.userSeconds, 6)
+                   << ", \"system_seconds\": " << fixed(total.systemSeconds, 6)
+                   << ", \"read_bytes\": " << total.readBytes
+                   << ", \"written_bytes\": " << total.writtenBytes
+                   << ", \"read_syscalls\": " << total.readSyscalls
+                   << ", \"write_syscalls\": " << total.writeSyscalls
+                   << ", \"files_touched\": " << total.filesTouched
+                   << ", \"syscalls\": {";
+            for (size_t kind = 0; kind < std::size(total.syscalls); ++kind) {
+                writer << (kind == 0 ? "" : ", ") << "\"" << syscallNames[kind] << "\": " << total.syscalls[kind];
+            }
+            writer << "}"
+                   << ", \"minor_faults\": " << total.minorFaults
+                   << ", \"major_faults\": " << total.majorFaults
+                   << ", \"voluntary_switches\": " << total.voluntarySwitches
+                   << ", \"involuntary_switches\": " << total.involuntarySwitches
+                   << ", \"latency_us\": [";
+            bool first = true;
+            for (size_t bucket = 0; bucket < bucketCount; ++bucket) {
+                if (entry.buckets[bucket] != 0) {
+                    writer << (first ? "" : ", ") << "{\"below\": " << (uint64_t(1) << bucket)
+                           << ", \"count\": " << entry.buckets[bucket] << "}";
+                    first = false;
+                }
+            }
+            writer << "]}";
+        }
+        writer << "\n]}\n";
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        uint64_t count = 0;
+        ResourceUsage total;
+        double maxSeconds = 0;
+        uint64_t buckets[bucketCount] = {};
+    };
+
+    std::vector<Entry> entries;
+};
+
+// Remembers where each external command was found on $PATH. The table is
+// dropped whenever $PATH changes and can be cleared with "hash -r".
+class CommandPathCache {
+
+public:
+    // Returns the executable for `name`, or an empty path if it is not found.
+    std::string lookup(const std::string& name) {
+        if (name.find('/') != std::string::npos) {
+            return isExecutableFile(name) ? name : std::string();
+        }
+
+        // Background jobs spawn their commands from their own threads
+        std::lock_guard<std::mutex> lock(mutex);
+        refresh();
+        auto cached = resolved.find(name);
+        if (cached != resolved.end()) {
+            return cached->second;
+        }
+
+        size_t begin = 0;
+        while (begin <= searchPath.size()) {
+            size_t end = searchPath.find(':', begin);
+            if (end == std::string::npos) {
+                end = searchPath.size();
+            }
+            // An empty entry means the current directory
+            std::string dir = end == begin ? "." : searchPath.substr(begin, end - begin);
+            std::string candidate = dir + "/" + name;
+            if (isExecutableFile(candidate)) {
+                resolved.emplace(name, candidate);
+                return candidate;
+            }
+            begin = end + 1;
+        }
+        return std::string();
+    }
+
+    void forget(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        resolved.erase(name);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        resolved.clear();
+    }
+
+    std::unordered_map<std::string, std::string> entries() {
+        std::lock_guard<std::mutex> lock(mutex);
+        refresh();
+        return resolved;
+    }
+
+private:
+    void refresh() {
+        const char* path = getenv("PATH");
+        std::string currentPath = path != nullptr ? path : "/usr/local/bin:/usr/bin:/bin";
+        if (currentPath != searchPath) {
+            resolved.clear();
+            searchPath = currentPath;
+        }
+    }
+
+    static bool isExecutableFile(const std::string& path) {
+        struct stat st;
+        return ::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(path.c_str(), X_OK) == 0;
+    }
+
+    std::mutex mutex;
+    std::string searchPath;
+    std::unordered_map<std::string, std::string> resolved;
+};
+
+// Signals kill accepts by name, with or without the SIG prefix
+struct SignalName {
+    std::string_view name;
+    int number;
+};
+
+constexpr SignalName signalNames[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+    {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+};
+
+// Returns the signal for a name or number, or -1
+int parseSignal(std::string_view text) {
+    if (text.substr(0, 3) == "SIG") {
+        text.remove_prefix(3);
+    }
+    for (const SignalName& signal : signalNames) {
+        if (signal.name == text) {
+            return signal.number;
+        }
+    }
+    int number = -1;
+    auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size() || number < 0 || number >= NSIG) {
+        return -1;
+    }
+    return number;
+}
+
+// Signals that stop or resume a process rather than end it
+bool isJobControlSignal(int signal) {
+    return signal == 0 || signal == SIGSTOP || signal == SIGTSTP || signal == SIGCONT
+           || signal == SIGTTIN || signal == SIGTTOU;
+}
+
+// A pipeline started with '&'. Its commands are copied out of the parser,
+// whose line is gone long before the job ends. External stages run in one
+// process group; builtin stages run on threads owned by the job.
+struct Job {
+    struct Process {
+        pid_t pid;
+        bool stopped = false;
+        bool reaped = false;
+    };
+
+    int id = 0;
+    std::string command;
+    TextArena arena;
+    std::vector<CommandNode> commands;
+    // Raised by kill; builtin stages poll it through activeCancelFlag()
+    std::atomic<bool> cancelled{false};
+
+    // Guarded by the JobTable mutex
+    std::vector<std::thread> threads;
+    size_t runningThreads = 0;
+    std::vector<Process> processes;
+    pid_t group = 0;
+    pid_t lastProcess = -1;
+    bool launching = true;
+    bool finished = false;
+    int cancelSignal = 0;
+    int status = 0;
+};
+
+// Background jobs of the shell. Processes are reaped with WNOHANG whenever
+// the table is looked at (at the prompt, by jobs and kill) and with blocking
+// waits by fg and wait, so the shell needs no SIGCHLD handler.
+class JobTable {
+
+public:
+    JobTable() = default;
+
+    // Builtin stages are threads of this process and cannot be left behind;
+    // external processes keep running, as in other shells
+    ~JobTable() {
+        for (auto& job : jobs) {
+            for (std::thread& thread : job->threads) {
+                thread.join();
+            }
+        }
+    }
+
+    JobTable(const JobTable&) = delete;
+    JobTable& operator=(const JobTable&) = delete;
+
+    // Copies the commands of the parser's current pipeline into a new job
+    Job& add(const Parser& parser) {
+        auto job = std::make_unique<Job>();
+        for (size_t i = 0; i < parser.commandCount(); ++i) {
+            const CommandNode& source = parser.command(i);
+            CommandNode& node = job->commands.emplace_back();
+            for (std::string_view word : source.argv) {
+                node.argv.push_back(job->arena.store(word));
+                job->command += word;
+                job->command += ' ';
+            }
+            node.inputFile = job->arena.store(source.inputFile);
+            node.outputFile = job->arena.store(source.outputFile);
+            node.errorFile = job->arena.store(source.errorFile);
+            node.append = source.append;
+            node.errorToOutput = source.errorToOutput;
+            appendRedirection(job->command, "< ", source.inputFile);
+            appendRedirection(job->command, source.append ? ">> " : "> ", source.outputFile);
+            appendRedirection(job->command, "2> ", source.errorFile);
+            if (source.errorToOutput) {
+                job->command += "2>&1 ";
+            }
+            if (i + 1 < parser.commandCount()) {
+                job->command += "| ";
+            }
+        }
+        job->command.pop_back();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        job->id = jobs.empty() ? 1 : jobs.back()->id + 1;
+        jobs.push_back(std::move(job));
+        return *jobs.back();
+    }
+
+    pid_t processGroup(const Job& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return job.group;
+    }
+
+    // Records an external stage; the first one leads the process group
+    void addProcess(Job& job, pid_t pid, bool last) {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.processes.push_back(Job::Process{pid});
+        if (job.group == 0) {
+            job.group = pid;
+        }
+        if (last) {
+            job.lastProcess = pid;
+        }
+    }
+
+    template <typename Body>
+    void startThread(Job& job, Body&& body) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++job.runningThreads;
+        job.threads.emplace_back(std::forward<Body>(body));
+    }
+
+    // Called by a builtin stage's thread when the builtin returns
+    void threadFinished(Job& job, bool last, int status) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (last) {
+            job.status = job.cancelled ? 128 + job.cancelSignal : status;
+        }
+        --job.runningThreads;
+        updateFinished(job);
+        changed.notify_all();
+    }
+
+    // Ends the launch; `status` stands for a last stage that did not start
+    void launched(Job& job, int status) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (status != 0) {
+            job.status = status;
+        }
+        job.launching = false;
+        updateFinished(job);
+    }
+
+    // Looks up "%n", "%%", "%+", "%-" or the pid of one of a job's
+    // processes. An empty spec means the current job.
+    Job* find(std::string_view spec) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spec.empty() || spec == "%%" || spec == "%+" || spec == "%") {
+            return jobs.empty() ? nullptr : jobs.back().get();
+        }
+        if (spec == "%-") {
+            return jobs.size() < 2 ? nullptr : jobs[jobs.size() - 2].get();
+        }
+        bool byId = spec[0] == '%';
+        if (byId) {
+            spec.remove_prefix(1);
+        }
+        int number = 0;
+        auto result = std::from_chars(spec.data(), spec.data() + spec.size(), number);
+        if (result.ec != std::errc() || result.ptr != spec.data() + spec.size()) {
+            return nullptr;
+        }
+        for (auto& job : jobs) {
+            if (byId && job->id == number) {
+                return job.get();
+            }
+            for (const Job::Process& process : job->processes) {
+                if (!byId && process.pid == number) {
+                    return job.get();
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<Job*> all() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Job*> result;
+        for (auto& job : jobs) {
+            result.push_back(job.get());
+        }
+        return result;
+    }
+
+    // Blocks until the job finishes or is stopped; returns its status, or
+    // 128 + SIGSTOP for a stopped job.
+    int wait(Job& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            reap(job);
+            if (job.finished) {
+                return job.status;
+            }
+            if (isStopped(job)) {
+                return 128 + SIGSTOP;
+            }
+            if (job.runningThreads == 0) {
+                lock.unlock();
+                reapOne(job);
+                lock.lock();
+            } else {
+                // Builtin stages notify; processes are checked on the next turn
+                changed.wait_for(lock, std::chrono::milliseconds(50));
+            }
+        }
+    }
+
+    // Sends `signal` to the job's processes. Builtin stages cannot be stopped
+    // or continued, but any other signal cancels them.
+    bool signal(Job& job, int signal, std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        reap(job);
+        if (job.finished) {
+            error = "job has terminated";
+            return false;
+        }
+        bool hasProcesses = false;
+        for (const Job::Process& process : job.processes) {
+            hasProcesses |= !process.reaped;
+        }
+        if (isJobControlSignal(signal) && !hasProcesses) {
+            if (signal != 0) {
+                error = "builtin jobs cannot be stopped or continued";
+                return false;
+            }
+            return true;
+        }
+        if (hasProcesses && ::killpg(job.group, signal) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        if (!isJobControlSignal(signal) && job.runningThreads != 0) {
+            job.cancelSignal = signal;
+            job.cancelled = true;
+        }
+        return true;
+    }
+
+    bool stopped(Job& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        reap(job);
+        return isStopped(job);
+    }
+
+    // Writes one line per job. Finished jobs are listed once and dropped.
+    void list(OutputWriter& writer, bool showPids) {
+        report(writer, showPids, false);
+    }
+
+    // At the prompt: announces jobs that finished since the last prompt
+    void reportFinished(OutputWriter& writer) {
+        report(writer, false, true);
+    }
+
+    // Without a prompt: reaps and drops finished jobs silently, so scripts
+    // that start many jobs leave no zombies and the table does not grow
+    void dropFinished() {
+        std::vector<std::unique_ptr<Job>> removed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& job : jobs) {
+                reap(*job);
+            }
+            takeFinished(removed);
+        }
+        joinAll(removed);
+    }
+
+    // Drops a job that fg or wait has waited for
+    void remove(Job& job) {
+        std::unique_ptr<Job> removed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+                if (it->get() == &job) {
+                    removed = std::move(*it);
+                    jobs.erase(it);
+                    break;
+                }
+            }
+        }
+        if (removed) {
+            for (std::thread& thread : removed->threads) {
+                thread.join();
+            }
+        }
+    }
+
+    void formatLine(const Job& job, char marker, bool showPids, std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        describe(job, marker, showPids, line);
+    }
+
+private:
+    static void appendRedirection(std::string& text, std::string_view op, std::string_view file) {
+        if (!file.empty()) {
+            text += op;
+            text += file;
+            text += ' ';
+        }
+    }
+
+    static bool isStopped(const Job& job) {
+        for (const Job::Process& process : job.processes) {
+            if (process.stopped && !process.reaped) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Collects status changes of the job's processes without blocking;
+    // mutex held
+    void reap(Job& job) {
+        for (Job::Process& process : job.processes) {
+            while (!process.reaped) {
+                int status;
+                pid_t result = ::waitpid(process.pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result == 0) {
+                    break;
+                }
+                record(job, process, result < 0 ? -1 : status);
+            }
+        }
+        updateFinished(job);
+    }
+
+    // Blocks on the first process still running; mutex not held
+    void reapOne(Job& job) {
+        pid_t pid = -1;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const Job::Process& process : job.processes) {
+                if (!process.reaped && !process.stopped) {
+                    pid = process.pid;
+                    break;
+                }
+            }
+        }
+        if (pid < 0) {
+            return;
+        }
+        int status;
+        pid_t result;
+        do {
+            result = ::waitpid(pid, &status, WUNTRACED | WCONTINUED);
+        } while (result < 0 && errno == EINTR);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Job::Process& process : job.processes) {
+            if (process.pid == pid) {
+                record(job, process, result < 0 ? -1 : status);
+            }
+        }
+        updateFinished(job);
+    }
+
+    // Applies one waitpid status; -1 means the process was reaped elsewhere
+    void record(Job& job, Job::Process& process, int status) {
+        if (status != -1 && WIFSTOPPED(status)) {
+            process.stopped = true;
+            return;
+        }
+        if (status != -1 && WIFCONTINUED(status)) {
+            process.stopped = false;
+            return;
+        }
+        process.reaped = true;
+        if (process.pid == job.lastProcess) {
+            if (status == -1) {
+                job.status = 1;
+            } else {
+                job.status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+            }
+        }
+    }
+
+    void updateFinished(Job& job) {
+        if (job.finished || job.launching || job.runningThreads != 0) {
+            return;
+        }
+        for (const Job::Process& process : job.processes) {
+            if (!process.reaped) {
+                return;
+            }
+        }
+        job.finished = true;
+    }
+
+    // "[1]+  Running                 cp -r src dst &"
+    void describe(const Job& job, char marker, bool showPids, std::string& line) {
+        line = "[" + std::to_string(job.id) + "]" + marker + " ";
+        if (showPids) {
+            for (const Job::Process& process : job.processes) {
+                line += std::to_string(process.pid) + " ";
+            }
+            if (job.processes.empty()) {
+                line += "builtin ";
+            }
+        }
+        std::string state;
+        if (!job.finished) {
+            state = isStopped(job) ? "Stopped" : "Running";
+        } else if (job.status == 0) {
+            state = "Done";
+        } else if (job.status > 128 && job.status < 128 + NSIG) {
+            state = ::strsignal(job.status - 128);
+        } else {
+            state = "Exit " + std::to_string(job.status);
+        }
+        state.resize(std::max<size_t>(state.size() + 1, 24), ' ');
+        line += " " + state + job.command + " &";
+    }
+
+    void report(OutputWriter& writer, bool showPids, bool finishedOnly) {
+        std::vector<std::unique_ptr<Job>> removed;
+        std::string line;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                reap(*jobs[i]);
+                if (finishedOnly && !jobs[i]->finished) {
+                    continue;
+                }
+                char marker = i + 1 == jobs.size() ? '+' : (i + 2 == jobs.size() ? '-' : ' ');
+                describe(*jobs[i], marker, showPids, line);
+                writer << line << '\n';
+            }
+            takeFinished(removed);
+        }
+        joinAll(removed);
+    }
+
+    // Moves the finished jobs out of the table; mutex held
+    void takeFinished(std::vector<std::unique_ptr<Job>>& removed) {
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            if ((*it)->finished) {
+                removed.push_back(std::move(*it));
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static void joinAll(std::vector<std::unique_ptr<Job>>& removed) {
+        for (auto& job : removed) {
+            for (std::thread& thread : job->threads) {
+                thread.join();
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::unique_ptr<Job>> jobs;
+};
+
+// Command history shared by the interactive sessions: one command per line
+// in $HISTFILE, or ~/.myshell_history. A session appends each command with
+// a single O_APPEND write, which the kernel never interleaves with another,
+// so concurrent shells need no lock. Nothing is read on the way to the first
+// prompt. The first lookup reads the file into a private buffer, so another
+// session truncating it cannot fault this one, and later lookups read only
+// what was appended since. Searches go from the newest entry back, and the
+// trigram indexes are built the same way, one chunk of entries at a time as
+// a search first reaches it, so a match among recent commands never waits
+// for the whole file to be indexed.
+class HistoryFile {
+
+public:
+    void open(const std::string& filePath) {
+        path = filePath;
+        appendFd.reset(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+    }
+
+    void add(std::string_view line) {
+        if (appendFd.get() < 0 || line.empty() || line.find('\n') != std::string_view::npos) {
+            return;
+        }
+        // Repeating the last command does not grow the file
+        if (line == lastAdded) {
+            return;
+        }
+        lastAdded = line;
+        lastAdded += '\n';
+        ssize_t ignored = ::write(appendFd.get(), lastAdded.data(), lastAdded.size());
+        (void)ignored;
+        lastAdded.pop_back();
+    }
+
+    // Picks up commands appended since the last call; indexes stay valid
+    size_t size() {
+        refresh();
+        return starts.size();
+    }
+
+    std::string_view entry(size_t index) const {
+        size_t end = index + 1 < starts.size() ? starts[index + 1] - 1 : scanned - 1;
+        return std::string_view(text).substr(starts[index], end - starts[index]);
+    }
+
+    // The newest entry before `before` that contains `query`, or npos
+    size_t findContaining(std::string_view query, size_t before) {
+        refresh();
+        auto contains = [&](std::string_view line) { return line.find(query) != std::string_view::npos; };
+        if (query.size() < 3) {
+            return scanBackward(before, contains);
+        }
+        // Every match contains every trigram of the query; walk the rarest list
+        return searchBackward(before, contains, [&](const Chunk& chunk) -> const std::vector<uint32_t>* {
+            const std::vector<uint32_t>* rarest = nullptr;
+            for (size_t i = 0; i + 3 <= query.size(); ++i) {
+                auto it = chunk.trigrams.find(trigramKey(query.data() + i));
+                if (it == chunk.trigrams.end()) {
+                    return nullptr;
+                }
+                if (rarest == nullptr || it->second.size() < rarest->size()) {
+                    rarest = &it->second;
+                }
+            }
+            return rarest;
+        });
+    }
+
+    // The nearest entry that starts with `prefix`: the newest one before
+    // `from`, or with `older` false the oldest one after it. npos if none.
+    size_t findPrefix(std::string_view prefix, size_t from, bool older) {
+        refresh();
+        auto startsWith = [&](std::string_view line) { return line.substr(0, prefix.size()) == prefix; };
+        if (prefix.size() < 3) {
+            if (older) {
+                return scanBackward(from, startsWith);
+            }
+            for (size_t i = from + 1; i < starts.size(); ++i) {
+                if (startsWith(entry(i))) {
+                    return i;
+                }
+            }
+            return npos;
+        }
+        auto postings = [&](const Chunk& chunk) -> const std::vector<uint32_t>* {
+            auto it = chunk.prefixes.find(trigramKey(prefix.data()));
+            return it != chunk.prefixes.end() ? &it->second : nullptr;
+        };
+        if (older) {
+            return searchBackward(from, startsWith, postings);
+        }
+        // Newer entries were indexed on the way back to `from`
+        for (size_t position = from + 1; position < starts.size();) {
+            const Chunk& chunk = chunkFor(position);
+            if (const std::vector<uint32_t>* list = postings(chunk)) {
+                for (auto next = std::lower_bound(list->begin(), list->end(), position); next != list->end(); ++next) {
+                    if (startsWith(entry(*next))) {
+                        return *next;
+                    }
+                }
+            }
+            position = chunk.end;
+        }
+        return npos;
+    }
+
+    static constexpr size_t npos = SIZE_MAX;
+
+private:
+    // Search indexes for the entries [first, end). Posting lists are sorted.
+    struct Chunk {
+        size_t first;
+        size_t end;
+        std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams{};
+        // Entries by their first three bytes
+        std::unordered_map<uint32_t, std::vector<uint32_t>> prefixes{};
+    };
+
+    static constexpr size_t chunkEntries = 4096;
+
+    static uint32_t trigramKey(const char* text) {
+        return static_cast<unsigned char>(text[0]) | static_cast<unsigned char>(text[1]) << 8
+               | static_cast<unsigned char>(text[2]) << 16;
+    }
+
+    // Reads what was appended since the last call and indexes the new
+    // complete lines. A line another session is still writing has no newline
+    // yet and waits.
+    void refresh() {
+        if (path.empty()) {
+            return;
+        }
+        struct stat st;
+        bool found = ::stat(path.c_str(), &st) == 0;
+        if (!found || static_cast<size_t>(st.st_size) < text.size() || st.st_ino != inode) {
+            // Replaced or truncated behind our back: start over
+            text.clear();
+            starts.clear();
+            chunks.clear();
+            scanned = 0;
+            indexedFrom = indexedTo = 0;
+            inode = found ? st.st_ino : 0;
+            if (!found) {
+                return;
+            }
+        }
+        if (static_cast<size_t>(st.st_size) > text.size()) {
+            FileDescriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            size_t loaded = text.size();
+            text.resize(st.st_size);
+            ssize_t n = 0;
+            while (fd.get() >= 0 && loaded < text.size()
+                   && ((n = ::pread(fd.get(), &text[loaded], text.size() - loaded, loaded)) > 0 || (n < 0 && errno == EINTR))) {
+                loaded += n > 0 ? n : 0;
+            }
+            text.resize(loaded);
+        }
+        while (scanned < text.size()) {
+            const char* newline = static_cast<const char*>(std::memchr(text.data() + scanned, '\n', text.size() - scanned));
+            if (newline == nullptr) {
+                break;
+            }
+            starts.push_back(scanned);
+            scanned = newline - text.data() + 1;
+        }
+    }
+
+    void indexEntry(Chunk& chunk, size_t index) {
+        std::string_view line = entry(index);
+        uint32_t key = static_cast<uint32_t>(index);
+        for (size_t i = 0; i + 3 <= line.size(); ++i) {
+            std::vector<uint32_t>& postings = chunk.trigrams[trigramKey(line.data() + i)];
+            if (postings.empty() || postings.back() != key) {
+                postings.push_back(key);
+            }
+        }
+        if (line.size() >= 3) {
+            chunk.prefixes[trigramKey(line.data())].push_back(key);
+        }
+    }
+
+    // Indexes the entries added since the last search. The first search
+    // indexes only the newest chunk.
+    void indexNewest() {
+        if (chunks.empty()) {
+            indexedFrom = indexedTo = starts.size() - std::min(starts.size(), chunkEntries);
+        }
+        for (; indexedTo < starts.size(); ++indexedTo) {
+            if (chunks.empty() || chunks.back().end - chunks.back().first >= chunkEntries) {
+                chunks.push_back(Chunk{indexedTo, indexedTo});
+            }
+            indexEntry(chunks.back(), indexedTo);
+            chunks.back().end = indexedTo + 1;
+        }
+    }
+
+    // The chunk holding entry `index`, indexing older chunks as needed
+    const Chunk& chunkFor(size_t index) {
+        indexNewest();
+        while (index < indexedFrom) {
+            size_t first = indexedFrom - std::min(indexedFrom, chunkEntries);
+            Chunk chunk{first, indexedFrom};
+            for (size_t i = first; i < indexedFrom; ++i) {
+                indexEntry(chunk, i);
+            }
+            chunks.push_front(std::move(chunk));
+            indexedFrom = first;
+        }
+        auto it = std::upper_bound(chunks.begin(), chunks.end(), index,
+                                   [](size_t value, const Chunk& chunk) { return value < chunk.first; });
+        return *std::prev(it);
+    }
+
+    // Walks the posting list that `postings` picks in each chunk, newest
+    // chunk first; a chunk without a list has no candidates
+    template <typename Match, typename Postings>
+    size_t searchBackward(size_t before, Match&& match, Postings&& postings) {
+        for (size_t position = std::min(before, starts.size()); position > 0;) {
+            const Chunk& chunk = chunkFor(position - 1);
+            if (const std::vector<uint32_t>* list = postings(chunk)) {
+                auto it = std::lower_bound(list->begin(), list->end(), position);
+                while (it != list->begin()) {
+                    --it;
+                    if (match(entry(*it))) {
+                        return *it;
+                    }
+                }
+            }
+            position = chunk.first;
+        }
+        return npos;
+    }
+
+    template <typename Match>
+    size_t scanBackward(size_t before, Match&& match) const {
+        for (size_t i = std::min(before, starts.size()); i-- > 0;) {
+            if (match(entry(i))) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    std::string path;
+    FileDescriptor appendFd;
+    std::string lastAdded;
+    // The file as read so far, and its inode
+    std::string text;
+    ino_t inode = 0;
+    // Offset of every complete line, and the end of the last one
+    std::vector<uint64_t> starts;
+    size_t scanned = 0;
+    // Chunks in entry order, covering [indexedFrom, indexedTo)
+    std::deque<Chunk> chunks;
+    size_t indexedFrom = 0;
+    size_t indexedTo = 0;
+};
+
+// The byte a terminal sends for Ctrl and the given letter
+constexpr int controlKey(char c) {
+    return c & 0x1f;
+}
+
+// Reads interactive command lines with the terminal in raw mode. Keys follow
+// emacs/readline: Ctrl-A/E/B/F and the arrows move, Ctrl-K/U/W cut, Up/Down
+// step through the history entries that start with what was typed, and
+// Ctrl-R searches the history incrementally. Tab completes builtins in
+// command position and paths everywhere else. The terminal is raw only while
+// a line is read, so commands always run with the settings they inherited.
+class LineEditor {
+
+public:
+    explicit LineEditor(HistoryFile& history) : history(history) {}
+
+    // Shows the prompt and reads one line. Returns false at end of input.
+    bool readLine(std::string_view promptText, std::string& line) {
+        RawMode raw;
+        if (!raw.active()) {
+            return false;
+        }
+        prompt = promptText;
+        buffer.clear();
+        cursor = 0;
+        scroll = 0;
+        historyIndex = HistoryFile::npos;
+        lastWasTab = false;
+        refresh();
+
+        int key = readKey();
+        while (true) {
+            bool tab = false;
+            if (key < 0) {
+                emit("\r\n");
+                return false;
+            }
+            switch (key) {
+            case '\r':
+            case '\n':
+                finish(line);
+                return true;
+            case controlKey('D'):
+                if (buffer.empty()) {
+                    emit("\r\n");
+                    return false;
+                }
+                erase(cursor, nextChar(cursor));
+                break;
+            case controlKey('C'):
+                cursor = buffer.size();
+                refresh();
+                emit("^C\r\n");
+                line.clear();
+                return true;
+            case controlKey('A'):
+            case KeyHome:
+                cursor = 0;
+                break;
+            case controlKey('E'):
+            case KeyEnd:
+                cursor = buffer.size();
+                break;
+            case controlKey('B'):
+            case KeyLeft:
+                cursor = previousChar(cursor);
+                break;
+            case controlKey('F'):
+            case KeyRight:
+                cursor = nextChar(cursor);
+                break;
+            case 127:
+            case controlKey('H'):
+                erase(previousChar(cursor), cursor);
+                break;
+            case KeyDelete:
+                erase(cursor, nextChar(cursor));
+                break;
+            case controlKey('K'):
+                erase(cursor, buffer.size());
+                break;
+            case controlKey('U'):
+                erase(0, cursor);
+                break;
+            case controlKey('W'): {
+                size_t start = cursor;
+                while (start > 0 && buffer[start - 1] == ' ') {
+                    --start;
+                }
+                while (start > 0 && buffer[start - 1] != ' ') {
+                    --start;
+                }
+                erase(start, cursor);
+                break;
+            }
+            case controlKey('L'):
+                emit("\x1b[H\x1b[2J");
+                break;
+            case controlKey('P'):
+            case KeyUp:
+                recall(true);
+                break;
+            case controlKey('N'):
+            case KeyDown:
+                recall(false);
+                break;
+            case controlKey('R'):
+                key = search();
+                if (key == '\r' || key == '\n') {
+                    finish(line);
+                    return true;
+                } else if (key != 0) {
+                    // Any other key leaves the match in place to be edited
+                    continue;
+                }
+                break;
+            case '\t':
+                complete();
+                tab = true;
+                break;
+            default:
+                if (key >= ' ' && key < 256) {
+                    buffer.insert(cursor++, 1, static_cast<char>(key));
+                    historyIndex = HistoryFile::npos;
+                }
+                break;
+            }
+            lastWasTab = tab;
+            refresh();
+            key = readKey();
+        }
+    }
+
+private:
+    // Puts the terminal in raw mode and restores it on destruction. Output
+    // processing stays on so "\n" from background jobs still returns the
+    // carriage.
+    class RawMode {
+
+    public:
+        RawMode() {
+            if (::tcgetattr(STDIN_FILENO, &saved) != 0) {
+                return;
+            }
+            termios raw = saved;
+            raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+            raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+            raw.c_cflag |= CS8;
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            enabled = ::tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0;
+        }
+
+        ~RawMode() {
+            if (enabled) {
+                ::tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+            }
+        }
+
+        RawMode(const RawMode&) = delete;
+        RawMode& operator=(const RawMode&) = delete;
+
+        bool active() const {
+            return enabled;
+        }
+
+    private:
+        termios saved;
+        bool enabled = false;
+    };
+
+    enum Key { KeyUp = 1000, KeyDown, KeyLeft, KeyRight, KeyHome, KeyEnd, KeyDelete, KeyEscape };
+
+    // Returns a byte, a Key for an escape sequence, or -1 at end of input
+    int readKey() {
+        int c = readByte();
+        if (c != 0x1b) {
+            return c;
+        }
+        // A lone Escape is not followed by anything within a few milliseconds
+        struct pollfd pending = {STDIN_FILENO, POLLIN, 0};
+        if (::poll(&pending, 1, 50) <= 0) {
+            return KeyEscape;
+        }
+        int kind = readByte();
+        if (kind != '[' && kind != 'O') {
+            return KeyEscape;
+        }
+        int code = readByte();
+        if (code >= '0' && code <= '9') {
+            // "ESC [ n ~", possibly with modifiers we ignore
+            int number = code - '0';
+            while ((code = readByte()) >= '0' && code <= '9') {
+                number = number * 10 + code - '0';
+            }
+            while (code == ';' || (code >= '0' && code <= '9')) {
+                code = readByte();
+            }
+            switch (number) {
+            case 1:
+            case 7:
+                return KeyHome;
+            case 4:
+            case 8:
+                return KeyEnd;
+            case 3:
+                return KeyDelete;
+            }
+            return KeyEscape;
+        }
+        switch (code) {
+        case 'A':
+            return KeyUp;
+        case 'B':
+            return KeyDown;
+        case 'C':
+            return KeyRight;
+        case 'D':
+            return KeyLeft;
+        case 'H':
+            return KeyHome;
+        case 'F':
+            return KeyEnd;
+        }
+        return KeyEscape;
+    }
+
+    static int readByte() {
+        unsigned char c;
+        while (true) {
+            ssize_t n = ::read(STDIN_FILENO, &c, 1);
+            if (n == 1) {
+                return c;
+            } else if (n == 0 || errno != EINTR) {
+                return -1;
+            }
+        }
+    }
+
+    static void emit(std::string_view text) {
+        while (!text.empty()) {
+            ssize_t n = ::write(STDOUT_FILENO, text.data(), text.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                return;
+            }
+            text.remove_prefix(n);
+        }
+    }
+
+    static size_t terminalWidth() {
+        struct winsize size;
+        if (::ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+            return size.ws_col;
+        }
+        return 80;
+    }
+
+    // Columns taken by text, counting each UTF-8 sequence as one
+    static size_t columns(std::string_view text) {
+        size_t count = 0;
+        for (char c : text) {
+            count += (static_cast<unsigned char>(c) & 0xc0) != 0x80;
+        }
+        return count;
+    }
+
+    size_t previousChar(size_t position) const {
+        while (position > 0 && (static_cast<unsigned char>(buffer[--position]) & 0xc0) == 0x80) {
+        }
+        return position;
+    }
+
+    size_t nextChar(size_t position) const {
+        if (position < buffer.size()) {
+            ++position;
+        }
+        while (position < buffer.size() && (static_cast<unsigned char>(buffer[position]) & 0xc0) == 0x80) {
+            ++position;
+        }
+        return position;
+    }
+
+    void erase(size_t from, size_t to) {
+        buffer.erase(from, to - from);
+        cursor = from;
+        historyIndex = HistoryFile::npos;
+    }
+
+    void finish(std::string& line) {
+        cursor = buffer.size();
+        refresh();
+        emit("\r\n");
+        line = buffer;
+    }
+
+    // Redraws the line in place. A line wider than the terminal scrolls
+    // sideways to keep the cursor in view instead of wrapping.
+    void refresh() {
+        refresh(prompt, buffer, cursor);
+    }
+
+    void refresh(std::string_view shownPrompt, std::string_view text, size_t position) {
+        size_t promptColumns = columns(shownPrompt);
+        size_t width = terminalWidth();
+        size_t room = width > promptColumns + 1 ? width - promptColumns - 1 : 1;
+
+        if (scroll > position) {
+            scroll = position;
+        }
+        auto advance = [&](size_t at) {
+            for (++at; at < text.size() && (static_cast<unsigned char>(text[at]) & 0xc0) == 0x80; ++at) {
+            }
+            return at;
+        };
+        while (columns(text.substr(scroll, position - scroll)) > room) {
+            scroll = advance(scroll);
+        }
+        size_t end = scroll;
+        for (size_t used = 0; end < text.size() && used < room; ++used) {
+            end = advance(end);
+        }
+
+        std::string frame = "\r";
+        frame += shownPrompt;
+        frame.append(text.substr(scroll, end - scroll));
+        frame += "\x1b[K\r";
+        size_t cursorColumn = promptColumns + columns(text.substr(scroll, position - scroll));
+        if (cursorColumn > 0) {
+            frame += "\x1b[" + std::to_string(cursorColumn) + "C";
+        }
+        emit(frame);
+    }
+
+    // Replaces the line with the nearest history entry that starts with what
+    // was typed before the first Up, skipping entries equal to the line.
+    void recall(bool older) {
+        size_t count = history.size();
+        if (historyIndex == HistoryFile::npos) {
+            if (!older) {
+                return;
+            }
+            typed = buffer;
+            historyIndex = count;
+        }
+        size_t found = historyIndex;
+        do {
+            found = history.findPrefix(typed, found, older);
+        } while (found != HistoryFile::npos && history.entry(found) == buffer);
+
+        if (found != HistoryFile::npos) {
+            historyIndex = found;
+            buffer = history.entry(found);
+        } else if (!older) {
+            // Down past the newest match returns to what was typed
+            historyIndex = HistoryFile::npos;
+            buffer = typed;
+        }
+        cursor = buffer.size();
+    }
+
+    // Incremental reverse search. Returns the key that ended it, or 0 when
+    // it was cancelled and the line left as it was.
+    int search() {
+        std::string query;
+        std::string original = buffer;
+        size_t found = HistoryFile::npos;
+        bool failed = false;
+
+        while (true) {
+            std::string_view match = found != HistoryFile::npos ? history.entry(found) : std::string_view(original);
+            size_t position = found != HistoryFile::npos ? match.find(query) : match.size();
+            std::string shown = (failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`") + query + "': ";
+            scroll = 0;
+            refresh(shown, match, position == std::string_view::npos ? 0 : position);
+
+            int key = readKey();
+            if (key == controlKey('R') || (key >= ' ' && key < 256 && key != 127) || key == 127 || key == controlKey('H')) {
+                size_t from = history.size();
+                if (key == controlKey('R')) {
+                    // Older matches, passing over repeats of the one shown
+                    from = found != HistoryFile::npos ? found : from;
+                } else if (key == 127 || key == controlKey('H')) {
+                    if (!query.empty()) {
+                        query.pop_back();
+                    }
+                } else {
+                    query += static_cast<char>(key);
+                    // The current match stays if it still matches
+                    from = found != HistoryFile::npos ? found + 1 : from;
+                }
+                if (query.empty()) {
+                    found = HistoryFile::npos;
+                    failed = false;
+                    continue;
+                }
+                size_t next = from;
+                do {
+                    next = history.findContaining(query, next);
+                } while (key == controlKey('R') && next != HistoryFile::npos && found != HistoryFile::npos
+                         && history.entry(next) == history.entry(found));
+                failed = next == HistoryFile::npos;
+                if (!failed) {
+                    found = next;
+                }
+                continue;
+            }
+
+            scroll = 0;
+            if (key == controlKey('G') || key == controlKey('C')) {
+                buffer = original;
+                cursor = buffer.size();
+                return 0;
+            }
+            buffer = match;
+            cursor = position == std::string_view::npos ? 0 : position;
+            historyIndex = HistoryFile::npos;
+            return key == KeyEscape ? 0 : key;
+        }
+    }
+
+    static bool isSpecial(char c) {
+        return std::strchr(" \t\\'\"$|;&<>*?[]{}#", c) != nullptr;
+    }
+
+    // Completes the word before the cursor: to the only candidate, or to
+    // the longest prefix the candidates share. A second Tab with nothing
+    // left to add lists them.
+    void complete() {
+        size_t start = cursor;
+        while (start > 0 && !(std::strchr(" \t|;&<>", buffer[start - 1]) != nullptr
+                              && (start < 2 || buffer[start - 2] != '\\'))) {
+            --start;
+        }
+        std::string word;
+        for (size_t i = start; i < cursor; ++i) {
+            if (buffer[i] == '\\' && i + 1 < cursor) {
+                ++i;
+            }
+            word += buffer[i];
+        }
+
+        size_t before = start;
+        while (before > 0 && (buffer[before - 1] == ' ' || buffer[before - 1] == '\t')) {
+            --before;
+        }
+        bool command = (before == 0 || std::strchr("|;&", buffer[before - 1]) != nullptr)
+                       && word.find('/') == std::string::npos;
+
+        // Candidates are full names; directories end with '/'
+        std::vector<std::string> candidates;
+        std::string_view stem = word;
+        if (command) {
+            for (std::string_view name : builtinNames) {
+                if (name.substr(0, word.size()) == word) {
+                    candidates.emplace_back(name);
+                }
+            }
+        } else {
+            size_t slash = word.rfind('/');
+            std::string directory = slash == std::string::npos ? "." : word.substr(0, slash + 1);
+            stem = slash == std::string::npos ? stem : stem.substr(slash + 1);
+            if (directory[0] == '~' && (directory.size() == 1 || directory[1] == '/')) {
+                const char* home = getenv("HOME");
+                directory.replace(0, 1, home != nullptr ? home : "");
+            }
+            FileDescriptor fd(::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (fd.get() >= 0) {
+                DirectoryReader reader(fd.get());
+                std::string_view name;
+                unsigned char type;
+                while (reader.next(name, type)) {
+                    if (name.substr(0, stem.size()) != stem || (name[0] == '.' && (stem.empty() || stem[0] != '.'))) {
+                        continue;
+                    }
+                    struct stat st;
+                    bool isDirectory = type == DT_DIR;
+                    if (type == DT_LNK || type == DT_UNKNOWN) {
+                        std::string target(name);
+                        isDirectory = ::fstatat(fd.get(), target.c_str(), &st, 0) == 0 && S_ISDIR(st.st_mode);
+                    }
+                    candidates.emplace_back(name);
+                    if (isDirectory) {
+                        candidates.back() += '/';
+                    }
+                }
+            }
+        }
+        if (candidates.empty()) {
+            return;
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        std::string_view shared = candidates[0];
+        for (const std::string& candidate : candidates) {
+            size_t length = 0;
+            while (length < shared.size() && length < candidate.size() && shared[length] == candidate[length]) {
+                ++length;
+            }
+            shared = shared.substr(0, length);
+        }
+
+        std::string insert;
+        for (char c : shared.substr(stem.size())) {
+            if (isSpecial(c)) {
+                insert += '\\';
+            }
+            insert += c;
+        }
+        if (candidates.size() == 1 && shared.back() != '/') {
+            insert += ' ';
+        }
+        if (!insert.empty()) {
+            buffer.insert(cursor, insert);
+            cursor += insert.size();
+            historyIndex = HistoryFile::npos;
+        } else if (lastWasTab) {
+            listCandidates(candidates);
+        }
+    }
+
+    void listCandidates(const std::vector<std::string>& candidates) {
+        size_t widest = 0;
+        for (const std::string& candidate : candidates) {
+            widest = std::max(widest, columns(candidate));
+        }
+        size_t perRow = std::max<size_t>(1, terminalWidth() / (widest + 2));
+        size_t rows = (candidates.size() + perRow - 1) / perRow;
+
+        std::string listing = "\r\n";
+        for (size_t row = 0; row < rows; ++row) {
+            for (size_t i = row; i < candidates.size(); i += rows) {
+                listing += candidates[i];
+                if (i + rows < candidates.size()) {
+                    listing.append(widest + 2 - columns(candidates[i]), ' ');
+                }
+            }
+            listing += "\r\n";
+        }
+        emit(listing);
+    }
+
+    HistoryFile& history;
+    std::string prompt;
+    std::string buffer;
+    // Byte offsets into buffer: the cursor, and the first byte on screen
+    size_t cursor = 0;
+    size_t scroll = 0;
+    // Entry shown by Up/Down, or npos while editing a new line
+    size_t historyIndex = HistoryFile::npos;
+    // The line as typed before Up, which recall matches against
+    std::string typed;
+    bool lastWasTab = false;
+};
+
+class Shell {
+
+public:
+    Shell() {
+        // A closed pipe must show up as EPIPE on write, not kill the shell
+        std::signal(SIGPIPE, SIG_IGN);
+        // ls orders names by the user's collation; everything else stays in C
+        std::setlocale(LC_COLLATE, "");
+    }
+
+    // Reads commands from standard input. The prompt is shown only when
+    // stdin is a terminal; a regular file on stdin is run as a script.
+    // Returns the exit status for the process.
+    int run() {
+        struct stat st;
+        interactive = ::isatty(STDIN_FILENO) == 1;
+        if (!interactive && ::fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+            return runScript(STDIN_FILENO, "standard input");
+        }
+
+        // Terminals get line editing and history; anything else is read as is
+        HistoryFile history;
+        LineEditor editor(history);
+        const char* term = getenv("TERM");
+        bool editing = interactive && ::isatty(STDOUT_FILENO) == 1 && (term == nullptr || std::strcmp(term, "dumb") != 0);
+        if (editing) {
+            const char* file = getenv("HISTFILE");
+            const char* home = getenv("HOME");
+            history.open(file != nullptr ? file : std::string(home != nullptr ? home : ".") + "/.myshell_history");
+        }
+
+        std::string input;
+        while (!exitRequested) {
+            if (interactive) {
+                jobs.reportFinished(out());
+                if (!editing) {
+                    out() << "MyShell> ";
+                }
+                out().flush();
+            } else {
+                jobs.dropFinished();
+            }
+            if (editing) {
+                if (!editor.readLine("MyShell> ", input)) {
+                    break;
+                }
+                if (input.find_first_not_of(" \t") != std::string::npos) {
+                    history.add(input);
+                }
+            } else if (!std::getline(std::cin, input)) {
+                if (interactive) {
+                    out() << '\n';
+                }
+                break;
+            }
+
+            executeCommand(input);
+            out().flush();
+        }
+        return finalStatus();
+    }
+
+    // Runs the commands in a script file without prompting.
+    int runScriptFile(const char* path) {
+        FileDescriptor fd(::open(path, O_RDONLY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            out() << "Error: cannot open " << path << ": " << std::strerror(errno) << '\n';
+            out().flush();
+            return 127;
+        }
+        return runScript(fd.get(), path);
+    }
+
+    // Records statistics for every command and writes them as JSON at exit,
+    // to `file` or to standard error
+    void enableStats(std::string_view file) {
+        statsEnabled = true;
+        statsAtExit = true;
+        statsFile = file;
+    }
+
+    // Called once at exit: writes the statistics recorded with --stats
+    void writeStatsReport() {
+        if (!statsAtExit) {
+            return;
+        }
+        out().flush();
+        FileDescriptor file;
+        if (!statsFile.empty()) {
+            file.reset(::open(statsFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+            if (file.get() < 0) {
+                out() << "Error: cannot write " << statsFile << ": " << std::strerror(errno) << '\n';
+                out().flush();
+                return;
+            }
+        }
+        OutputWriter writer(statsFile.empty() ? STDERR_FILENO : file.get());
+        stats.writeJson(writer);
+        writer.flush();
+    }
+
+    // Runs a single command line, as for "myShell -c".
+    int runCommandString(std::string_view commands) {
+        executeCommand(commands);
+        out().flush();
+        return finalStatus();
+    }
+
+private:
+    // Maps the script and hands each line to the parser as a view into the
+    // mapping, so no line is copied.
+    int runScript(int fd, const char* name) {
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            out() << "Error: cannot read " << name << ": " << std::strerror(errno) << '\n';
+            out().flush();
+            return 1;
+        }
+        if (st.st_size == 0) {
+            return 0;
+        }
+
+        size_t size = static_cast<size_t>(st.st_size);
+        void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            out() << "Error: cannot map " << name << ": " << std::strerror(errno) << '\n';
+            out().flush();
+            return 1;
+        }
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+
+        const char* text = static_cast<const char*>(mapping);
+        const char* end = text + size;
+        while (text < end && !exitRequested) {
+            const char* newline = static_cast<const char*>(std::memchr(text, '\n', end - text));
+            const char* lineEnd = newline != nullptr ? newline : end;
+            executeCommand(std::string_view(text, lineEnd - text));
+            jobs.dropFinished();
+            text = lineEnd + 1;
+        }
+        out().flush();
+        ::munmap(mapping, size);
+        return finalStatus();
+    }
+
+    int finalStatus() const {
+        return exitRequested ? exitStatus : lastStatus;
+    }
+
+    void executeCommand(std::string_view input) {
+        std::string error;
+        parser.start(input);
+        while (!exitRequested && parser.nextPipeline(lastStatus, error)) {
+            if (parser.background()) {
+                startJob();
+                continue;
+            }
+
+            const Arguments& first = parser.command(0).argv;
+            bool timed = first.size() > 1 && first[0] == "time" && first[1] != "--help";
+            if (timed) {
+                parser.dropLeadingWord();
+            }
+
+            bool measured = timed || statsEnabled;
+            ResourceSample before;
+            if (measured) {
+                before = ResourceSample::take();
+            }
+
+            if (parser.commandCount() == 1 && !parser.command(0).hasRedirections()) {
+                runCommand(parser.command(0).argv);
+            } else {
+                runPipeline();
+            }
+
+            if (measured) {
+                // Output still in the buffer belongs to this command
+                out().flush();
+                ResourceUsage usage = ResourceUsage::between(before, ResourceSample::take());
+                if (statsEnabled) {
+                    stats.record(commandLabel(), usage);
+                }
+                if (timed) {
+                    printUsage(usage);
+                }
+            }
+        }
+
+        if (!error.empty()) {
+            out() << "Syntax error: " << error << '\n';
+            lastStatus = 2;
+        }
+    }
+
+    // Starts the parsed pipeline as a background job. Builtins that change
+    // the shell itself are refused: they would do so at an unpredictable
+    // time from another thread.
+    void startJob() {
+        for (size_t i = 0; i < parser.commandCount(); ++i) {
+            std::string_view name = parser.command(i).argv[0];
+            if (isBuiltin(name) && changesShellState(findBuiltin(name))) {
+                out() << name << ": cannot run in the background" << '\n';
+                lastStatus = 1;
+                return;
+            }
+        }
+
+        Job& job = jobs.add(parser);
+        std::vector<const CommandNode*> stages;
+        for (const CommandNode& node : job.commands) {
+            stages.push_back(&node);
+        }
+        runStages(stages, &job);
+        if (interactive) {
+            out() << "[" << job.id << "]";
+            if (pid_t group = jobs.processGroup(job)) {
+                out() << " " << group;
+            }
+            out() << '\n';
+        }
+        lastStatus = 0;
+    }
+
+    static bool changesShellState(Builtin builtin) {
+        switch (builtin) {
+            case Builtin::Cd:
+            case Builtin::Export:
+            case Builtin::Exit:
+            case Builtin::Hash:
+            case Builtin::Time:
+            case Builtin::Stats:
+            case Builtin::Dircache:
+            case Builtin::Jobs:
+            case Builtin::Fg:
+            case Builtin::Bg:
+            case Builtin::Wait:
+            case Builtin::Kill:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Name statistics are kept under: the builtin, or "external" or
+    // "pipeline", so the table stays small
+    std::string_view commandLabel() {
+        if (parser.commandCount() > 1) {
+            return "pipeline";
+        }
+        std::string_view name = parser.command(0).argv[0];
+        return isBuiltin(name) ? name : "external";
+    }
+
+    void printUsage(const ResourceUsage& usage) {
+        out() << "real " << fixed(usage.wallSeconds, 3) << " s, user " << fixed(usage.userSeconds, 3)
+              << " s, sys " << fixed(usage.systemSeconds, 3) << " s" << '\n';
+        out() << "io " << usage.readBytes << " bytes read, " << usage.writtenBytes << " bytes written, "
+              << usage.readSyscalls << " read and " << usage.writeSyscalls << " write syscalls, "
+              << usage.filesTouched << " files touched" << '\n';
+        out() << "syscalls";
+        for (size_t kind = 0; kind < std::size(usage.syscalls); ++kind) {
+            out() << (kind == 0 ? " " : ", ") << syscallNames[kind] << " " << usage.syscalls[kind];
+        }
+        out() << '\n';
+        out() << "faults " << usage.minorFaults << " minor, " << usage.majorFaults << " major; switches "
+              << usage.voluntarySwitches << " voluntary, " << usage.involuntarySwitches << " involuntary" << '\n';
+    }
+
+    void runCommand(const Arguments& tokens) {
+        if (isBuiltin(tokens[0])) {
+            builtinStatus() = 0;
+            runBuiltin(tokens);
+            lastStatus = builtinStatus();
+        } else {
+            runExternal(tokens);
+        }
+    }
+
+    bool isBuiltin(std::string_view command) {
+        return findBuiltin(command) != Builtin::Count;
+    }
+
+    void runBuiltin(const Arguments& tokens) {
+        const BuiltinEntry& entry = builtinEntries[static_cast<size_t>(findBuiltin(tokens[0]))];
+        ParsedArguments arguments;
+        std::string error;
+        if (entry.options == nullptr) {
+            // No schema: the builtin parses its words itself (find, whose
+            // expression is made of words starting with '-')
+            arguments.command = tokens[0];
+            arguments.operands.assign(tokens.begin() + 1, tokens.end());
+        } else if (!parseArguments(tokens, entry.options, entry.optionCount, arguments, error)) {
+            out() << error << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        (this->*entry.handler)(arguments);
+    }
+
+    void changeDirectory(const ParsedArguments& arguments) {
+        if (arguments.has(CdHelp)) {
+            displayCdHelp();
+            return;
+        }
+
+        if (arguments.operands.empty()) {
+            out() << "Usage: cd [options] <directory>" << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        std::string_view option = arguments.operands[0];
+
+        fs::path targetDir;
+
+        if (option == "~" || option == "~username") {
+            // Go to home directory or specified user's home directory
+            targetDir = getHomeDirectory(option);
+        } else if (option == ".") {
+            // Stay in the current directory
+            targetDir = ".";
+        } else {
+            // Go to a subdirectory
+            targetDir = option;
+        }
+
+        // chdir reports a missing or non-directory target itself
+        if (::chdir(targetDir.c_str()) != 0) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                out() << "Directory does not exist: " << targetDir.string() << '\n';
+            } else {
+                out() << "Error: cannot change to " << targetDir.string() << ": " << std::strerror(errno) << '\n';
+            }
+            builtinStatus() = 1;
+            return;
+        }
+        directoryCache.setWorkingDirectory();
+    }
+
+    void displayCdHelp() {
+        out() << "Usage: cd [options] <directory>" << '\n';
+        out() << "Options:" << '\n';
+        out() << "  ~ or ~username      Go to home directory or specified user's home directory" << '\n';
+        out() << "  .                   Stay in the current directory" << '\n';
+        out() << "  dir                 Go to a subdirectory" << '\n';
+        out() << "  --help              Display this help message" << '\n';
+    }
+
+    fs::path getHomeDirectory(std::string_view option) {
+        // Get the home directory path
+        if (option == "~") {
+            return fs::path(getenv("HOME"));
+        } else if (option.substr(0, 2) == "~/") {
+            // Get the home directory of the specified user
+            std::string username(option.substr(2));
+            return fs::path("/home/" + username);
+        } else {
+            return fs::path(getenv("HOME")); // Default to user's home directory
+        }
+    }
+
+
+    void listDirectory(const ParsedArguments& arguments) {
+        if (arguments.has(LsHelp)) {
+            displayLsHelp();
+            return;
+        }
+
+        ListOptions options;
+        options.longFormat = arguments.has(LsLong);
+        options.reverseOrder = arguments.has(LsReverse);
+        options.recursive = arguments.has(LsRecursive);
+        if (arguments.has(LsUnsorted)) {
+            options.sortKey = SortKey::Unsorted;
+        } else if (arguments.has(LsTime)) {
+            options.sortKey = SortKey::Time;
+        } else if (arguments.has(LsSize)) {
+            options.sortKey = SortKey::Size;
+        } else if (arguments.has(LsExtension)) {
+            options.sortKey = SortKey::Extension;
+        } else if (arguments.has(LsNatural)) {
+            options.sortKey = SortKey::Natural;
+        }
+
+        std::vector<fs::path> paths;
+        for (std::string_view operand : arguments.operands) {
+            if (operand == "~") {
+                paths.emplace_back(getenv("HOME"));
+            } else if (operand == "../") {
+                paths.emplace_back("..");
+            } else {
+                paths.emplace_back(operand);
+            }
+        }
+        if (paths.empty()) {
+            paths.emplace_back(".");
+        }
+
+        try {
+            for (size_t i = 0; i < paths.size(); ++i) {
+                const fs::path& dirPath = paths[i];
+                // Files named on the command line, e.g. by a glob. A single
+                // operand is told apart by the open in listDirectorySimple,
+                // so a cached listing needs no stat.
+                struct stat st;
+                if ((paths.size() > 1 || options.recursive) && ::stat(dirPath.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+                    listFile(dirPath, options.longFormat);
+                    continue;
+                }
+                if (paths.size() > 1) {
+                    out() << (i == 0 ? "" : "\n") << dirPath.string() << ":" << '\n';
+                }
+
+                if (!options.recursive) {
+                    listDirectorySimple(dirPath, options);
+                } else if (fs::exists(dirPath) && fs::is_directory(dirPath)) {
+                    listDirectoryRecursive(dirPath, options);
+                } else {
+                    out() << "Directory does not exist: " << dirPath.string() << '\n';
+                    builtinStatus() = 1;
+                }
+            }
+        } catch (const fs::filesystem_error& ex) {
+            out() << "Error: " << ex.what() << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void listDirectorySimple(const fs::path& dirPath, const ListOptions& options) {
+        bool longFormat = options.longFormat;
+        // Time and size order read the same statx fields as -l
+        bool needMetadata = longFormat || options.sortKey == SortKey::Time || options.sortKey == SortKey::Size;
+        DirectoryCache::Fill fill;
+        std::string key;
+        if (directoryCache.enabled() && directoryCache.keyFor(dirPath, key)) {
+            if (auto listing = directoryCache.find(key, needMetadata)) {
+                printListing(*listing, dirPath, options);
+                return;
+            }
+            fill = directoryCache.beginFill(key);
+        }
+
+        FileDescriptor dirFd(::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (dirFd.get() < 0) {
+            int error = errno;
+            struct stat st;
+            if (error == ENOTDIR && ::stat(dirPath.c_str(), &st) == 0) {
+                listFile(dirPath, longFormat);
+            } else if (error == ENOENT || error == ENOTDIR) {
+                out() << "Directory does not exist: " << dirPath.string() << '\n';
+                builtinStatus() = 1;
+            } else {
+                throw fs::filesystem_error("cannot open directory", dirPath, std::error_code(error, std::generic_category()));
+            }
+            return;
+        }
+
+        DirectoryReader reader(dirFd.get());
+        std::string_view name;
+        unsigned char type;
+
+        // Nothing to reorder, stat or cache: print names as they come off the buffer
+        if (options.sortKey == SortKey::Unsorted && !longFormat && !options.reverseOrder && !fill.active()) {
+            while (!cancellationRequested() && reader.next(name, type)) {
+                out() << name << '\n';
+            }
+            checkReaderError(reader, dirPath);
+            return;
+        }
+
+        auto listing = std::make_shared<DirectoryCache::Listing>();
+        while (reader.next(name, type)) {
+            listing->names.add(name, type);
+        }
+        checkReaderError(reader, dirPath);
+
+        if (needMetadata) {
+            listing->metadata = fetchDirectoryMetadata(dirFd.get(), listing->names, longFormatStatxMask);
+            listing->hasMetadata = true;
+        }
+
+        printListing(*listing, dirPath, options);
+        if (fill.active()) {
+            directoryCache.store(fill, std::move(listing));
+        }
+    }
+
+    void printListing(const DirectoryCache::Listing& listing, const fs::path& dirPath, const ListOptions& options) {
+        const NameArena& entries = listing.names;
+        const std::vector<EntryMetadata>* metadata = listing.hasMetadata ? &listing.metadata : nullptr;
+        std::vector<uint32_t> order = EntrySorter::sort(entries, metadata, options.sortKey, defaultThreadCount());
+        for (size_t n = 0; n < order.size() && !cancellationRequested(); ++n) {
+            size_t i = order[options.reverseOrder ? order.size() - 1 - n : n];
+            if (options.longFormat) {
+                printLongFormat(listing.metadata[i], entries.name(i), dirPath);
+            } else {
+                out() << entries.name(i) << '\n';
+            }
+        }
+    }
+
+    void checkReaderError(const DirectoryReader& reader, const fs::path& dirPath) {
+        if (reader.error() != 0) {
+            throw fs::filesystem_error("cannot read directory", dirPath, std::error_code(reader.error(), std::generic_category()));
+        }
+    }
+
+    void listFile(const fs::path& filePath, bool longFormat) {
+        if (longFormat) {
+            EntryMetadata metadata;
+            fetchEntryMetadata(AT_FDCWD, filePath.c_str(), longFormatStatxMask, metadata);
+            printLongFormat(metadata, filePath.native(), fs::path());
+        } else {
+            out() << filePath.string() << '\n';
+        }
+    }
+
+    // Lists every entry below dirPath by its path, each directory followed by
+    // its contents. Directories are read in parallel; the output is that of
+    // a serial walk with every directory sorted as for a plain ls.
+    void listDirectoryRecursive(const fs::path& dirPath, const ListOptions& options) {
+        bool needMetadata = options.longFormat || options.sortKey == SortKey::Time || options.sortKey == SortKey::Size;
+        TreeWalker walker(defaultThreadCount(), needMetadata ? longFormatStatxMask : 0);
+        std::atomic<bool> failed{false};
+        walker.walk(dirPath.string(), out(), [&](TreeWalker::Directory& dir) {
+            const std::vector<EntryMetadata>* metadata = needMetadata ? &dir.metadata : nullptr;
+            std::vector<uint32_t> order = EntrySorter::sort(dir.names, metadata, options.sortKey, 1);
+            for (size_t n = 0; n < order.size(); ++n) {
+                size_t i = order[options.reverseOrder ? order.size() - 1 - n : n];
+                if (!options.longFormat) {
+                    dir.appendPath(i, dir.output);
+                    dir.output += '\n';
+                } else if (dir.metadata[i].error == 0) {
+                    appendLongFormat(dir.metadata[i].stx, dir.names.name(i), dir.output);
+                } else {
+                    dir.output += "Error: cannot access ";
+                    dir.appendPath(i, dir.output);
+                    dir.output += ": " + std::generic_category().message(dir.metadata[i].error) + "\n";
+                    failed = true;
+                }
+                if (dir.names.type(i) == DT_DIR) {
+                    dir.descend(i);
+                }
+            }
+        });
+
+        for (const auto& error : walker.getErrors()) {
+            out() << "Error: " << error.first << ": " << error.second << '\n';
+        }
+        if (failed || !walker.getErrors().empty()) {
+            builtinStatus() = 1;
+        }
+    }
+
+    void printLongFormat(const EntryMetadata& metadata, std::string_view name, const fs::path& dirPath) {
+        if (metadata.error != 0) {
+            out() << "Error: cannot access " << (dirPath / name).string() << ": "
+                      << std::generic_category().message(metadata.error) << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        thread_local std::string line;
+        line.clear();
+        appendLongFormat(metadata.stx, name, line);
+        out() << line;
+    }
+
+    void displayLsHelp() {
+        out() << "Usage: ls [options] [file/directory]..." << '\n';
+        out() << "Options:" << '\n';
+        out() << "  -l                Show list in long format" << '\n';
+        out() << "  -r                Print list in reverse order" << '\n';
+        out() << "  -R                Display content of sub-directories also" << '\n';
+        out() << "  -t                Sort by modification time, newest first" << '\n';
+        out() << "  -S                Sort by file size, largest first" << '\n';
+        out() << "  -X                Sort alphabetically by extension" << '\n';
+        out() << "  -v                Natural sort of numbers within names" << '\n';
+        out() << "  -U                Do not sort; list entries in directory order" << '\n';
+        out() << "  ~                 Give the contents of home directory" << '\n';
+        out() << "  ../               Give the contents of parent directory" << '\n';
+        out() << "  --help            Display this help message" << '\n';
+    }
+
+    void moveFile(const ParsedArguments& arguments) {
+        if (arguments.has(MvHelp)) {
+            out() << "Usage: mv [options] <source>... <destination>" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -i            Ask for permission to overwrite" << '\n';
+            out() << "  --suffix      Take backup before overwriting" << '\n';
+            out() << "  -u            Only move those files that don't exist" << '\n';
+            return;
+        }
+
+        MoveOptions options;
+        options.interactive = arguments.has(MvInteractive);
+        options.suffixBackup = arguments.has(MvSuffix);
+        options.onlyIfNotExists = arguments.has(MvUpdate);
+
+        // Globs such as "mv src/* dst" arrive here already expanded
+        const Arguments& operands = arguments.operands;
+        if (operands.size() < 2) {
+            out() << "Usage: mv [options] <source>... <destination>" << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        performMove(options, Arguments(operands.begin(), operands.end() - 1), operands.back());
+    }
+
+    // One source of a move: its parent directory (an index into the open
+    // descriptors) and the names on both sides
+    struct MoveItem {
+        fs::path source;
+        size_t sourceDir;
+        std::string name;
+        std::string targetName;
+    };
+
+    void performMove(const MoveOptions& options, const Arguments& sources, const fs::path& destination) {
+        // Several sources, or an existing directory, mean "move into"
+        struct stat st;
+        bool intoDirectory = ::stat(destination.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        if (sources.size() > 1 && !intoDirectory) {
+            out() << "Target is not a directory: " << destination.string() << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        fs::path targetDir = destination;
+        std::string targetName;
+        if (!intoDirectory && !splitPath(destination, targetDir, targetName)) {
+            out() << "Error: cannot move to " << destination.string() << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        FileDescriptor targetDirFd(::open(targetDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (targetDirFd.get() < 0) {
+            out() << "Error: cannot open " << targetDir.string() << ": " << std::strerror(errno) << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        // Sources usually share a parent (e.g. from a glob): open each once
+        std::vector<FileDescriptor> sourceDirs;
+        std::unordered_map<std::string, size_t> sourceDirIndex;
+        std::vector<MoveItem> items;
+        for (std::string_view operand : sources) {
+            MoveItem item;
+            item.source = operand;
+            fs::path parent;
+            if (!splitPath(item.source, parent, item.name)) {
+                out() << "Error: cannot move " << item.source.string() << '\n';
+                builtinStatus() = 1;
+                continue;
+            }
+            auto found = sourceDirIndex.find(parent.native());
+            if (found == sourceDirIndex.end()) {
+                FileDescriptor fd(::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                if (fd.get() < 0) {
+                    out() << "Error: cannot move " << item.source.string() << ": " << std::strerror(errno) << '\n';
+                    builtinStatus() = 1;
+                    continue;
+                }
+                found = sourceDirIndex.emplace(parent.native(), sourceDirs.size()).first;
+                sourceDirs.push_back(std::move(fd));
+            }
+            item.sourceDir = found->second;
+            item.targetName = intoDirectory ? item.name : targetName;
+            items.push_back(std::move(item));
+        }
+
+        // Anything that must not silently replace the target uses
+        // RENAME_NOREPLACE, so existence is checked atomically by the rename
+        unsigned int flags = options.interactive || options.suffixBackup || options.onlyIfNotExists ? RENAME_NOREPLACE : 0;
+        std::vector<int> results(items.size(), 0);
+        IoUring* ring = IoUring::forThread();
+        if (!options.interactive && items.size() > 1 && ring != nullptr && ring->supports(IORING_OP_RENAMEAT)) {
+            ring->runBatch(items.size(),
+                [&](size_t i, io_uring_sqe* sqe) {
+                    IoUring::prepareRenameat(sqe, sourceDirs[items[i].sourceDir].get(), items[i].name.c_str(),
+                                             targetDirFd.get(), items[i].targetName.c_str(), flags);
+                },
+                [&](size_t i, int res) { results[i] = res < 0 ? -res : 0; },
+                [&](size_t i) {
+                    results[i] = renameEntry(sourceDirs[items[i].sourceDir].get(), items[i].name.c_str(),
+                                             targetDirFd.get(), items[i].targetName.c_str(), flags);
+                });
+        } else {
+            for (size_t i = 0; i < items.size(); ++i) {
+                results[i] = renameEntry(sourceDirs[items[i].sourceDir].get(), items[i].name.c_str(),
+                                         targetDirFd.get(), items[i].targetName.c_str(), flags);
+            }
+        }
+
+        std::vector<CrossDeviceMover::Item> crossDevice;
+        for (size_t i = 0; i < items.size(); ++i) {
+            const MoveItem& item = items[i];
+            int sourceDirFd = sourceDirs[item.sourceDir].get();
+            int error = results[i];
+            if (error == EINVAL && flags != 0) {
+                // The ring does not fall back for file systems without RENAME_NOREPLACE
+                error = renameEntry(sourceDirFd, item.name.c_str(), targetDirFd.get(), item.targetName.c_str(), flags);
+            }
+
+            unsigned int itemFlags = flags;
+            if (error == EEXIST || (error == EXDEV && flags != 0 && targetExists(targetDirFd.get(), item.targetName))) {
+                if (!resolveExistingTarget(options, targetDirFd.get(), targetDir, item.targetName)) {
+                    continue;
+                }
+                // The user agreed to replace it, or it was backed up
+                itemFlags = options.interactive ? 0 : flags;
+                if (error == EEXIST) {
+                    error = renameEntry(sourceDirFd, item.name.c_str(), targetDirFd.get(), item.targetName.c_str(), itemFlags);
+                }
+            }
+
+            if (error == EXDEV) {
+                struct stat sourceStat;
+                if (::fstatat(sourceDirFd, item.name.c_str(), &sourceStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                    out() << "Error: cannot move " << item.source.string() << ": " << std::strerror(errno) << '\n';
+                    builtinStatus() = 1;
+                    continue;
+                }
+                unsigned char type = S_ISDIR(sourceStat.st_mode) ? DT_DIR : S_ISLNK(sourceStat.st_mode) ? DT_LNK : DT_REG;
+                crossDevice.push_back({item.source, targetDir / item.targetName, type, itemFlags});
+            } else if (error != 0) {
+                out() << "Error: cannot move " << item.source.string() << ": " << std::strerror(error) << '\n';
+                builtinStatus() = 1;
+            } else {
+                out() << "Moved: " << item.source << " to " << destination << '\n';
+            }
+        }
+
+        if (!crossDevice.empty()) {
+            moveAcrossDevices(crossDevice, destination);
+        }
+    }
+
+    // Splits a path into its parent directory and last name; "dir/" names
+    // the directory itself. Returns false for "", "." and "..".
+    static bool splitPath(const fs::path& path, fs::path& parent, std::string& name) {
+        fs::path trimmed = path.filename().empty() ? path.parent_path() : path;
+        name = trimmed.filename().string();
+        parent = trimmed.parent_path().empty() ? fs::path(".") : trimmed.parent_path();
+        return !name.empty() && name != "." && name != "..";
+    }
+
+    static bool targetExists(int dirFd, const std::string& name) {
+        struct stat st;
+        return ::fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    // Applies -u, -i or --suffix to a target that already exists. Returns
+    // true if the move should go ahead.
+    bool resolveExistingTarget(const MoveOptions& options, int targetDirFd, const fs::path& targetDir, const std::string& name) {
+        fs::path target = targetDir / name;
+        if (options.onlyIfNotExists) {
+            out() << "File already exists at the destination: " << target.string() << '\n';
+            return false;
+        }
+
+        if (options.interactive) {
+            out() << "Destination file " << target << " already exists. Overwrite? (y/n): ";
+            out().flush();
+            std::string response = readAnswer();
+            if (response != "y") {
+                out() << "Move operation canceled." << '\n';
+                return false;
+            }
+        }
+
+        if (options.suffixBackup) {
+            // Keep the existing file by appending a suffix to its name
+            fs::path existing = name;
+            std::string backup = existing.stem().string() + "_backup" + existing.extension().string();
+            int error = renameEntry(targetDirFd, name.c_str(), targetDirFd, backup.c_str(), 0);
+            if (error != 0) {
+                out() << "Error: cannot back up " << target.string() << ": " << std::strerror(error) << '\n';
+                builtinStatus() = 1;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void moveAcrossDevices(const std::vector<CrossDeviceMover::Item>& items, const fs::path& destination) {
+        CrossDeviceMover mover(defaultThreadCount());
+        mover.run(items, [&] {
+            out() << "Moving across devices: " << mover.itemsFinished() << "/" << mover.itemCount() << " entries, "
+                  << fixed(mover.bytesMoved() / (1024.0 * 1024.0), 1) << " MB" << '\n';
+            out().flush();
+        });
+
+        for (const fs::path& target : mover.skippedTargets()) {
+            out() << "File already exists at the destination: " << target.string() << '\n';
+        }
+        for (const auto& error : mover.getErrors()) {
+            out() << "Error: " << error.first << ": " << error.second << '\n';
+            builtinStatus() = 1;
+        }
+
+        double seconds = mover.seconds();
+        out() << "Moved across devices to " << destination << ": " << mover.filesMoved() << " files, "
+              << mover.bytesMoved() << " bytes in " << fixed(seconds, 3) << " s ("
+              << fixed(seconds > 0 ? mover.bytesMoved() / (1024.0 * 1024.0) / seconds : 0.0, 1) << " MB/s)" << '\n';
+    }
+
+    void removeFile(const ParsedArguments& arguments) {
+        if (arguments.has(RmHelp)) {
+            out() << "Usage: rm [options] <file/directory>..." << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -r, -R        Remove directory recursively" << '\n';
+            out() << "  -i            Remove file interactively" << '\n';
+            out() << "  -rf           Remove directory forcefully" << '\n';
+            out() << "  -f            Force removal, ignores non-existent files and overrides prompts" << '\n';
+            return;
+        }
+
+        if (arguments.operands.empty()) {
+            out() << "Usage: rm [options] <file/directory>..." << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        RemoveOptions options;
+        options.recursive = arguments.has(RmRecursive);
+        options.interactive = arguments.has(RmInteractive);
+        options.force = arguments.has(RmForce);
+        options.forceRecursive = arguments.has(RmForceRecursive);
+
+        for (std::string_view operand : arguments.operands) {
+            performRemove(options, operand);
+        }
+    }
+
+    void performRemove(const RemoveOptions& options, const fs::path& fileOrDir) {
+        try {
+            if (options.recursive && options.forceRecursive) {
+                out() << "Error: Options -r and -rf are mutually exclusive." << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+
+            if (options.forceRecursive) {
+                removeDirectoryForcefully(fileOrDir);
+            } else if (options.recursive) {
+                removeDirectoryRecursively(fileOrDir);
+            } else if (options.force) {
+                removeFileForcefully(fileOrDir);
+            } else if (options.interactive) {
+                removeFileInteractively(fileOrDir);
+            } else {
+                removeFileOrDirectory(fileOrDir);
+            }
+        } catch (const fs::filesystem_error& ex) {
+            out() << "Error: " << ex.what() << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void removeFileOrDirectory(const fs::path& fileOrDir) {
+        if (fs::exists(fileOrDir)) {
+            if (fs::is_directory(fileOrDir)) {
+                fs::remove(fileOrDir);
+                out() << "Removed directory: " << fileOrDir << '\n';
+            } else {
+                fs::remove(fileOrDir);
+                out() << "Removed file: " << fileOrDir << '\n';
+            }
+        } else {
+            out() << "File or directory does not exist: " << fileOrDir << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void removeFileInteractively(const fs::path& file) {
+        if (fs::exists(file)) {
+            out() << "Are you sure you want to remove '" << file << "'? (y/n): ";
+            out().flush();
+            std::string response = readAnswer();
+            if (response == "y") {
+                fs::remove(file);
+                out() << "Removed file: " << file << '\n';
+            } else {
+                out() << "Removal canceled." << '\n';
+            }
+        } else {
+            out() << "File does not exist: " << file << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void removeFileForcefully(const fs::path& file) {
+        if (fs::exists(file)) {
+            fs::remove(file);
+            out() << "Removed file: " << file << '\n';
+        } else {
+            out() << "File does not exist: " << file << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void removeDirectoryRecursively(const fs::path& dir) {
+        removeDirectoryTree(dir, "Removed directory recursively: ");
+    }
+
+    void removeDirectoryForcefully(const fs::path& dir) {
+        try {
+            removeDirectoryTree(dir, "Removed directory forcefully: ");
+        } catch (const fs::filesystem_error& ex) {
+            out() << "Error: " << ex.what() << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void removeDirectoryTree(const fs::path& dir, const char* message) {
+        fs::path parent = dir.parent_path().empty() ? fs::path(".") : dir.parent_path();
+        fs::path name = dir.filename().empty() ? dir.parent_path().filename() : dir.filename();
+        if (dir.filename().empty()) {
+            // "dir/" names the directory itself
+            parent = parent.parent_path().empty() ? fs::path(".") : parent.parent_path();
+        }
+
+        FileDescriptor parentFd(::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        struct stat st;
+        if (name.empty() || name == "." || name == ".." || parentFd.get() < 0
+            || ::fstatat(parentFd.get(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            out() << "Directory does not exist: " << dir << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+            // A link to a directory is removed, never followed
+            if (::fstatat(parentFd.get(), name.c_str(), &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+                out() << "Directory does not exist: " << dir << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+            if (::unlinkat(parentFd.get(), name.c_str(), 0) != 0) {
+                throw fs::filesystem_error("cannot remove", dir, std::error_code(errno, std::generic_category()));
+            }
+            out() << message << dir << '\n';
+            return;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            out() << "Directory does not exist: " << dir << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        ParallelRemover remover(defaultThreadCount());
+        remover.removeTree(parentFd.get(), parent / name);
+
+        for (const auto& error : remover.getErrors()) {
+            out() << "Error: " << error.first << ": " << error.second << '\n';
+            builtinStatus() = 1;
+        }
+
+        double seconds = remover.seconds();
+        out() << (cancellationRequested() ? "Cancelled: removing " : message) << dir << '\n';
+        out() << remover.entriesRemoved() << " entries removed in "
+                  << fixed(seconds, 3) << " s ("
+                  << fixed(seconds > 0 ? remover.entriesRemoved() / seconds : 0.0, 0) << " entries/s)" << '\n';
+    }
+
+
+    void copyFile(const ParsedArguments& arguments) {
+        if (arguments.has(CpHelp)) {
+            out() << "Usage: cp [options] <source>... <destination>" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  --copy-contents       Copy special file contents when recursive" << '\n';
+            out() << "  -d                    Equivalent to --no-dereference --preserve=links" << '\n';
+            out() << "  --link, -l            Specify hard link files rather than copying" << '\n';
+            out() << "  --recursive, -r, -R   Recursively copy directories" << '\n';
+            out() << "  -j N                  Copy recursively with N threads (default: all cores)" << '\n';
+            out() << "  --reflink[=WHEN]      Clone file data: auto (default), always or never" << '\n';
+            out() << "  --sync                Copy only what changed; resumes an interrupted run" << '\n';
+            out() << "  --verify              With --sync, compare unchanged files by content hash" << '\n';
+            return;
+        }
+
+        if (arguments.operands.size() < 2) {
+            out() << "Usage: cp [options] <source>... <destination>" << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        CopyOptions options;
+        options.copyContents = arguments.has(CpCopyContents);
+        options.dereference = arguments.has(CpDereference);
+        options.linkFiles = arguments.has(CpLink);
+        options.recursive = arguments.has(CpRecursive);
+        options.sync = arguments.has(CpSync);
+        options.verify = arguments.has(CpVerify);
+        options.jobs = defaultThreadCount();
+        if (arguments.has(CpJobs) && !parseThreadCount(arguments.value(CpJobs), options.jobs)) {
+            out() << "Invalid thread count: " << arguments.value(CpJobs) << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        if (options.verify && !options.sync) {
+            out() << "Error: Option --verify requires --sync." << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        if (arguments.has(CpReflink)) {
+            std::string_view when = arguments.value(CpReflink);
+            if (when.empty() || when == "always") {
+                options.reflinkMode = ReflinkMode::Always;
+            } else if (when == "auto") {
+                options.reflinkMode = ReflinkMode::Auto;
+            } else if (when == "never") {
+                options.reflinkMode = ReflinkMode::Never;
+            } else {
+                out() << "Invalid reflink mode: " << when << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+        }
+
+        // With several sources the destination must be a directory, and
+        // each source is copied into it under its own name
+        const Arguments& operands = arguments.operands;
+        fs::path destination = operands.back();
+        if (operands.size() > 2 && !fs::is_directory(destination)) {
+            out() << "Target is not a directory: " << destination.string() << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        for (size_t i = 0; i + 1 < operands.size(); ++i) {
+            fs::path source = operands[i];
+            bool intoDirectory = operands.size() > 2 && fs::is_directory(source);
+            performCopy(options, source, intoDirectory ? destination / source.filename() : destination);
+        }
+    }
+
+    void performCopy(const CopyOptions& options, const fs::path& source, const fs::path& destination) {
+        try {
+            if (options.linkFiles && options.recursive) {
+                out() << "Error: Options --link and --recursive are mutually exclusive." << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+            if (options.sync) {
+                if (options.linkFiles || options.dereference) {
+                    out() << "Error: Option --sync cannot be combined with --link or -d." << '\n';
+                    builtinStatus() = 1;
+                    return;
+                }
+                syncTree(options, source, destination);
+                return;
+            }
+
+            if (options.dereference) {
+                fs::copy_options copyOptions = fs::copy_options::none;
+                if (!options.copyContents) {
+                    copyOptions |= fs::copy_options::skip_symlinks;
+                }
+                if (options.linkFiles) {
+                    copyOptions |= fs::copy_options::create_hard_links;
+                }
+
+                fs::copy(source, destination, copyOptions);
+            } else {
+                if (fs::is_directory(source)) {
+                    if (options.recursive) {
+                        copyDirectoryParallel(source, destination, options.jobs, options.reflinkMode);
+                    } else {
+                        fs::copy(source, destination);
+                        out() << "Copied: " << source << " to " << destination << '\n';
+                    }
+                    return;
+                }
+
+                fs::path target = fs::is_directory(destination) ? destination / source.filename() : destination;
+                uintmax_t bytes = 0;
+                std::error_code ec;
+                CopyMethod method = copyFileData(source, target, options.reflinkMode, bytes, ec);
+                if (ec) {
+                    throw fs::filesystem_error("cannot copy file", source, target, ec);
+                }
+                out() << "Copied: " << source << " to " << destination << " (" << copyMethodName(method) << ")" << '\n';
+                return;
+            }
+
+            out() << "Copied: " << source << " to " << destination << '\n';
+        } catch (const fs::filesystem_error& ex) {
+            out() << "Error: " << ex.what() << '\n';
+            builtinStatus() = 1;
+        }
+    }
+
+    void copyDirectoryParallel(const fs::path& source, const fs::path& destination, size_t jobs, ReflinkMode reflinkMode) {
+        ParallelCopier copier(jobs, reflinkMode);
+        copier.copyTree(source, destination);
+
+        for (const auto& error : copier.getErrors()) {
+            out() << "Error: " << error.first << ": " << error.second << '\n';
+            builtinStatus() = 1;
+        }
+
+        double seconds = copier.seconds();
+        double megabytes = copier.bytesCopied() / (1024.0 * 1024.0);
+        out() << (cancellationRequested() ? "Cancelled: copying " : "Copied: ") << source << " to " << destination << '\n';
+        out() << copier.filesCopied() << " files, " << copier.bytesCopied() << " bytes in "
+                  << fixed(seconds, 3) << " s ("
+                  << fixed(seconds > 0 ? megabytes / seconds : 0.0, 1) << " MB/s, "
+                  << copier.threads() << " threads"
+                  << (copier.getErrors().empty() ? "" : ", " + std::to_string(copier.getErrors().size()) + " errors")
+                  << ")" << '\n';
+
+        out() << "Data path:";
+        for (size_t i = 0; i < static_cast<size_t>(CopyMethod::Count); ++i) {
+            CopyMethod method = static_cast<CopyMethod>(i);
+            if (copier.filesCopiedWith(method) != 0) {
+                out() << " " << copyMethodName(method) << "=" << copier.filesCopiedWith(method);
+            }
+        }
+        out() << '\n';
+    }
+
+    // cp --sync: the source directory (or file) is brought in line with the
+    // destination, copying only what changed. Directories are journaled next
+    // to the destination, so a cancelled or killed run picks up where it
+    // stopped; a run without errors removes the journal.
+    void syncTree(const CopyOptions& options, const fs::path& source, const fs::path& destination) {
+        std::string target = destination.string();
+        while (target.size() > 1 && target.back() == '/') {
+            target.pop_back();
+        }
+        struct stat st;
+        bool directory = ::stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        if (!directory && fs::is_directory(destination)) {
+            target = (destination / source.filename()).string();
+        }
+
+        // Without a writable journal the sync still works, it just cannot resume
+        SyncJournal journal;
+        std::error_code ec;
+        std::string error;
+        bool journaled = directory && journal.open(target + ".sync-journal", fs::absolute(source, ec).lexically_normal().string(), error);
+        if (journaled && journal.resumedDirectories() > 0) {
+            out() << "Resuming: " << journal.resumedDirectories() << " directories journaled as in sync" << '\n';
+        }
+
+        TreeSyncer syncer(options.jobs, options.verify, options.reflinkMode, journaled ? &journal : nullptr);
+        syncer.sync(source.string(), target);
+        for (const auto& failure : syncer.getErrors()) {
+            out() << "Error: " << failure.first << ": " << failure.second << '\n';
+            builtinStatus() = 1;
+        }
+        bool cancelled = cancellationRequested();
+        if (journaled && syncer.getErrors().empty() && !cancelled) {
+            journal.remove();
+        }
+
+        out() << (cancelled ? "Cancelled: syncing " : "Synced: ") << source << " to " << destination << '\n';
+        out() << syncer.filesChecked() << " files checked, " << syncer.filesCopied() << " copied, "
+              << syncer.bytesWritten() << " bytes written, " << syncer.bytesReused() << " bytes reused in "
+              << fixed(syncer.seconds(), 3) << " s (" << syncer.threads() << " threads"
+              << (syncer.getErrors().empty() ? "" : ", " + std::to_string(syncer.getErrors().size()) + " errors")
+              << ")" << '\n';
+    }
+
+    bool parseThreadCount(std::string_view text, size_t& count) {
+        if (text.empty() || text.size() > 4) {
+            return false;
+        }
+        auto result = std::from_chars(text.data(), text.data() + text.size(), count);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size() && count > 0;
+    }
+
+    // Directories find -delete matched, with their depth. They are removed
+    // deepest first once the walk is over and everything below them is gone.
+    struct FindState {
+        std::mutex mutex;
+        std::vector<std::pair<size_t, std::string>> directories;
+        std::atomic<bool> failed{false};
+    };
+
+    // find [path...] [expression]. The expression is compiled once; each
+    // path is evaluated itself and then walked in parallel, with the output
+    // in serial walk order. -exec makes the walk serial so its commands run
+    // in that order too.
+    void findFiles(const ParsedArguments& arguments) {
+        const Arguments& words = arguments.operands;
+        if (words.size() == 1 && words[0] == "--help") {
+            displayFindHelp();
+            return;
+        }
+
+        size_t first = 0;
+        while (first < words.size() && !FindProgram::startsExpression(words[first])) {
+            ++first;
+        }
+        Arguments expression(words.begin() + first, words.end());
+        FindProgram program;
+        std::string error;
+        if (!program.compile(expression, error)) {
+            out() << "find: " << error << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+
+        FindState state;
+        if (first == 0) {
+            findFrom(program, ".", state);
+        }
+        for (size_t i = 0; i < first && !cancellationRequested(); ++i) {
+            findFrom(program, std::string(words[i]), state);
+        }
+        if (state.failed) {
+            builtinStatus() = 1;
+        }
+    }
+
+    void findFrom(const FindProgram& program, const std::string& root, FindState& state) {
+        struct stat st;
+        if (::lstat(root.c_str(), &st) != 0) {
+            int error = errno;
+            out() << "Error: " << root << ": " << std::strerror(error) << '\n';
+            state.failed = true;
+            return;
+        }
+
+        if (program.minDepth == 0) {
+            EntryMetadata metadata{};
+            if (program.statxMask() != 0) {
+                fetchEntryMetadata(AT_FDCWD, root.c_str(), program.statxMask(), metadata);
+            }
+            size_t end = root.find_last_not_of('/');
+            size_t start = end == std::string::npos ? std::string::npos : root.rfind('/', end);
+            std::string_view name = end == std::string::npos ? std::string_view("/")
+                                    : std::string_view(root).substr(start + 1, end - start);
+            std::string output;
+            FindProgram::Entry entry{AT_FDCWD, root.c_str(), name, root, static_cast<unsigned char>(IFTODT(st.st_mode)), metadata};
+            program.run(entry, [&](const FindProgram::Op& op, const FindProgram::Entry& current) {
+                return findAction(program, op, current, 0, output, state);
+            });
+            out() << output;
+        }
+
+        if (S_ISDIR(st.st_mode) && program.maxDepth > 0) {
+            TreeWalker walker(program.runsCommands() ? 0 : defaultThreadCount(), program.statxMask());
+            walker.walk(root, out(), [&](TreeWalker::Directory& dir) {
+                static const EntryMetadata noMetadata{};
+                size_t depth = dir.depth + 1;
+                std::string path;
+                for (size_t i = 0; i < dir.names.size(); ++i) {
+                    if (depth >= program.minDepth) {
+                        path.clear();
+                        dir.appendPath(i, path);
+                        FindProgram::Entry entry{dir.fd, dir.names.c_str(i), dir.names.name(i), path, dir.names.type(i),
+                                                 dir.metadata.empty() ? noMetadata : dir.metadata[i]};
+                        program.run(entry, [&](const FindProgram::Op& op, const FindProgram::Entry& current) {
+                            return findAction(program, op, current, depth, dir.output, state);
+                        });
+                    }
+                    if (dir.names.type(i) == DT_DIR && depth < program.maxDepth) {
+                        dir.descend(i);
+                    }
+                }
+            });
+            for (const auto& error : walker.getErrors()) {
+                out() << "Error: " << error.first << ": " << error.second << '\n';
+                state.failed = true;
+            }
+        }
+
+        std::stable_sort(state.directories.begin(), state.directories.end(), [](const auto& a, const auto& b) {
+            return a.first > b.first;
+        });
+        for (const auto& directory : state.directories) {
+            // Like other finds, "." itself is never removed
+            if (directory.second != "." && ::rmdir(directory.second.c_str()) != 0) {
+                int error = errno;
+                out() << "Error: cannot delete " << directory.second << ": " << std::strerror(error) << '\n';
+                state.failed = true;
+            }
+        }
+        state.directories.clear();
+    }
+
+    // Carries out one action of the program for `entry`, with any output
+    // going to the buffer of the directory it is in
+    bool findAction(const FindProgram& program, const FindProgram::Op& op, const FindProgram::Entry& entry, size_t depth,
+                    std::string& output, FindState& state) {
+        switch (op.kind) {
+            case FindProgram::OpKind::Print:
+            case FindProgram::OpKind::Print0:
+                output += entry.path;
+                output += op.kind == FindProgram::OpKind::Print ? '\n' : '\0';
+                return true;
+            case FindProgram::OpKind::Delete:
+                if (entry.type == DT_DIR) {
+                    std::lock_guard<std::mutex> lock(state.mutex);
+                    state.directories.emplace_back(depth, entry.path);
+                    return true;
+                }
+                countSyscall(SyscallKind::Unlinkat);
+                if (::unlinkat(entry.dirFd, entry.cName, 0) == 0) {
+                    return true;
+                }
+                output += "Error: cannot delete " + entry.path + ": " + std::strerror(errno) + "\n";
+                state.failed = true;
+                return false;
+            default:
+                return runFindCommand(program.command(op.index), entry.path, output);
+        }
+    }
+
+    // Runs one -exec command with every {} replaced by `path`. Its output is
+    // captured so it lands in walk order. True if the command exited with 0.
+    bool runFindCommand(const std::vector<std::string>& command, const std::string& path, std::string& output) {
+        std::vector<std::string> words;
+        for (const std::string& word : command) {
+            std::string& expanded = words.emplace_back();
+            size_t start = 0;
+            for (size_t brace; (brace = word.find("{}", start)) != std::string::npos; start = brace + 2) {
+                expanded.append(word, start, brace - start);
+                expanded += path;
+            }
+            expanded.append(word, start, std::string::npos);
+        }
+
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) != 0) {
+            output += "Error: cannot create pipe: " + std::string(std::strerror(errno)) + "\n";
+            return false;
+        }
+        FileDescriptor readEnd(fds[0]);
+        FileDescriptor writeEnd(fds[1]);
+        int status = 0;
+        pid_t pid = spawnExternal(Arguments(words.begin(), words.end()), activeInputFd(), writeEnd.get(), -1, status, nullptr);
+        writeEnd.reset();
+        if (pid < 0) {
+            return false;
+        }
+
+        char buffer[4096];
+        while (true) {
+            ssize_t n = ::read(readEnd.get(), buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            output.append(buffer, n);
+        }
+        return waitForChild(pid) == 0;
+    }
+
+    void displayFindHelp() {
+        out() << "Usage: find [path...] [expression]" << '\n';
+        out() << "Tests:" << '\n';
+        out() << "  -name PATTERN     File name matches the glob PATTERN" << '\n';
+        out() << "  -path PATTERN     Whole path matches PATTERN; '/' is not special" << '\n';
+        out() << "  -type f,d,l,...   File type: f, d, l, b, c, p or s" << '\n';
+        out() << "  -size [+-]N[ckMG] Size in units (default 512-byte blocks), rounded up" << '\n';
+        out() << "  -mtime [+-]N      Modified N whole days ago" << '\n';
+        out() << "  -maxdepth N       Descend at most N levels below the paths" << '\n';
+        out() << "  -mindepth N       Do not act on entries less than N levels down" << '\n';
+        out() << "Actions:" << '\n';
+        out() << "  -print, -print0   Print the path, ending in a newline or NUL" << '\n';
+        out() << "  -delete           Remove the entry; directories after their contents" << '\n';
+        out() << "  -exec CMD {} \\;   Run CMD with {} replaced by the path" << '\n';
+        out() << "Operators: ( ), ! or -not, -a or -and (implied), -o or -or" << '\n';
+        out() << "Without an action, matching entries are printed." << '\n';
+    }
+
+    // du [-s] [-h] [-d depth] [path...]: space used by every directory
+    // below each path, in KiB, counting hard-linked files once
+    void diskUsage(const ParsedArguments& arguments) {
+        if (arguments.has(DuHelp)) {
+            out() << "Usage: du [options] [path]..." << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -s                Only show a total for each path" << '\n';
+            out() << "  -h                Sizes in human readable form (K, M, G)" << '\n';
+            out() << "  -d DEPTH          Only show directories up to DEPTH levels down" << '\n';
+            out() << "  --help            Display this help message" << '\n';
+            return;
+        }
+
+        size_t maxDepth = arguments.has(DuSummarize) ? 0 : SIZE_MAX;
+        if (arguments.has(DuMaxDepth)) {
+            std::string_view text = arguments.value(DuMaxDepth);
+            auto result = std::from_chars(text.data(), text.data() + text.size(), maxDepth);
+            if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+                out() << "du: invalid depth: " << text << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+        }
+
+        InodeSet seen;
+        std::vector<std::string> paths(arguments.operands.begin(), arguments.operands.end());
+        if (paths.empty()) {
+            paths.emplace_back(".");
+        }
+        for (size_t i = 0; i < paths.size() && !cancellationRequested(); ++i) {
+            measureDiskUsage(paths[i], seen, maxDepth, arguments.has(DuHuman));
+        }
+    }
+
+    // Each directory's visit writes a record of its own usage and of its
+    // hard-linked files. The records arrive in serial walk order, so the
+    // links are counted at their first name, as in a serial du, and a stack
+    // of the directories still open turns the records into subtree totals,
+    // printed children first, in memory bounded by the depth of the tree.
+    void measureDiskUsage(const std::string& root, InodeSet& seen, size_t maxDepth, bool human) {
+        constexpr unsigned int mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_BLOCKS;
+        OutputWriter& writer = out();
+        auto print = [&](uint64_t bytes, std::string_view path) {
+            writer << formatDiskUsage(bytes, human) << '\t' << path << '\n';
+        };
+
+        EntryMetadata metadata;
+        fetchEntryMetadata(AT_FDCWD, root.c_str(), mask, metadata);
+        if (metadata.error != 0) {
+            writer << "Error: cannot access " << root << ": " << std::strerror(metadata.error) << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        if (!S_ISDIR(metadata.stx.stx_mode)) {
+            bool counted = metadata.stx.stx_nlink <= 1 || seen.insert(InodeSet::deviceOf(metadata.stx), metadata.stx.stx_ino);
+            print(counted ? metadata.stx.stx_blocks * 512 : 0, root);
+            return;
+        }
+
+        // Followed by the path and `links` LinkedFiles
+        struct Record {
+            uint64_t bytes;
+            uint32_t depth;
+            uint32_t length;
+            uint64_t links;
+        };
+        struct LinkedFile {
+            uint64_t device;
+            uint64_t inode;
+            uint64_t bytes;
+        };
+        struct Open {
+            uint32_t depth;
+            uint64_t total;
+            std::string path;
+        };
+        std::vector<Open> open;
+        auto close = [&](uint32_t depth) {
+            while (!open.empty() && open.back().depth >= depth) {
+                Open done = std::move(open.back());
+                open.pop_back();
+                if (done.depth <= maxDepth) {
+                    print(done.total, done.path);
+                }
+                if (!open.empty()) {
+                    open.back().total += done.total;
+                }
+            }
+        };
+        auto sink = [&](std::string_view records) {
+            while (records.size() >= sizeof(Record)) {
+                Record record;
+                std::memcpy(&record, records.data(), sizeof(record));
+                records.remove_prefix(sizeof(record));
+                close(record.depth);
+                open.push_back(Open{record.depth, record.bytes, std::string(records.substr(0, record.length))});
+                records.remove_prefix(record.length);
+                for (uint64_t i = 0; i < record.links; ++i) {
+                    LinkedFile file;
+                    std::memcpy(&file, records.data(), sizeof(file));
+                    records.remove_prefix(sizeof(file));
+                    if (seen.insert(file.device, file.inode)) {
+                        open.back().total += file.bytes;
+                    }
+                }
+            }
+        };
+
+        std::mutex errorMutex;
+        std::vector<std::pair<std::string, int>> errors;
+        TreeWalker walker(defaultThreadCount(), mask);
+        walker.walk(root, sink, [&](TreeWalker::Directory& dir) {
+            Record record{0, static_cast<uint32_t>(dir.depth), static_cast<uint32_t>(dir.path.size()), 0};
+            struct stat st;
+            if (::fstat(dir.fd, &st) == 0) {
+                record.bytes += st.st_blocks * 512;
+            }
+            thread_local std::vector<LinkedFile> links;
+            links.clear();
+            for (size_t i = 0; i < dir.names.size(); ++i) {
+                const EntryMetadata& entry = dir.metadata[i];
+                if (entry.error != 0) {
+                    std::string path;
+                    dir.appendPath(i, path);
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    errors.emplace_back(std::move(path), entry.error);
+                } else if (dir.names.type(i) == DT_DIR) {
+                    continue;
+                } else if (entry.stx.stx_nlink > 1) {
+                    links.push_back(LinkedFile{InodeSet::deviceOf(entry.stx), entry.stx.stx_ino, entry.stx.stx_blocks * 512});
+                } else {
+                    record.bytes += entry.stx.stx_blocks * 512;
+                }
+            }
+
+            record.links = links.size();
+            dir.output.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            dir.output += dir.path;
+            dir.output.append(reinterpret_cast<const char*>(links.data()), links.size() * sizeof(LinkedFile));
+            for (size_t i = 0; i < dir.names.size(); ++i) {
+                if (dir.names.type(i) == DT_DIR) {
+                    dir.descend(i);
+                }
+            }
+        });
+        close(0);
+
+        std::sort(errors.begin(), errors.end());
+        for (const auto& error : errors) {
+            writer << "Error: cannot access " << error.first << ": " << std::strerror(error.second) << '\n';
+        }
+        for (const auto& error : walker.getErrors()) {
+            writer << "Error: " << error.first << ": " << error.second << '\n';
+        }
+        if (!errors.empty() || !walker.getErrors().empty()) {
+            builtinStatus() = 1;
+        }
+    }
+
+    // KiB rounded up, or with -h the largest unit that keeps the number
+    // below 1024, with one decimal under 10
+    static std::string formatDiskUsage(uint64_t bytes, bool human) {
+        if (!human) {
+            return std::to_string((bytes + 1023) / 1024);
+        }
+        static constexpr char units[] = "KMGTPE";
+        double value = static_cast<double>(bytes);
+        size_t unit = 0;
+        while (value >= 1024 && unit < std::size(units) - 1) {
+            value /= 1024;
+            ++unit;
+        }
+        if (unit == 0) {
+            return std::to_string(bytes);
+        }
+        char text[32];
+        if (std::ceil(value * 10) / 10 < 10) {
+            std::snprintf(text, sizeof(text), "%.1f%c", std::ceil(value * 10) / 10, units[unit - 1]);
+        } else {
+            std::snprintf(text, sizeof(text), "%.0f%c", std::ceil(value), units[unit - 1]);
+        }
+        return text;
+    }
+
+    void runExternal(const Arguments& tokens) {
+        int status = 0;
+        pid_t pid = spawnExternal(tokens, -1, -1, -1, status, nullptr);
+        lastStatus = pid > 0 ? waitForChild(pid) : status;
+    }
+
+    // Starts an external command with the given descriptors as its stdin,
+    // stdout and stderr (-1 inherits the shell's). A process of a background
+    // job joins the job's process group. Returns the child pid, or -1 after
+    // reporting the error and setting `status`.
+    pid_t spawnExternal(const Arguments& tokens, int inFd, int outFd, int errFd, int& status, Job* job) {
+        // Views into the input line are not NUL-terminated; exec needs copies
+        std::vector<std::string> arguments(tokens.begin(), tokens.end());
+        std::string program = commandPaths.lookup(arguments[0]);
+        if (program.empty()) {
+            out() << "Unknown command: " << tokens[0] << '\n';
+            status = 127;
+            return -1;
+        }
+
+        std::vector<char*> argv;
+        for (std::string& argument : arguments) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        ::posix_spawn_file_actions_init(&actions);
+        if (inFd >= 0) {
+            ::posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        }
+        if (outFd >= 0) {
+            ::posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+        }
+        if (errFd >= 0) {
+            ::posix_spawn_file_actions_adddup2(&actions, errFd, STDERR_FILENO);
+        }
+
+        // The shell ignores SIGPIPE; its children must not
+        posix_spawnattr_t attributes;
+        ::posix_spawnattr_init(&attributes);
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGPIPE);
+        ::posix_spawnattr_setsigdefault(&attributes, &defaults);
+        short flags = POSIX_SPAWN_SETSIGDEF;
+        if (job != nullptr) {
+            // Keystrokes meant for the foreground must not reach the job
+            ::posix_spawnattr_setpgroup(&attributes, jobs.processGroup(*job));
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        ::posix_spawnattr_setflags(&attributes, flags);
+
+        // Anything buffered must reach the terminal before the child writes
+        out().flush();
+
+        // posix_spawn uses clone(CLONE_VM | CLONE_VFORK), so the child shares
+        // our address space until exec instead of copying the page tables.
+        pid_t pid;
+        int error = ::posix_spawn(&pid, program.c_str(), &actions, &attributes, argv.data(), environ);
+        if (error == ENOENT && tokens[0].find('/') == std::string::npos) {
+            // The cached location went away; search $PATH again
+            commandPaths.forget(arguments[0]);
+            program = commandPaths.lookup(arguments[0]);
+            error = program.empty() ? ENOENT : ::posix_spawn(&pid, program.c_str(), &actions, &attributes, argv.data(), environ);
+        }
+        ::posix_spawnattr_destroy(&attributes);
+        ::posix_spawn_file_actions_destroy(&actions);
+
+        if (error != 0) {
+            out() << "Error: cannot execute " << tokens[0] << ": " << std::strerror(error) << '\n';
+            status = error == ENOENT ? 127 : 126;
+            return -1;
+        }
+        return pid;
+    }
+
+    void runPipeline() {
+        std::vector<const CommandNode*> stages;
+        for (size_t i = 0; i < parser.commandCount(); ++i) {
+            stages.push_back(&parser.command(i));
+        }
+        lastStatus = runStages(stages, nullptr);
+    }
+
+    // Runs all stages concurrently: external commands are spawned, builtins
+    // run on threads of this process with their output pointed at the pipe.
+    // In the foreground the last stage, if it is a builtin, runs on the
+    // calling thread, and the status of the last stage is returned once every
+    // stage is done. A background job reads /dev/null and hands its threads
+    // and processes to the job table instead of waiting.
+    int runStages(const std::vector<const CommandNode*>& stages, Job* job) {
+        size_t count = stages.size();
+        for (size_t i = 0; i < count; ++i) {
+            std::string_view name = stages[i]->argv[0];
+            if (!isBuiltin(name)) {
+                continue;
+            }
+            const char* problem = nullptr;
+            if (i + 1 < count && changesShellState(findBuiltin(name))) {
+                // It would run on a thread of its own, racing with the shell
+                problem = "cannot run in a pipeline except as its last command";
+            } else if (!stages[i]->errorFile.empty()) {
+                problem = "cannot redirect errors with 2>: builtins report errors on their output";
+            }
+            if (problem != nullptr) {
+                out() << name << ": " << problem << '\n';
+                if (job != nullptr) {
+                    jobs.launched(*job, 1);
+                }
+                return 1;
+            }
+        }
+
+        std::vector<FileDescriptor> inputs(count);
+        std::vector<FileDescriptor> outputs(count);
+        std::vector<FileDescriptor> errors(count);
+        std::vector<bool> ready(count, true);
+
+        for (size_t i = 0; i + 1 < count; ++i) {
+            int fds[2];
+            if (::pipe2(fds, O_CLOEXEC) != 0) {
+                out() << "Error: cannot create pipe: " << std::strerror(errno) << '\n';
+                if (job != nullptr) {
+                    jobs.launched(*job, 1);
+                }
+                return 1;
+            }
+            outputs[i].reset(fds[1]);
+            inputs[i + 1].reset(fds[0]);
+        }
+        if (job != nullptr) {
+            inputs[0].reset(::open("/dev/null", O_RDONLY | O_CLOEXEC));
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            ready[i] = openRedirections(*stages[i], inputs[i], outputs[i], errors[i]);
+        }
+
+        // Anything buffered must come out before the stages start writing
+        out().flush();
+
+        std::vector<pid_t> pids(count, -1);
+        std::vector<std::thread> threads;
+        int lastBuiltinStatus = 0;
+        int spawnStatus = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (!ready[i]) {
+                inputs[i].reset();
+                outputs[i].reset();
+                continue;
+            }
+            const Arguments& argv = stages[i]->argv;
+            bool last = i + 1 == count;
+            if (!isBuiltin(argv[0])) {
+                int errFd = errors[i].get();
+                if (stages[i]->errorToOutput) {
+                    errFd = outputs[i].get() >= 0 ? outputs[i].get() : STDOUT_FILENO;
+                }
+                pids[i] = spawnExternal(argv, inputs[i].get(), outputs[i].get(), errFd, spawnStatus, job);
+                if (job != nullptr && pids[i] > 0) {
+                    jobs.addProcess(*job, pids[i], last);
+                }
+                inputs[i].reset();
+                outputs[i].reset();
+                errors[i].reset();
+            } else if (job != nullptr) {
+                // Every builtin stage of a job gets a thread, and a writer of
+                // its own even when it prints to the terminal
+                jobs.startThread(*job, [this, job, &argv, last, in = std::move(inputs[i]), output = std::move(outputs[i])] {
+                    activeCancelFlag() = &job->cancelled;
+                    int status = runBuiltinStage(argv, in.get(), output.get() >= 0 ? output.get() : STDOUT_FILENO);
+                    jobs.threadFinished(*job, last, status);
+                });
+            } else if (!last) {
+                threads.emplace_back([this, &argv, in = std::move(inputs[i]), output = std::move(outputs[i])] {
+                    runBuiltinStage(argv, in.get(), output.get());
+                });
+            } else {
+                lastBuiltinStatus = runBuiltinStage(argv, inputs[i].get(), outputs[i].get());
+                inputs[i].reset();
+                outputs[i].reset();
+            }
+        }
+
+        // The pipeline's status is the status of its last stage
+        bool lastFailed = ready.back() && pids.back() < 0 && !isBuiltin(stages.back()->argv[0]);
+        if (job != nullptr) {
+            jobs.launched(*job, !ready.back() ? 1 : (lastFailed ? spawnStatus : 0));
+            return 0;
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        int status = ready.back() ? lastBuiltinStatus : 1;
+        if (lastFailed) {
+            status = spawnStatus;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (pids[i] > 0) {
+                int childStatus = waitForChild(pids[i]);
+                if (i + 1 == count) {
+                    status = childStatus;
+                }
+            }
+        }
+        return status;
+    }
+
+    bool openRedirections(const CommandNode& stage, FileDescriptor& input, FileDescriptor& output, FileDescriptor& error) {
+        auto openFile = [](std::string_view file, int flags, FileDescriptor& target) {
+            int fd = ::open(std::string(file).c_str(), flags | O_CLOEXEC, 0666);
+            if (fd < 0) {
+                out() << "Error: " << file << ": " << std::strerror(errno) << '\n';
+                return false;
+            }
+            target.reset(fd);
+            return true;
+        };
+
+        if (!stage.inputFile.empty() && !openFile(stage.inputFile, O_RDONLY, input)) {
+            return false;
+        }
+        if (!stage.outputFile.empty()
+            && !openFile(stage.outputFile, O_WRONLY | O_CREAT | (stage.append ? O_APPEND : O_TRUNC), output)) {
+            return false;
+        }
+        if (!stage.errorFile.empty() && !openFile(stage.errorFile, O_WRONLY | O_CREAT | O_TRUNC, error)) {
+            return false;
+        }
+        return true;
+    }
+
+    int runBuiltinStage(const Arguments& argv, int inFd, int outFd) {
+        StageRedirect redirect(inFd, outFd);
+        builtinStatus() = 0;
+        try {
+            runBuiltin(argv);
+        } catch (const std::exception& ex) {
+            out() << "Error: " << ex.what() << '\n';
+            builtinStatus() = 1;
+        }
+        return builtinStatus();
+    }
+
+    void concatenateFiles(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly)) {
+            out() << "Usage: cat [file ...]" << '\n';
+            out() << "Copy each file, or standard input when no file or - is given, to standard output." << '\n';
+            return;
+        }
+
+        Arguments files = arguments.operands;
+        if (files.empty()) {
+            files.push_back("-");
+        }
+
+        // Data bypasses the writer, so whatever it holds must go first
+        out().flush();
+        int outFd = out().fileDescriptor();
+        for (std::string_view file : files) {
+            FileDescriptor opened;
+            int inFd = activeInputFd();
+            if (file != "-") {
+                opened.reset(::open(std::string(file).c_str(), O_RDONLY | O_CLOEXEC));
+                if (opened.get() < 0) {
+                    out() << "cat: " << file << ": " << std::strerror(errno) << '\n';
+                    builtinStatus() = 1;
+                    continue;
+                }
+                inFd = opened.get();
+            }
+
+            int error = 0;
+            if (!transferData(inFd, outFd, error) && error != EPIPE) {
+                out() << "cat: " << file << ": " << std::strerror(error) << '\n';
+                builtinStatus() = 1;
+            }
+        }
+    }
+
+    int waitForChild(pid_t pid) {
+        int status = 0;
+        while (::waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                return 1;
+            }
+        }
+        if (WIFSIGNALED(status)) {
+            return 128 + WTERMSIG(status);
+        }
+        return WEXITSTATUS(status);
+    }
+
+    void hashCommand(const ParsedArguments& arguments) {
+        if (arguments.has(HashHelp)) {
+            out() << "Usage: hash [-r] [name ...]" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -r            Forget all remembered command locations" << '\n';
+            out() << "  name          Look up name on $PATH and remember it" << '\n';
+            return;
+        }
+
+        if (arguments.has(HashReset)) {
+            commandPaths.clear();
+        } else if (arguments.operands.empty()) {
+            auto entries = commandPaths.entries();
+            if (entries.empty()) {
+                out() << "hash: hash table empty" << '\n';
+            }
+            for (const auto& entry : entries) {
+                out() << entry.first << "\t" << entry.second << '\n';
+            }
+            return;
+        }
+
+        for (std::string_view name : arguments.operands) {
+            if (commandPaths.lookup(std::string(name)).empty()) {
+                out() << "hash: " << name << ": not found" << '\n';
+                builtinStatus() = 1;
+            }
+        }
+    }
+
+    void exportVariables(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly) || arguments.operands.empty()) {
+            out() << "Usage: export NAME=VALUE ..." << '\n';
+            return;
+        }
+
+        for (std::string_view assignment : arguments.operands) {
+            size_t equals = assignment.find('=');
+            if (equals == 0 || equals == std::string::npos) {
+                out() << "export: invalid assignment: " << assignment << '\n';
+                builtinStatus() = 1;
+                continue;
+            }
+            std::string name(assignment.substr(0, equals));
+            std::string value(assignment.substr(equals + 1));
+            ::setenv(name.c_str(), value.c_str(), 1);
+        }
+    }
+
+    // "time <pipeline>" is handled in executeCommand; this only runs for a
+    // bare "time" or "time --help"
+    void timeCommand(const ParsedArguments&) {
+        out() << "Usage: time <command> [| <command>]..." << '\n';
+        out() << "Runs the pipeline and reports its wall, user and system time, I/O," << '\n';
+        out() << "system calls, files touched, page faults and context switches." << '\n';
+    }
+
+    void statsCommand(const ParsedArguments& arguments) {
+        if (arguments.has(StatsHelp)) {
+            out() << "Usage: stats [-r] [on|off]" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  (none)        Print the recorded statistics as JSON" << '\n';
+            out() << "  on, off       Start or stop recording every command" << '\n';
+            out() << "  -r            Discard the recorded statistics" << '\n';
+            return;
+        }
+
+        if (arguments.has(StatsReset)) {
+            stats.reset();
+        } else if (arguments.operands.empty()) {
+            stats.writeJson(out());
+        }
+
+        for (std::string_view operand : arguments.operands) {
+            if (operand == "on") {
+                statsEnabled = true;
+            } else if (operand == "off") {
+                statsEnabled = false;
+            } else {
+                out() << "stats: expected on or off: " << operand << '\n';
+                builtinStatus() = 1;
+            }
+        }
+    }
+
+    void directoryCacheCommand(const ParsedArguments& arguments) {
+        if (arguments.has(DircacheHelp)) {
+            out() << "Usage: dircache [-r] [-m MB] [on|off]" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  (none)        Show whether the cache is on and how it is doing" << '\n';
+            out() << "  on, off       Cache ls listings, kept current with inotify" << '\n';
+            out() << "  -r            Drop all cached listings" << '\n';
+            out() << "  -m MB         Memory budget (default: 64)" << '\n';
+            return;
+        }
+
+        if (arguments.has(DircacheMemory)) {
+            size_t megabytes = 0;
+            std::string_view text = arguments.value(DircacheMemory);
+            auto result = std::from_chars(text.data(), text.data() + text.size(), megabytes);
+            if (result.ec != std::errc() || result.ptr != text.data() + text.size() || megabytes == 0) {
+                out() << "Invalid memory budget: " << text << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+            directoryCache.setBudget(megabytes << 20);
+        }
+        if (arguments.has(DircacheReset)) {
+            directoryCache.clear();
+        }
+
+        for (std::string_view operand : arguments.operands) {
+            if (operand == "on") {
+                if (int error = directoryCache.enable()) {
+                    out() << "dircache: cannot start inotify: " << std::strerror(error) << '\n';
+                    builtinStatus() = 1;
+                }
+            } else if (operand == "off") {
+                directoryCache.disable();
+            } else {
+                out() << "dircache: expected on or off: " << operand << '\n';
+                builtinStatus() = 1;
+            }
+        }
+
+        if (arguments.operands.empty() && !arguments.has(DircacheReset) && !arguments.has(DircacheMemory)) {
+            directoryCache.writeStatus(out());
+        }
+    }
+
+    void jobsCommand(const ParsedArguments& arguments) {
+        if (arguments.has(JobsHelp)) {
+            out() << "Usage: jobs [-l]" << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -l            Also list process ids" << '\n';
+            return;
+        }
+        jobs.list(out(), arguments.has(JobsLong));
+    }
+
+    void foregroundCommand(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly)) {
+            out() << "Usage: fg [%job]" << '\n';
+            out() << "Wait for a background job, continuing it first if it is stopped." << '\n';
+            return;
+        }
+
+        Job* job = findJob("fg", arguments.operands.empty() ? std::string_view() : arguments.operands[0]);
+        if (job == nullptr) {
+            return;
+        }
+        std::string error;
+        if (jobs.stopped(*job)) {
+            jobs.signal(*job, SIGCONT, error);
+        }
+        out() << job->command << '\n';
+        out().flush();
+
+        int status = jobs.wait(*job);
+        if (jobs.stopped(*job)) {
+            std::string line;
+            jobs.formatLine(*job, '+', false, line);
+            out() << line << '\n';
+        } else {
+            jobs.remove(*job);
+        }
+        builtinStatus() = status;
+    }
+
+    void backgroundCommand(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly)) {
+            out() << "Usage: bg [%job]" << '\n';
+            out() << "Continue a stopped background job." << '\n';
+            return;
+        }
+
+        Job* job = findJob("bg", arguments.operands.empty() ? std::string_view() : arguments.operands[0]);
+        if (job == nullptr) {
+            return;
+        }
+        if (!jobs.stopped(*job)) {
+            out() << "bg: job " << job->id << " is not stopped" << '\n';
+            return;
+        }
+        std::string error;
+        if (!jobs.signal(*job, SIGCONT, error)) {
+            out() << "bg: " << error << '\n';
+            builtinStatus() = 1;
+            return;
+        }
+        out() << "[" << job->id << "] " << job->command << " &" << '\n';
+    }
+
+    void waitCommand(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly)) {
+            out() << "Usage: wait [%job | pid]..." << '\n';
+            out() << "Wait for the given jobs, or for all of them, to finish." << '\n';
+            return;
+        }
+
+        std::vector<Job*> targets;
+        if (arguments.operands.empty()) {
+            targets = jobs.all();
+        }
+        for (std::string_view spec : arguments.operands) {
+            if (Job* job = jobs.find(spec)) {
+                targets.push_back(job);
+            } else {
+                out() << "wait: " << spec << ": no such job" << '\n';
+                builtinStatus() = 127;
+            }
+        }
+
+        for (Job* job : targets) {
+            int status = jobs.wait(*job);
+            if (!jobs.stopped(*job)) {
+                jobs.remove(*job);
+            }
+            if (!arguments.operands.empty() && builtinStatus() != 127) {
+                builtinStatus() = status;
+            }
+        }
+    }
+
+    void killCommand(const ParsedArguments& arguments) {
+        if (arguments.has(KillHelp) || (arguments.operands.empty() && !arguments.has(KillList))) {
+            out() << "Usage: kill [-s signal] %job | pid ..." << '\n';
+            out() << "Options:" << '\n';
+            out() << "  -s signal     Signal to send by name or number (default TERM)" << '\n';
+            out() << "  -l            List signal names" << '\n';
+            builtinStatus() = arguments.has(KillHelp) ? 0 : 1;
+            return;
+        }
+        if (arguments.has(KillList)) {
+            for (const SignalName& signal : signalNames) {
+                out() << signal.number << ") SIG" << signal.name << '\n';
+            }
+            return;
+        }
+
+        int signal = SIGTERM;
+        if (arguments.has(KillSignal)) {
+            signal = parseSignal(arguments.value(KillSignal));
+            if (signal < 0) {
+                out() << "kill: invalid signal: " << arguments.value(KillSignal) << '\n';
+                builtinStatus() = 1;
+                return;
+            }
+        }
+
+        for (std::string_view target : arguments.operands) {
+            std::string error;
+            if (target[0] == '%') {
+                Job* job = jobs.find(target);
+                if (job == nullptr) {
+                    error = "no such job";
+                } else {
+                    jobs.signal(*job, signal, error);
+                }
+            } else {
+                pid_t pid = 0;
+                auto result = std::from_chars(target.data(), target.data() + target.size(), pid);
+                if (result.ec != std::errc() || result.ptr != target.data() + target.size()) {
+                    error = "not a pid or job";
+                } else if (::kill(pid, signal) != 0) {
+                    error = std::strerror(errno);
+                }
+            }
+            if (!error.empty()) {
+                out() << "kill: " << target << ": " << error << '\n';
+                builtinStatus() = 1;
+            }
+        }
+    }
+
+    Job* findJob(std::string_view command, std::string_view spec) {
+        Job* job = jobs.find(spec);
+        if (job == nullptr) {
+            out() << command << ": " << (spec.empty() ? std::string_view("current") : spec) << ": no such job" << '\n';
+            builtinStatus() = 1;
+        }
+        return job;
+    }
+
+    void exitShell(const ParsedArguments& arguments) {
+        if (arguments.has(HelpOnly)) {
+            out() << "Usage: exit [status]" << '\n';
+            return;
+        }
+
+        int status = lastStatus;
+        if (!arguments.operands.empty()) {
+            std::string_view text = arguments.operands[0];
+            auto result = std::from_chars(text.data(), text.data() + text.size(), status);
+            if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+                out() << "exit: numeric argument required: " << text << '\n';
+                status = 2;
+            }
+        }
+        exitStatus = status & 0xff;
+        exitRequested = true;
+    }
+
+    struct BuiltinEntry {
+        void (Shell::*handler)(const ParsedArguments&);
+        // Null to pass every word through as an operand
+        const OptionSpec* options;
+        size_t optionCount;
+    };
+
+    static const BuiltinEntry builtinEntries[static_cast<size_t>(Builtin::Count)];
+
+    Parser parser;
+    CommandPathCache commandPaths;
+    int lastStatus = 0;
+    bool exitRequested = false;
+    int exitStatus = 0;
+    CommandStats stats;
+    DirectoryCache directoryCache;
+    bool statsEnabled = false;
+    bool statsAtExit = false;
+    std::string statsFile;
+    bool interactive = false;
+    // Last, so it is destroyed first: running builtin jobs use the members above
+    JobTable jobs;
+};
+
+// Handlers and option schemas, in Builtin order
+const Shell::BuiltinEntry Shell::builtinEntries[static_cast<size_t>(Builtin::Count)] = {
+    {&Shell::changeDirectory, cdOptionSpecs, std::size(cdOptionSpecs)},
+    {&Shell::listDirectory, lsOptionSpecs, std::size(lsOptionSpecs)},
+    {&Shell::moveFile, mvOptionSpecs, std::size(mvOptionSpecs)},
+    {&Shell::removeFile, rmOptionSpecs, std::size(rmOptionSpecs)},
+    {&Shell::copyFile, cpOptionSpecs, std::size(cpOptionSpecs)},
+    {&Shell::concatenateFiles, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::hashCommand, hashOptionSpecs, std::size(hashOptionSpecs)},
+    {&Shell::exportVariables, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::exitShell, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::timeCommand, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::statsCommand, statsOptionSpecs, std::size(statsOptionSpecs)},
+    {&Shell::directoryCacheCommand, dircacheOptionSpecs, std::size(dircacheOptionSpecs)},
+    {&Shell::jobsCommand, jobsOptionSpecs, std::size(jobsOptionSpecs)},
+    {&Shell::foregroundCommand, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::backgroundCommand, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::waitCommand, helpOnlyOptionSpecs, std::size(helpOnlyOptionSpecs)},
+    {&Shell::killCommand, killOptionSpecs, std::size(killOptionSpecs)},
+    {&Shell::findFiles, nullptr, 0},
+    {&Shell::diskUsage, duOptionSpecs, std::size(duOptionSpecs)},
+};
+
+#ifndef MYSHELL_NO_MAIN
+int main(int argc, char* argv[]) {
+    Shell myShell;
+    int first = 1;
+    if (argc > 1 && std::string_view(argv[1]).substr(0, 7) == "--stats") {
+        std::string_view flag = argv[1];
+        if (flag.size() > 7 && flag[7] != '=') {
+            out() << "Usage: " << argv[0] << " [--stats[=FILE]] [-c command | script]" << '\n';
+            return 2;
+        }
+        myShell.enableStats(flag.size() > 8 ? flag.substr(8) : std::string_view());
+        first = 2;
+    }
+
+    int status;
+    if (argc > first && std::string_view(argv[first]) == "-c") {
+        if (argc < first + 2) {
+            out() << "Usage: " << argv[0] << " [--stats[=FILE]] [-c command | script]" << '\n';
+            return 2;
+        }
+        status = myShell.runCommandString(argv[first + 1]);
+    } else if (argc > first) {
+        status = myShell.runScriptFile(argv[first]);
+    } else {
+        status = myShell.run();
+    }
+    myShell.writeStatsReport();
+    return status;
+}
+#endif
@@ -0,0 +1,348 @@
+// Behaviour tests for the parts of the shell that are pure logic and can be
+// checked without a file system: the ls entry sorter and the find expression
+// compiler. The cp --sync resume tests work in a scratch directory under
+// /tmp. Prints each failed check and exits with status 1 if any failed.
+//
+//   make test
+
+#define MYSHELL_NO_MAIN
+#include "myShell.cpp"
+
+#include <fstream>
+
+namespace {
+
+int checks = 0;
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    ++checks;
+    if (!condition) {
+        ++failures;
+        out() << "FAIL: " << what << '\n';
+    }
+}
+
+std::string join(const std::vector<std::string>& items) {
+    std::string text;
+    for (const std::string& item : items) {
+        text += (text.empty() ? "" : " ") + item;
+    }
+    return text;
+}
+
+// Sorts `names` and returns them in display order
+std::vector<std::string> sorted(const std::vector<std::string>& names, SortKey key,
+                                const std::vector<EntryMetadata>* metadata = nullptr, size_t threads = 1) {
+    NameArena arena;
+    for (const std::string& name : names) {
+        arena.add(name, DT_REG);
+    }
+    std::vector<std::string> result;
+    for (uint32_t index : EntrySorter::sort(arena, metadata, key, threads)) {
+        result.push_back(names[index]);
+    }
+    return result;
+}
+
+EntryMetadata metadataWith(int64_t size, int64_t seconds, int error = 0) {
+    EntryMetadata metadata{};
+    metadata.stx.stx_size = static_cast<uint64_t>(size);
+    metadata.stx.stx_mtime.tv_sec = seconds;
+    metadata.error = error;
+    return metadata;
+}
+
+void testNameOrder() {
+    check(join(sorted({"b", "a", "C", "_x", "a0"}, SortKey::Name)) == "C _x a a0 b", "name order is byte order in the C locale");
+    check(join(sorted({"b", "a", "c"}, SortKey::Unsorted)) == "b a c", "unsorted keeps directory order");
+    check(join(sorted({"only"}, SortKey::Name)) == "only", "a single name");
+}
+
+void testNaturalOrder() {
+    check(join(sorted({"file10", "file9", "file1", "a", "file100", "file2b", "file2a"}, SortKey::Natural))
+              == "a file1 file2a file2b file9 file10 file100",
+          "natural order compares digit runs by value");
+    // Equal values keep directory order, whichever comes first
+    check(join(sorted({"v07", "v7", "v007"}, SortKey::Natural)) == "v07 v7 v007", "equal numbers keep directory order");
+    check(join(sorted({"v7", "v07"}, SortKey::Natural)) == "v7 v07", "equal numbers keep directory order, reversed");
+    check(join(sorted({"x0", "x00", "x"}, SortKey::Natural)) == "x x0 x00", "zeros are a number too");
+    check(join(sorted({"1.10", "1.9", "1.2"}, SortKey::Natural)) == "1.2 1.9 1.10", "each digit run compares separately");
+    check(join(sorted({"12345678901234567890", "9"}, SortKey::Natural)) == "9 12345678901234567890",
+          "numbers wider than 64 bits");
+}
+
+void testExtensionOrder() {
+    check(join(sorted({"b.txt", "a.txt", "c.c", "README", ".hidden", "x.tar.gz"}, SortKey::Extension))
+              == ".hidden README c.c x.tar.gz a.txt b.txt",
+          "extension order, then name; hidden names without a dot have no extension");
+}
+
+void testSizeAndTimeOrder() {
+    std::vector<std::string> names = {"small", "big", "same1", "same2", "broken", "empty"};
+    std::vector<EntryMetadata> metadata = {metadataWith(10, 0), metadataWith(1 << 30, 0), metadataWith(500, 0),
+                                           metadataWith(500, 0), metadataWith(999, 0, ENOENT), metadataWith(0, 0)};
+    check(join(sorted(names, SortKey::Size, &metadata)) == "big same1 same2 small broken empty",
+          "size order is largest first, ties by name, unreadable entries as 0");
+
+    // Before 1970 sorts as older than after, not as a huge unsigned value
+    std::vector<std::string> times = {"epoch", "old", "new", "future"};
+    std::vector<EntryMetadata> stamps = {metadataWith(0, 0), metadataWith(0, -86400), metadataWith(0, 1700000000),
+                                         metadataWith(0, 4000000000LL)};
+    check(join(sorted(times, SortKey::Time, &stamps)) == "future new epoch old", "time order is newest first");
+
+    std::vector<EntryMetadata> nanos = {metadataWith(0, 5), metadataWith(0, 5), metadataWith(0, 5), metadataWith(0, 5)};
+    nanos[0].stx.stx_mtime.tv_nsec = 1;
+    nanos[2].stx.stx_mtime.tv_nsec = 2;
+    check(join(sorted(times, SortKey::Time, &nanos)) == "new epoch future old", "nanoseconds break ties");
+}
+
+// Large inputs go through the parallel merge; any run count must give the
+// same order as a plain stable sort
+void testParallelOrder() {
+    std::vector<std::string> names;
+    std::vector<EntryMetadata> metadata;
+    uint64_t state = 12345;
+    auto next = [&] {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state >> 33;
+    };
+    for (size_t i = 0; i < 100003; ++i) {
+        names.push_back("n" + std::to_string(next() % 50000) + (i % 3 == 0 ? ".c" : ".h"));
+        metadata.push_back(metadataWith(static_cast<int64_t>(next() % 1000), static_cast<int64_t>(next() % 100) - 50));
+    }
+
+    std::vector<std::string> byName = names;
+    std::stable_sort(byName.begin(), byName.end());
+    std::vector<size_t> bySize(names.size());
+    for (size_t i = 0; i < bySize.size(); ++i) {
+        bySize[i] = i;
+    }
+    std::stable_sort(bySize.begin(), bySize.end(), [&](size_t a, size_t b) {
+        if (metadata[a].stx.stx_size != metadata[b].stx.stx_size) {
+            return metadata[a].stx.stx_size > metadata[b].stx.stx_size;
+        }
+        return names[a] != names[b] ? names[a] < names[b] : a < b;
+    });
+    std::vector<std::string> expectedBySize;
+    for (size_t index : bySize) {
+        expectedBySize.push_back(names[index]);
+    }
+
+    for (size_t threads : {2, 3, 5, 7, 8}) {
+        std::string label = " with " + std::to_string(threads) + " threads";
+        check(sorted(names, SortKey::Name, nullptr, threads) == byName, "parallel name order" + label);
+        check(sorted(names, SortKey::Size, &metadata, threads) == expectedBySize, "parallel size order" + label);
+        check(sorted(names, SortKey::Natural, nullptr, threads) == sorted(names, SortKey::Natural),
+              "parallel natural order matches serial" + label);
+    }
+}
+
+// One entry for the find tests; `age` is in seconds before now
+struct FindEntry {
+    std::string name;
+    unsigned char type;
+    int64_t size;
+    int64_t age;
+    int error;
+};
+
+const std::vector<FindEntry> findEntries = {
+    {"a", DT_REG, 0, 0, 0},
+    {"b", DT_REG, 1024, 0, 0},
+    {"a.c", DT_REG, 1025, 3 * 86400, 0},
+    {"src", DT_DIR, 4096, 10 * 86400, 0},
+    {"link", DT_LNK, 0, 0, ENOENT},
+};
+
+// Compiles the space-separated `expression` and runs it on findEntries.
+// Returns the names -print printed, in order, or "error: " and the message.
+std::string printed(const std::string& expression) {
+    std::vector<std::string> words;
+    std::istringstream stream(expression);
+    for (std::string word; stream >> word;) {
+        words.push_back(word);
+    }
+    Arguments arguments(words.begin(), words.end());
+
+    FindProgram program;
+    std::string error;
+    if (!program.compile(arguments, error)) {
+        return "error: " + error;
+    }
+    std::vector<std::string> names;
+    auto act = [&](const FindProgram::Op& op, const FindProgram::Entry& entry) {
+        if (op.kind == FindProgram::OpKind::Print) {
+            names.emplace_back(entry.name);
+        }
+        return true;
+    };
+    for (const FindEntry& entry : findEntries) {
+        EntryMetadata metadata = metadataWith(entry.size, std::time(nullptr) - entry.age, entry.error);
+        program.run(FindProgram::Entry{AT_FDCWD, entry.name.c_str(), entry.name, entry.name, entry.type, metadata}, act);
+    }
+    return join(names);
+}
+
+void testFindImplicitPrint() {
+    check(printed("") == "a b a.c src link", "an empty expression prints everything");
+    check(printed("-name a*") == "a a.c", "a test alone is printed");
+    check(printed("-name a -o -name b") == "a b", "the implicit -print covers the whole -o");
+    check(printed("-name a -o -name b -print") == "b", "an explicit -print binds to its own operand");
+    check(printed("( -name a -o -name b ) -print") == "a b", "parentheses group -o under -print");
+    check(printed("-type d -false") == "", "a false expression prints nothing");
+}
+
+void testFindOperators() {
+    check(printed("-type f -name *.c -o -type d") == "a.c src", "-a binds tighter than -o");
+    check(printed("-type f -a -name *.c -or -type d") == "a.c src", "-a and -or spelled out");
+    check(printed("-name a -print -o -print") == "a b a.c src link", "-o skips its right operand after a true left one");
+    check(printed("-print -print") == "a a b b a.c a.c src src link link", "actions are true");
+    check(printed("-name x -print -o -name b -print") == "b", "a false left operand skips its own -print");
+    check(printed("! -name a*") == "b src link", "! negates a test");
+    check(printed("-not -type f") == "src link", "-not is !");
+    check(printed("! ! -name a") == "a", "! twice cancels");
+    check(printed("! ( -name a -o -type d )") == "b a.c link", "! negates a group");
+    check(printed("( ( -name b ) )") == "b", "nested parentheses");
+    check(printed("-type f ( -name a -o -name b ) -o -type l") == "a b link", "a group inside -a inside -o");
+    check(printed("-false -o -name src") == "src", "-false falls through -o");
+    check(printed("-type f,l") == "a b a.c link", "-type takes a list");
+    check(printed("-maxdepth 1 -name b") == "b", "-maxdepth is always true");
+}
+
+void testFindNumbers() {
+    check(printed("-size +1k") == "a.c src", "-size rounds up to whole units");
+    check(printed("-size 1k") == "b", "-size without a sign is exact");
+    check(printed("-size -1") == "a", "-size counts 512-byte blocks by default");
+    check(printed("-size -1025c") == "a b", "-size in bytes; unreadable entries never match");
+    check(printed("-mtime 0") == "a b", "-mtime 0 is the last day");
+    check(printed("-mtime +2") == "a.c src", "-mtime +N is more than N whole days");
+    check(printed("-mtime -4") == "a b a.c", "-mtime -N is fewer than N whole days");
+}
+
+void testFindErrors() {
+    check(printed("( -name a") == "error: missing ')'", "unmatched (");
+    check(printed("-name a )") == "error: unexpected ')'", "unmatched )");
+    check(printed("-name") == "error: missing argument to -name", "missing argument");
+    check(printed("-bogus") == "error: unknown predicate '-bogus'", "unknown predicate");
+    check(printed("-name a -o") == "error: expected an expression at the end", "dangling -o");
+    check(printed("!") == "error: expected an expression at the end", "dangling !");
+    check(printed("-type x") == "error: invalid argument 'x' to -type", "bad -type");
+    check(printed("-type f,") == "error: invalid argument 'f,' to -type", "trailing comma in -type");
+    check(printed("-size 1q") == "error: invalid argument '1q' to -size", "bad -size unit");
+    check(printed("-exec ls") == "error: -exec needs a command terminated by ';'", "unterminated -exec");
+}
+
+std::string readText(const std::string& path) {
+    std::ifstream stream(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+void writeText(const std::string& path, const std::string& text) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << text;
+}
+
+int64_t mtimeNanoseconds(const std::string& path) {
+    struct stat st;
+    ::stat(path.c_str(), &st);
+    return st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+}
+
+// Runs cp --sync from src to dst in `root`, resuming from the journal left
+// there; the journal is kept, as after a run with errors
+TreeSyncer& syncWithJournal(const std::string& root, std::unique_ptr<TreeSyncer>& syncer, size_t* resumed = nullptr) {
+    SyncJournal journal;
+    std::string error;
+    journal.open(root + "/dst.sync-journal", root + "/src", error);
+    if (resumed != nullptr) {
+        *resumed = journal.resumedDirectories();
+    }
+    syncer = std::make_unique<TreeSyncer>(2, false, ReflinkMode::Auto, &journal);
+    syncer->sync(root + "/src", root + "/dst");
+    return *syncer;
+}
+
+// A directory the journal has as in sync is still compared on the
+// destination side: a file changed there since is copied again
+void testSyncResumeDirectory(const std::string& root) {
+    fs::create_directories(root + "/src/A");
+    writeText(root + "/src/A/f", "original");
+    writeText(root + "/src/A/g", "other");
+    std::unique_ptr<TreeSyncer> syncer;
+    check(syncWithJournal(root, syncer).filesCopied() == 2, "first sync copies both files");
+
+    writeText(root + "/dst/A/f", "corrupted, and longer");
+    size_t resumed = 0;
+    TreeSyncer& again = syncWithJournal(root, syncer, &resumed);
+    check(resumed > 0, "the journal of the first run is resumed");
+    check(readText(root + "/dst/A/f") == "original", "a destination file changed since the journal is synced again");
+    check(again.filesCopied() == 1, "only the changed file is copied");
+}
+
+// A large-file checkpoint is trusted only while the destination is as the
+// interrupted run left it
+void testSyncResumeCheckpoint(const std::string& root) {
+    fs::create_directories(root + "/src");
+    fs::create_directories(root + "/dst");
+    std::string data(9 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 131 + (i >> 12));
+    }
+    writeText(root + "/src/big", data);
+    writeText(root + "/dst/big", std::string(data.size(), 'x'));
+
+    auto writeJournal = [&](int64_t destinationMtime) {
+        std::string journal = "myshell-sync 3 " + std::to_string(std::time(nullptr)) + " " + root + "/src";
+        journal += '\0';
+        journal += "B " + std::to_string(data.size()) + " " + std::to_string(data.size()) + " "
+                   + std::to_string(mtimeNanoseconds(root + "/src/big")) + " " + std::to_string(data.size()) + " "
+                   + std::to_string(destinationMtime) + " big";
+        journal += '\0';
+        writeText(root + "/dst.sync-journal", journal);
+    };
+
+    // Claims the whole file was done, but the destination changed since
+    writeJournal(mtimeNanoseconds(root + "/dst/big") + 1);
+    std::unique_ptr<TreeSyncer> syncer;
+    syncWithJournal(root, syncer);
+    check(syncer->bytesReused() == 0, "a checkpoint for a changed destination is ignored");
+    check(readText(root + "/dst/big") == data, "the file is compared from the start");
+
+    // Matching on both sides, the checkpoint is resumed
+    ::truncate((root + "/dst/big").c_str(), 0);
+    writeText(root + "/dst/big", std::string(data.size(), 'y'));
+    writeJournal(mtimeNanoseconds(root + "/dst/big"));
+    syncWithJournal(root, syncer);
+    check(syncer->bytesReused() == data.size(), "a checkpoint for an unchanged destination is resumed");
+}
+
+void testSyncResume() {
+    char scratch[] = "/tmp/myshell-test-XXXXXX";
+    if (::mkdtemp(scratch) == nullptr) {
+        check(false, "cannot create a scratch directory");
+        return;
+    }
+    testSyncResumeDirectory(std::string(scratch) + "/directory");
+    testSyncResumeCheckpoint(std::string(scratch) + "/checkpoint");
+    std::error_code ec;
+    fs::remove_all(scratch, ec);
+}
+
+} // namespace
+
+int main() {
+    testNameOrder();
+    testNaturalOrder();
+    testExtensionOrder();
+    testSizeAndTimeOrder();
+    testParallelOrder();
+    testFindImplicitPrint();
+    testFindOperators();
+    testFindNumbers();
+    testFindErrors();
+    testSyncResume();
+
+    out() << checks - failures << " of " << checks << " checks passed" << '\n';
+    out().flush();
+    return failures == 0 ? 0 : 1;
+}